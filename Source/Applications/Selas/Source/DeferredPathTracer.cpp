@@ -1,9 +1,9 @@
-
 //=================================================================================================================================
 // Joe Schutte
 //=================================================================================================================================
 
 #include "PathTracer.h"
+#include "RenderSettings.h"
 #include "SceneLib/SceneResource.h"
 #include "SceneLib/GeometryCache.h"
 #include "Shading/SurfaceScattering.h"
@@ -12,6 +12,7 @@
 #include "Shading/IntegratorContexts.h"
 #include "Shading/AreaLighting.h"
 #include "Shading/PathTracingBatcher.h"
+#include "Shading/RayBatchTraversal.h"
 #include "GeometryLib/Camera.h"
 #include "GeometryLib/Ray.h"
 #include "MathLib/FloatFuncs.h"
@@ -19,6 +20,10 @@
 #include "MathLib/Trigonometric.h"
 #include "MathLib/ImportanceSampling.h"
 #include "MathLib/Random.h"
+#include "UtilityLib/RadixSort.h"
+#include "StringLib/FixedString.h"
+#include "StringLib/StringUtil.h"
+#include "IoLib/Environment.h"
 #include "ThreadingLib/Thread.h"
 #include "SystemLib/OSThreading.h"
 #include "SystemLib/Atomic.h"
@@ -27,18 +32,13 @@
 #include "SystemLib/BasicTypes.h"
 #include "SystemLib/MinMax.h"
 #include "SystemLib/SystemTime.h"
+#include "SystemLib/Profiling.h"
 #include "SystemLib/Logging.h"
 #include "SystemLib/CountOf.h"
 
 #include "embree3/rtcore.h"
 #include "embree3/rtcore_ray.h"
 
-#define RayBatchSize_         4 Mb_
-#define HitBatchSize_         2 Mb_
-
-#define WorkerThreadCount_    9
-#define SamplesPerPixelX_     4
-#define SamplesPerPixelY_     4
 #define OutputLayers_         1
 
 namespace Selas
@@ -55,234 +55,326 @@ namespace Selas
             const SceneResource*         scene;
             GeometryCache*               geometryCache;
             TextureCache*                textureCache;
+            uint                         samplesPerPixelX;
+            uint                         samplesPerPixelY;
+            uint                         pass;
+            TraversalMode                traversalMode;
+            bool                         benchmarkTraversal;
+            TraversalTimings             traversalTimings;
+            volatile int64               tracedRayCount;
+            volatile int64               occlusionRayCount;
+            volatile int64               shadedHitCount;
+            volatile int64               shadedBatchCount;
+            volatile int64               filterRebindCount;
         };
 
         //=========================================================================================================================
-        static void ShadeHitPosition(GIIntegratorContext* __restrict context, PathTracingBatcher* ptBatcher,
-                                     const HitParameters& hit, const SurfaceParameters& surface)
+        static void AddDirectLightingRay(BatchWriter* batchWriter, const HitParameters& hit, const SurfaceParameters& surface,
+                                         const LightDirectSample& lightSample, float3 reflectance, float weight)
         {
+            float3 sample = weight * reflectance * lightSample.radiance * (1.0f / lightSample.pdfW);
+            if(Dot(sample, float3::One_) > 0) {
+                float3 offset = OffsetRayOrigin(surface, lightSample.direction, 0.1f);
+
+                OcclusionRay occlusionRay;
+                occlusionRay.ray = MakeRay(offset, lightSample.direction);
+                occlusionRay.distance = lightSample.distance;
+                occlusionRay.index = hit.index;
+                occlusionRay.value = sample * hit.throughput;
+                BatchWriter_AddOcclusionRay(batchWriter, occlusionRay);
+            }
+        }
 
+        //=========================================================================================================================
+        static void AddBounceRay(GIIntegratorContext* __restrict context, BatchWriter* batchWriter, const HitParameters& hit,
+                                 const SurfaceParameters& surface)
+        {
+            // - sample the bsdf
+            BsdfSample bsdfSample;
+            if(SampleBsdfFunction(&context->sampler, surface, hit.view, bsdfSample) == false) {
+                return;
+            }
 
-            // -- choose a light and sample the light source
-            LightDirectSample lightSample;
-            NextEventEstimation(context, surface.lightSetIndex, hit.position, GeometricNormal(surface), lightSample);
-            if(Dot(lightSample.radiance, float3::One_) > 0) {
-                float forwardPdfW;
-                float reversePdfW;
-                float3 reflectance = EvaluateBsdf(surface, hit.view, lightSample.direction, forwardPdfW,
-                                                  reversePdfW);
-
-                float weight = 1.0f;// ImportanceSampling::BalanceHeuristic(1, lightSample.pdfW, 1, forwardPdfW);
+            float skyPdfW = BackgroundLightingPdf(context, bsdfSample.wi);
+            float misWeight = ImportanceSampling::BalanceHeuristic(1, bsdfSample.forwardPdfW, 1, skyPdfW);
 
-                float3 sample = weight * reflectance * lightSample.radiance * (1.0f / lightSample.pdfW);
-                if(Dot(sample, float3::One_) > 0) {
-                    float3 offset = OffsetRayOrigin(surface, lightSample.direction, 0.1f);
+            float3 throughput = misWeight * hit.throughput * bsdfSample.reflectance;
+            if(LengthSquared(throughput) == 0.0f) {
+                return;
+            }
 
-                    OcclusionRay occlusionRay;
-                    occlusionRay.ray = MakeRay(offset, lightSample.direction);
-                    occlusionRay.distance = lightSample.distance;
-                    occlusionRay.index = hit.index;
-                    occlusionRay.value = sample * hit.throughput;
-                    ptBatcher->AddUnsortedOcclusionRay(occlusionRay);
+            // --Russian roulette path termination
+            if(hit.trackedBounces >= MaxTrackedBounces_) {
+                float continuationProb = Max<float>(Max<float>(throughput.x, throughput.y), throughput.z);
+                if(context->sampler.UniformFloat() >= continuationProb) {
+                    return;
                 }
+                Assert_(continuationProb > 0.0f);
+                throughput = throughput * (1.0f / continuationProb);
             }
 
-            LightDirectSample skySample;
-            SampleBackground(context, skySample);
-            if(Dot(skySample.radiance, float3::One_) > 0) {
-                float forwardPdfW;
-                float reversePdfW;
-                float3 reflectance = EvaluateBsdf(surface, hit.view, skySample.direction, forwardPdfW, reversePdfW);
-
-                float misWeight = ImportanceSampling::BalanceHeuristic(1, skySample.pdfW, 1, forwardPdfW);
-
-                float3 sample = misWeight * reflectance * skySample.radiance * (1.0f / skySample.pdfW);
-                if(Dot(sample, float3::One_) > 0) {
-                    float3 offset = OffsetRayOrigin(surface, skySample.direction, 0.1f);
-
-                    OcclusionRay occlusionRay;
-                    occlusionRay.ray = MakeRay(offset, skySample.direction);
-                    occlusionRay.distance = skySample.distance;
-                    occlusionRay.index = hit.index;
-                    occlusionRay.value = sample * hit.throughput;
-                    ptBatcher->AddUnsortedOcclusionRay(occlusionRay);
-                }
+            float3 offsetOrigin = OffsetRayOrigin(surface, bsdfSample.wi, 1.0f);
+
+            DeferredRay bounceRay;
+            bounceRay.error = hit.error;
+            bounceRay.index = hit.index;
+            bounceRay.diracScatterOnly = hit.diracScatterOnly && bsdfSample.flags & SurfaceEventFlags::eDiracEvent;
+            bounceRay.ray = MakeRay(offsetOrigin, bsdfSample.wi);
+            bounceRay.throughput = throughput;
+            bounceRay.trackedBounces = Min<uint32>(MaxTrackedBounces_, hit.trackedBounces + 1);
+            BatchWriter_AddDeferredRay(batchWriter, bounceRay);
+        }
+
+        //=========================================================================================================================
+        static void ShadeHitPack(GIIntegratorContext* __restrict context, BatchWriter* batchWriter,
+                                 const HitParameters* hits, const SurfaceParameters* surfaces, uint count)
+        {
+            Assert_(count <= SurfacePackLaneCount_);
+
+            LightDirectSample lightSamples[SurfacePackLaneCount_];
+            LightDirectSample skySamples[SurfacePackLaneCount_];
+            float3 views[SurfacePackLaneCount_];
+            float3 lightDirections[SurfacePackLaneCount_];
+            float3 skyDirections[SurfacePackLaneCount_];
+
+            // -- choose a light and sample the light source and the sky for every hit before evaluating any bsdf so all of the
+            // -- evaluations go through EvaluateBsdfBatch. Lanes without radiance evaluate the view direction and are ignored.
+            for(uint lane = 0; lane < count; ++lane) {
+                const HitParameters& hit = hits[lane];
+                const SurfaceParameters& surface = surfaces[lane];
+
+                NextEventEstimation(context, surface.lightSetIndex, hit.position, GeometricNormal(surface), lightSamples[lane]);
+                SampleBackground(context, skySamples[lane]);
+
+                bool hasLight = Dot(lightSamples[lane].radiance, float3::One_) > 0;
+                bool hasSky = Dot(skySamples[lane].radiance, float3::One_) > 0;
+
+                views[lane] = hit.view;
+                lightDirections[lane] = hasLight ? lightSamples[lane].direction : hit.view;
+                skyDirections[lane] = hasSky ? skySamples[lane].direction : hit.view;
             }
 
-            {
-                // - sample the bsdf
-                BsdfSample bsdfSample;
-                if(SampleBsdfFunction(&context->sampler, surface, hit.view, bsdfSample) == false) {
-                    return;
-                }
+            float3 lightReflectance[SurfacePackLaneCount_];
+            float3 skyReflectance[SurfacePackLaneCount_];
+            float lightForwardPdfW[SurfacePackLaneCount_];
+            float lightReversePdfW[SurfacePackLaneCount_];
+            float skyForwardPdfW[SurfacePackLaneCount_];
+            float skyReversePdfW[SurfacePackLaneCount_];
 
-                float skyPdfW = BackgroundLightingPdf(context, bsdfSample.wi);
-                float misWeight = ImportanceSampling::BalanceHeuristic(1, bsdfSample.forwardPdfW, 1, skyPdfW);
+            EvaluateBsdfBatch(surfaces, views, lightDirections, count, lightReflectance, lightForwardPdfW, lightReversePdfW);
+            EvaluateBsdfBatch(surfaces, views, skyDirections, count, skyReflectance, skyForwardPdfW, skyReversePdfW);
 
-                float3 throughput = misWeight * hit.throughput * bsdfSample.reflectance;
-                if(LengthSquared(throughput) == 0.0f) {
-                    return;
+            for(uint lane = 0; lane < count; ++lane) {
+                const HitParameters& hit = hits[lane];
+                const SurfaceParameters& surface = surfaces[lane];
+
+                if(Dot(lightSamples[lane].radiance, float3::One_) > 0) {
+                    float weight = 1.0f;// ImportanceSampling::BalanceHeuristic(1, lightSample.pdfW, 1, forwardPdfW);
+                    AddDirectLightingRay(batchWriter, hit, surface, lightSamples[lane], lightReflectance[lane], weight);
                 }
 
-                // --Russian roulette path termination
-                if(hit.trackedBounces >= MaxTrackedBounces_) {
-                    float continuationProb = Max<float>(Max<float>(throughput.x, throughput.y), throughput.z);
-                    if(context->sampler.UniformFloat() >= continuationProb) {
-                        return;
-                    }
-                    Assert_(continuationProb > 0.0f);
-                    throughput = throughput * (1.0f / continuationProb);
+                if(Dot(skySamples[lane].radiance, float3::One_) > 0) {
+                    float misWeight = ImportanceSampling::BalanceHeuristic(1, skySamples[lane].pdfW, 1, skyForwardPdfW[lane]);
+                    AddDirectLightingRay(batchWriter, hit, surface, skySamples[lane], skyReflectance[lane], misWeight);
                 }
 
-                float3 offsetOrigin = OffsetRayOrigin(surface, bsdfSample.wi, 1.0f);
+                AddBounceRay(context, batchWriter, hit, surface);
+            }
+        }
 
-                DeferredRay bounceRay;
-                bounceRay.error = hit.error;
-                bounceRay.index = hit.index;
-                bounceRay.diracScatterOnly = hit.diracScatterOnly && bsdfSample.flags & SurfaceEventFlags::eDiracEvent;
-                bounceRay.ray = MakeRay(offsetOrigin, bsdfSample.wi);
-                bounceRay.throughput = throughput;
-                bounceRay.trackedBounces = Min<uint32>(MaxTrackedBounces_, hit.trackedBounces + 1);
-                ptBatcher->AddUnsortedDeferredRay(bounceRay);
+        //=========================================================================================================================
+        static void ParkRay(KernelData* __restrict kernelData, const DeferredRaySoa& rays, uint scan, uint32 instId)
+        {
+            SubsceneResource* subscene = SubsceneFromInstanceId(kernelData->scene, instId);
+
+            DeferredRay ray;
+            ray.ray = MakeRay(float3(rays.originX[scan], rays.originY[scan], rays.originZ[scan]),
+                              float3(rays.directionX[scan], rays.directionY[scan], rays.directionZ[scan]));
+            ray.throughput = float3(rays.throughputX[scan], rays.throughputY[scan], rays.throughputZ[scan]);
+            ray.index = rays.index[scan];
+            ray.trackedBounces = rays.trackedBounces[scan];
+            ray.diracScatterOnly = rays.diracScatterOnly[scan];
+            ray.error = rays.error[scan];
+            kernelData->ptBatcher->ParkDeferredRays(subscene->cacheIndex, &ray, 1);
+
+            // -- The load may have finished after traversal gave up on the subscene but before the ray was parked. In that case
+            // -- the loaded callback has already run and won't see this ray.
+            if(subscene->geometryLoaded == 1) {
+                kernelData->ptBatcher->ResumeParkedRays(subscene->cacheIndex);
+            }
+            else {
+                // -- The subscene may also have been loaded and evicted again in that window, leaving nothing in flight to wake
+                // -- this ray. Requeue the load; this does nothing if the subscene is already loading.
+                kernelData->geometryCache->PrefetchSubsceneGeometry(subscene);
             }
         }
 
         //=========================================================================================================================
-        static void TraceRayBatch(GIIntegratorContext* __restrict context, PathTracingBatcher* ptBatcher,
-                                  DeferredRay* rays, uint rayCount)
+        static void ResumeParkedRays(void* userData, SubsceneResource* subscene)
         {
-            #define BatchSize_ 8
-            uint batchCount = (rayCount + BatchSize_ - 1) / BatchSize_;
+            PathTracingBatcher* ptBatcher = (PathTracingBatcher*)userData;
+            ptBatcher->ResumeParkedRays(subscene->cacheIndex);
+        }
+
+        //=========================================================================================================================
+        static void TraceRayBatch(GIIntegratorContext* __restrict context, KernelData* __restrict kernelData,
+                                  TraversalBuffers* traversal, BatchWriter* batchWriter, const DeferredRaySoa& rays)
+        {
+            ProfileScope_("TraceRayBatch");
 
             const float kErr = 32.0f * 1.19209e-07f;
 
-            for(uint batchScan = 0; batchScan < batchCount; ++batchScan) {
-                DeferredRay* startRay = rays + BatchSize_ * batchScan;
-
-                uint batchSize = Min<uint>(rayCount - batchScan * BatchSize_, BatchSize_);
-
-                RTCIntersectContext rtcContext;
-                rtcInitIntersectContext(&rtcContext);
-                rtcContext.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
-
-                Align_(64) int32 valid[BatchSize_];
-
-                Align_(64) RTCRayHit8 rayhit;
-                for(uint scan = 0; scan < batchSize; ++scan) {
-                    rayhit.ray.org_x[scan] = startRay[scan].ray.origin.x;
-                    rayhit.ray.org_y[scan] = startRay[scan].ray.origin.y;
-                    rayhit.ray.org_z[scan] = startRay[scan].ray.origin.z;
-                    rayhit.ray.dir_x[scan] = startRay[scan].ray.direction.x;
-                    rayhit.ray.dir_y[scan] = startRay[scan].ray.direction.y;
-                    rayhit.ray.dir_z[scan] = startRay[scan].ray.direction.z;
-                    rayhit.ray.tnear[scan] = 0.0f;
-                    rayhit.ray.tfar[scan] = FloatMax_;
-
-                    rayhit.hit.geomID[scan] = RTC_INVALID_GEOMETRY_ID;
-                    rayhit.hit.primID[scan] = RTC_INVALID_GEOMETRY_ID;
-                    rayhit.hit.instID[0][scan] = RTC_INVALID_GEOMETRY_ID;
-                    rayhit.hit.instID[1][scan] = RTC_INVALID_GEOMETRY_ID;
-                    valid[scan] = -1;
-                }
-                for(uint scan = batchSize; scan < BatchSize_; ++scan) {
-                    valid[scan] = 0;
-                }
+            // -- Rays that reach a subscene that is still streaming in are parked rather than stalling this thread.
+            SetDeferSubsceneLoads(true);
+            if(kernelData->benchmarkTraversal) {
+                BenchmarkRayBatchTraversal(context->scene, rays, traversal, &kernelData->traversalTimings);
+            }
+            else {
+                IntersectRayBatch(context->scene, kernelData->traversalMode, rays, traversal);
+            }
+            SetDeferSubsceneLoads(false);
 
-                rtcIntersect8(valid, context->rtcScene, &rtcContext, &rayhit);
+            for(uint scan = 0; scan < rays.count; ++scan) {
+                float3 direction = float3(rays.directionX[scan], rays.directionY[scan], rays.directionZ[scan]);
+                float3 throughput = float3(rays.throughputX[scan], rays.throughputY[scan], rays.throughputZ[scan]);
 
-                for(uint scan = 0; scan < BatchSize_; ++scan) {
+                if(traversal->geomId[scan] == DeferredSubsceneGeomId_) {
+                    ParkRay(kernelData, rays, scan, traversal->instId[0][scan]);
+                    continue;
+                }
+
+                if(traversal->geomId[scan] == RTC_INVALID_GEOMETRY_ID) {
                     float3 Ld[OutputLayers_];
                     Memory::Zero(Ld, sizeof(Ld));
 
-                    if(valid[scan] == 0 || rayhit.hit.geomID[scan] == RTC_INVALID_GEOMETRY_ID) {
-
-                        float3 sample;
-                        if(startRay[scan].diracScatterOnly)
-                            sample = EvaluateBackgroundMiss(context, startRay[scan].ray.direction);
-                        else
-                            sample = EvaluateBackground(context, startRay[scan].ray.direction);
+                    float3 sample;
+                    if(rays.diracScatterOnly[scan])
+                        sample = EvaluateBackgroundMiss(context, direction);
+                    else
+                        sample = EvaluateBackground(context, direction);
 
-                        Ld[0] += sample * startRay[scan].throughput;
-                        FramebufferWriter_Write(&context->frameWriter, Ld, OutputLayers_, startRay[scan].index);
-                        continue;
-                    }
-
-                    HitParameters hit;
-                    hit.position.x       = rayhit.ray.org_x[scan] + rayhit.ray.tfar[scan] * rayhit.ray.dir_x[scan];
-                    hit.position.y       = rayhit.ray.org_y[scan] + rayhit.ray.tfar[scan] * rayhit.ray.dir_y[scan];
-                    hit.position.z       = rayhit.ray.org_z[scan] + rayhit.ray.tfar[scan] * rayhit.ray.dir_z[scan];
-                    hit.normal           = float3(rayhit.hit.Ng_x[scan], rayhit.hit.Ng_y[scan], rayhit.hit.Ng_z[scan]);
-                    hit.view             = -startRay[scan].ray.direction;
-                    hit.error            = kErr * Max(Max(Math::Absf(hit.position.x), Math::Absf(hit.position.y)),
-                                                      Max(Math::Absf(hit.position.z), rayhit.ray.tfar[scan]));
-                    hit.baryCoords       = { rayhit.hit.u[scan], rayhit.hit.v[scan] };
-                    hit.geomId           = rayhit.hit.geomID[scan];
-                    hit.primId           = rayhit.hit.primID[scan];
-                    hit.instId[0]        = rayhit.hit.instID[0][scan];
-                    hit.instId[1]        = rayhit.hit.instID[1][scan];
-                    hit.index            = startRay[scan].index;
-                    hit.diracScatterOnly = startRay[scan].diracScatterOnly;
-                    hit.trackedBounces   = startRay[scan].trackedBounces;
-                    hit.throughput       = startRay[scan].throughput;
-
-                    ptBatcher->AddUnsortedHit(hit);
+                    Ld[0] += sample * throughput;
+                    FramebufferWriter_Write(&context->frameWriter, Ld, OutputLayers_, rays.index[scan]);
+                    continue;
                 }
+
+                float tfar = traversal->tfar[scan];
+
+                HitParameters hit;
+                hit.position.x       = rays.originX[scan] + tfar * direction.x;
+                hit.position.y       = rays.originY[scan] + tfar * direction.y;
+                hit.position.z       = rays.originZ[scan] + tfar * direction.z;
+                hit.normal           = float3(traversal->normalX[scan], traversal->normalY[scan], traversal->normalZ[scan]);
+                hit.view             = -direction;
+                hit.error            = kErr * Max(Max(Math::Absf(hit.position.x), Math::Absf(hit.position.y)),
+                                                  Max(Math::Absf(hit.position.z), tfar));
+                hit.baryCoords       = { traversal->u[scan], traversal->v[scan] };
+                hit.geomId           = traversal->geomId[scan];
+                hit.primId           = traversal->primId[scan];
+                hit.instId[0]        = traversal->instId[0][scan];
+                hit.instId[1]        = traversal->instId[1][scan];
+                hit.index            = rays.index[scan];
+                hit.diracScatterOnly = rays.diracScatterOnly[scan];
+                hit.trackedBounces   = rays.trackedBounces[scan];
+                hit.throughput       = throughput;
+
+                BatchWriter_AddHit(batchWriter, hit);
             }
         }
 
         //=========================================================================================================================
-        static void TraceOcclusionBatch(GIIntegratorContext* __restrict context, OcclusionRay* rays, uint rayCount)
+        static void TraceOcclusionBatch(GIIntegratorContext* __restrict context, KernelData* __restrict kernelData,
+                                        TraversalBuffers* traversal, const OcclusionRaySoa& rays)
         {
-            #define BatchSize_ 8
-            uint batchCount = (rayCount + BatchSize_ - 1) / BatchSize_;
+            ProfileScope_("TraceOcclusionBatch");
 
-            for(uint batchScan = 0; batchScan < batchCount; ++batchScan) {
-                OcclusionRay* startRay = rays + BatchSize_ * batchScan;
+            OccludeRayBatch(context->scene, kernelData->traversalMode, rays, traversal);
+
+            for(uint scan = 0; scan < rays.count; ++scan) {
+                if(traversal->tfar[scan] >= 0.0f) {
+
+                    float3 Ld[OutputLayers_];
+                    Memory::Zero(Ld, sizeof(Ld));
 
-                uint batchSize = Min<uint>(rayCount - batchScan * BatchSize_, BatchSize_);
+                    Ld[0] = float3(rays.valueX[scan], rays.valueY[scan], rays.valueZ[scan]);
+                    FramebufferWriter_Write(&context->frameWriter, Ld, OutputLayers_, rays.index[scan]);
+                }
+            }
+        }
 
-                RTCIntersectContext rtcContext;
-                rtcInitIntersectContext(&rtcContext);
-                rtcContext.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+        //=========================================================================================================================
+        static void SortHitsByTexture(GIIntegratorContext* __restrict context, HitParameters* hits, uint hitCount)
+        {
+            // -- Hits arrive ordered by instance, geometry and primitive. Reorder them by base color texture and then by Ptex
+            // -- face so each filter is bound once per batch and hits on the same face read the same tiles back to back.
+            if(hitCount < 2) {
+                return;
+            }
 
-                Align_(64) int32 valid[BatchSize_];
+            uint32* textureKeys = AllocArray_(uint32, hitCount);
+            uint64* values = AllocArrayAligned_(uint64, 2 * (uint64)hitCount, CacheLineSize_);
+            uint64* scratch = values + hitCount;
 
-                Align_(64) RTCRay8 ray;
-                for(uint scan = 0; scan < batchSize; ++scan) {
-                    ray.org_x[scan] = startRay[scan].ray.origin.x;
-                    ray.org_y[scan] = startRay[scan].ray.origin.y;
-                    ray.org_z[scan] = startRay[scan].ray.origin.z;
-                    ray.dir_x[scan] = startRay[scan].ray.direction.x;
-                    ray.dir_y[scan] = startRay[scan].ray.direction.y;
-                    ray.dir_z[scan] = startRay[scan].ray.direction.z;
-                    ray.tnear[scan] = 0.0f;
-                    ray.tfar[scan]  = startRay[scan].distance;
+            float4x4 localToWorld;
+            ModelGeometryUserData* modelData = nullptr;
+            for(uint scan = 0; scan < hitCount; ++scan) {
+                const HitParameters& hit = hits[scan];
 
-                    valid[scan] = -1;
+                bool modelDataChanged = (scan == 0) || (hits[scan - 1].geomId != hit.geomId);
+                for(uint level = 0; !modelDataChanged && level < MaxInstanceLevelCount_; ++level) {
+                    modelDataChanged = (hits[scan - 1].instId[level] != hit.instId[level]);
                 }
-                for(uint scan = batchSize; scan < BatchSize_; ++scan) {
-                    valid[scan] = 0;
+
+                if(modelDataChanged) {
+                    ModelDataFromRayIds(context->scene, hit.instId, hit.geomId, localToWorld, modelData);
                 }
 
-                rtcOccluded8(valid, context->rtcScene, &rtcContext, &ray);
+                // -- Only Ptex faces are worth interleaving across geometries. Everything else keeps its arrival order so hits
+                // -- on one geometry stay together and their surfaces can be built a pack at a time.
+                bool usesPtex = (modelData->material->flags & eUsesPtex) != 0;
+                textureKeys[scan] = modelData->baseColorTextureHandle.SortKey();
+                values[scan] = ((uint64)(usesPtex ? (uint32)hit.primId : 0) << 32) | scan;
+            }
 
-                for(uint scan = 0; scan < BatchSize_; ++scan) {
-                    if(valid[scan] == -1 && ray.tfar[scan] >= 0.0f) {
+            // -- Both sorts are stable so sorting by face and then by texture leaves hits grouped by texture then face.
+            ParallelRadixSort(values, scratch, hitCount, 32);
+            for(uint scan = 0; scan < hitCount; ++scan) {
+                uint64 index = values[scan] & 0xFFFFFFFF;
+                values[scan] = ((uint64)textureKeys[index] << 32) | index;
+            }
+            ParallelRadixSort(values, scratch, hitCount, 32);
 
-                        float3 Ld[OutputLayers_];
-                        Memory::Zero(Ld, sizeof(Ld));
+            for(uint scan = 0; scan < hitCount; ++scan) {
+                values[scan] &= 0xFFFFFFFF;
+            }
+            ApplyPermutation(hits, values, hitCount);
 
-                        Ld[0] = startRay[scan].value;
-                        FramebufferWriter_Write(&context->frameWriter, Ld, OutputLayers_, startRay[scan].index);
-                    }
+            FreeAligned_(values);
+            Free_(textureKeys);
+        }
+
+        //=========================================================================================================================
+        static bool SameGeometry(const HitParameters& a, const HitParameters& b)
+        {
+            if(a.geomId != b.geomId) {
+                return false;
+            }
+
+            for(uint level = 0; level < MaxInstanceLevelCount_; ++level) {
+                if(a.instId[level] != b.instId[level]) {
+                    return false;
                 }
             }
+
+            return true;
         }
 
         //=========================================================================================================================
-        static void ShadeHitBatch(GIIntegratorContext* __restrict context, PathTracingBatcher* ptBatcher,
-                                  HitParameters* hits, uint hitCount)
+        static int64 ShadeHitBatch(GIIntegratorContext* __restrict context, BatchWriter* batchWriter,
+                                   HitParameters* hits, uint hitCount)
         {
+            ProfileScope_("ShadeHitBatch");
+
             float4x4 localToWorld;
 
             ModelGeometryUserData* modelData = nullptr;
@@ -290,27 +382,26 @@ namespace Selas
             PtexTexture* texture = nullptr;
             Ptex::PtexFilter* filter = nullptr;
 
-            int32 geomId = RTC_INVALID_GEOMETRY_ID;
-            int32 instId[MaxInstanceLevelCount_];
-            for(uint scan = 0; scan < MaxInstanceLevelCount_; ++scan) {
-                instId[scan] = RTC_INVALID_GEOMETRY_ID;
-            }
-
             Ptex::PtexFilter::Options opts(Ptex::PtexFilter::FilterType::f_bspline);
 
-            for(uint scan = 0; scan < hitCount; ++scan) {
+            int64 filterRebindCount = 0;
 
-                const HitParameters& hit = hits[scan];
+            SortHitsByTexture(context, hits, hitCount);
+
+            SurfaceParameters surfaces[SurfacePackLaneCount_];
 
-                bool modelDataChanged = (geomId != hit.geomId);
-                for(uint scan = 0; !modelDataChanged && scan < MaxInstanceLevelCount_; ++scan) {
-                    modelDataChanged = (instId[scan] != hit.instId[scan]);
+            // -- Shade runs of hits on the same geometry a pack at a time so the model data lookup, subscene refcount and
+            // -- attribute interpolation are paid once per pack rather than once per hit.
+            uint runStart = 0;
+            while(runStart < hitCount) {
+                uint runEnd = runStart + 1;
+                while(runEnd < hitCount && runEnd - runStart < SurfacePackLaneCount_
+                      && SameGeometry(hits[runStart], hits[runEnd])) {
+                    ++runEnd;
                 }
 
-                if(modelDataChanged) {
-                    ModelDataFromRayIds(context->scene, hit.instId, hit.geomId, localToWorld, modelData);
-                    geomId = hit.geomId;
-                    Memory::Copy(instId, hit.instId, sizeof(hit.instId));
+                if(modelData == nullptr || SameGeometry(hits[runStart - 1], hits[runStart]) == false) {
+                    ModelDataFromRayIds(context->scene, hits[runStart].instId, hits[runStart].geomId, localToWorld, modelData);
                 }
 
                 if(modelData->baseColorTextureHandle != textureHandle) {
@@ -322,6 +413,7 @@ namespace Selas
                     if(modelData->baseColorTextureHandle.Valid()) {
                         texture = context->textureCache->FetchPtex(modelData->baseColorTextureHandle);
                         filter = Ptex::PtexFilter::getFilter(texture, opts);
+                        ++filterRebindCount;
                     }
                     else {
                         texture = nullptr;
@@ -331,23 +423,26 @@ namespace Selas
                     textureHandle = modelData->baseColorTextureHandle;
                 }
 
-                SurfaceParameters surface;
-                if(CalculateSurfaceParams(context, &hit, modelData, localToWorld, filter, surface) == false) {
-                    continue;
-                }
+                uint runCount = runEnd - runStart;
+                CalculateSurfaceParamsBatch(context, hits + runStart, runCount, modelData, localToWorld, filter, surfaces);
+                ShadeHitPack(context, batchWriter, hits + runStart, surfaces, runCount);
 
-                ShadeHitPosition(context, ptBatcher, hit, surface);
+                runStart = runEnd;
             }
 
             if(texture != nullptr) {
                 filter->release();
                 texture->release();
             }
+
+            return filterRebindCount;
         }
 
         //=========================================================================================================================
-        static void GeneratePrimaryRays(CSampler* sampler, KernelData* __restrict kernelData)
+        static void GeneratePrimaryRays(CSampler* sampler, KernelData* __restrict kernelData, BatchWriter* batchWriter)
         {
+            ProfileScope_("GeneratePrimaryRays");
+
             uint width = kernelData->camera->width;
             uint height = kernelData->camera->height;
 
@@ -362,21 +457,28 @@ namespace Selas
                 uint y = index / width;
                 uint x = index - (y * width);
 
-                uint sampleCount = SamplesPerPixelX_ * SamplesPerPixelY_;
+                uint samplesX = kernelData->samplesPerPixelX;
+                uint samplesY = kernelData->samplesPerPixelY;
+                uint sampleCount = samplesX * samplesY;
+
+                // -- Every pass needs its own jitter pattern or progressive passes would all trace the same rays.
+                int32 pattern = (int32)(uint32)(index + kernelData->pass * endIndex);
 
                 for(uint scan = 0; scan < sampleCount; ++scan) {
 
                     DeferredRay dr;
                     dr.ray              = JitteredCameraRay(kernelData->camera, (int32)x, (int32)y, (int32)scan,
-                                                            SamplesPerPixelX_, SamplesPerPixelY_, (int32)index);
+                                                            (int32)samplesX, (int32)samplesY, pattern);
                     dr.error            = 0.0f;
                     dr.index            = (uint32)(y * width + x);
                     dr.diracScatterOnly = 1;
                     dr.throughput       = float3::One_;
                     dr.trackedBounces   = 0;
-                    kernelData->ptBatcher->AddUnsortedDeferredRay(dr);
+                    BatchWriter_AddDeferredRay(batchWriter, dr);
                 }
             }
+
+            BatchWriter_Flush(batchWriter);
         }
 
         //=========================================================================================================================
@@ -396,48 +498,68 @@ namespace Selas
             context.maxPathLength = 1;
             FramebufferWriter_Initialize(&context.frameWriter, kernelData->frame);
 
-            GeneratePrimaryRays(&context.sampler, kernelData);
+            BatchWriter batchWriter;
+            BatchWriter_Initialize(&batchWriter, kernelData->ptBatcher);
+
+            TraversalBuffers traversal;
+            TraversalBuffers_Initialize(&traversal);
+
+            GeneratePrimaryRays(&context.sampler, kernelData, &batchWriter);
 
-            // JSTODO -- Change stop condition to be that this is empty and that all worker kernels report as idle
-            //        -- so no threads exit when they could be useful later.
-            while(kernelData->ptBatcher->Empty() == false) {
+            while(true) {
                 
-                DeferredRay* deferredRays;
-                OcclusionRay* occlusionRays;
+                DeferredRaySoa deferredRays;
+                OcclusionRaySoa occlusionRays;
                 HitParameters* hitParams;
-                uint rayCount;
                 uint hitCount;
 
                 if(kernelData->ptBatcher->GetSortedHits(hitParams, hitCount)) {
-                    ShadeHitBatch(&context, kernelData->ptBatcher, hitParams, hitCount);
+                    int64 filterRebindCount = ShadeHitBatch(&context, &batchWriter, hitParams, hitCount);
+                    BatchWriter_Flush(&batchWriter);
                     kernelData->ptBatcher->FreeHits(hitParams);
+
+                    Atomic::Add64(&kernelData->shadedHitCount, (int64)hitCount);
+                    Atomic::Increment64(&kernelData->shadedBatchCount);
+                    Atomic::Add64(&kernelData->filterRebindCount, filterRebindCount);
                 }
-                else if(kernelData->ptBatcher->GetSortedBatch(occlusionRays, rayCount)) {
-                    TraceOcclusionBatch(&context, occlusionRays, rayCount);
+                else if(kernelData->ptBatcher->GetSortedBatch(occlusionRays)) {
+                    TraceOcclusionBatch(&context, kernelData, &traversal, occlusionRays);
+                    Atomic::Add64(&kernelData->occlusionRayCount, (int64)occlusionRays.count);
                     kernelData->ptBatcher->FreeRays(occlusionRays);
                 }
-                else if(kernelData->ptBatcher->GetSortedBatch(deferredRays, rayCount)) {
-                    TraceRayBatch(&context, kernelData->ptBatcher, deferredRays, rayCount);
+                else if(kernelData->ptBatcher->GetSortedBatch(deferredRays)) {
+                    TraceRayBatch(&context, kernelData, &traversal, &batchWriter, deferredRays);
+                    Atomic::Add64(&kernelData->tracedRayCount, (int64)deferredRays.count);
+                    BatchWriter_Flush(&batchWriter);
                     kernelData->ptBatcher->FreeRays(deferredRays);
                 }
-                else {
-                    kernelData->ptBatcher->Flush();
+                else if(kernelData->ptBatcher->WaitForWork() == false) {
+                    break;
                 }
             }
 
+            TraversalBuffers_Shutdown(&traversal);
+            BatchWriter_Shutdown(&batchWriter);
             context.sampler.Shutdown();
             FramebufferWriter_Shutdown(&context.frameWriter);
         }
 
         //=========================================================================================================================
         void GenerateImage(GeometryCache* geometryCache, TextureCache* textureCache, SceneResource* scene,
-                           const RayCastCameraSettings& camera, cpointer imageName)
+                           const RayCastCameraSettings& camera, const RenderSettings& settings, cpointer imageName)
         {
+            uint threadCount = settings.additionalThreadCount;
+
             PathTracingBatcher ptBatcher;
-            ptBatcher.Initialize(RayBatchSize_, HitBatchSize_);
+            // -- The calling thread runs a kernel too.
+            // -- One parked ray queue per subscene registered with the geometry cache.
+            ptBatcher.Initialize(settings.rayBatchSize, settings.hitBatchSize, settings.residentBatchBudget, scene->aaBox,
+                                 threadCount + 1, (uint)scene->data->subsceneNames.Count());
+            geometryCache->SetLoadedCallback(ResumeParkedRays, &ptBatcher);
 
             Framebuffer frame;
-            FrameBuffer_Initialize(&frame, (uint32)camera.viewportWidth, (uint32)camera.viewportHeight, OutputLayers_);
+            FrameBuffer_Initialize(&frame, (uint32)camera.viewportWidth, (uint32)camera.viewportHeight, OutputLayers_,
+                                   settings.tileLockedFramebuffer ? eFramebufferTileLocks : 0);
 
             KernelData kernelData;
             kernelData.camera = &camera;
@@ -448,28 +570,123 @@ namespace Selas
             kernelData.geometryCache = geometryCache;
             kernelData.textureCache = textureCache;
             kernelData.scene = scene;
+            kernelData.samplesPerPixelX = settings.samplesPerPixelX;
+            kernelData.samplesPerPixelY = settings.samplesPerPixelY;
+            kernelData.pass = 0;
+            kernelData.traversalMode = settings.traversalMode;
+            kernelData.benchmarkTraversal = settings.benchmarkTraversal;
+            TraversalTimings_Initialize(&kernelData.traversalTimings);
+            kernelData.tracedRayCount = 0;
+            kernelData.occlusionRayCount = 0;
+            kernelData.shadedHitCount = 0;
+            kernelData.shadedBatchCount = 0;
+            kernelData.filterRebindCount = 0;
+
+            if(settings.profile) {
+                Profiler_Start();
+            }
+            auto renderTimer = SystemTime::Now();
+
+            uint samplesPerPass = settings.samplesPerPixelX * settings.samplesPerPixelY;
+            ThreadHandle* threadHandles = AllocArray_(ThreadHandle, Max<uint>(threadCount, 1));
+
+            // -- Snapshots between passes get their own name so a run that gets killed early never leaves a partial image behind
+            // -- under the final name.
+            FilePathString progressName;
+            FixedStringSprintf(progressName, "%s_progress", imageName);
 
-            #if WorkerThreadCount_ > 0
-                ThreadHandle threadHandles[WorkerThreadCount_];
+            uint passCount = 0;
+            while(true) {
+                kernelData.pass = passCount;
+                kernelData.pixelIndex = 0;
 
                 // -- fork threads
-                for(uint scan = 0; scan < WorkerThreadCount_; ++scan) {
+                for(uint scan = 0; scan < threadCount; ++scan) {
                     threadHandles[scan] = CreateThread(DeferredPathTracerKernel, &kernelData);
                 }
-            #endif
 
-            DeferredPathTracerKernel(&kernelData);
+                DeferredPathTracerKernel(&kernelData);
 
-            #if WorkerThreadCount_ > 0
-                for(uint scan = 0; scan < WorkerThreadCount_; ++scan) {
+                for(uint scan = 0; scan < threadCount; ++scan) {
                     ShutdownThread(threadHandles[scan]);
                 }
-            #endif
 
-            FrameBuffer_Scale(&frame, (1.0f / (SamplesPerPixelX_ * SamplesPerPixelY_)));
+                ++passCount;
+
+                // -- Stop if another pass would take us past the time budget. Passes all cost about the same so use the average.
+                float elapsedSeconds = SystemTime::ElapsedSecondsF(renderTimer);
+                bool passLimitReached = (settings.passCount != 0 && passCount >= settings.passCount);
+                bool budgetReached = (settings.timeBudgetSeconds > 0.0f)
+                                  && (elapsedSeconds + elapsedSeconds / passCount > settings.timeBudgetSeconds);
+                if(passLimitReached || budgetReached) {
+                    break;
+                }
+
+                WriteDebugInfo_("Pass %llu finished after %.2fs", passCount, elapsedSeconds);
+                FrameBuffer_Save(&frame, progressName.Ascii(), 1.0f / (passCount * samplesPerPass));
+
+                ptBatcher.ResetWork();
+            }
+            Free_(threadHandles);
+            geometryCache->SetLoadedCallback(nullptr, nullptr);
+
+            float renderSeconds = Max<float>(SystemTime::ElapsedSecondsF(renderTimer), 1e-6f);
+            Profiler_Stop();
+
+            WriteDebugInfo_("Rendered %llu passes at %llu samples per pixel each", passCount, samplesPerPass);
+            FrameBuffer_Scale(&frame, (1.0f / (passCount * samplesPerPass)));
             FrameBuffer_Save(&frame, imageName);
             FrameBuffer_Shutdown(&frame);
 
+            PathTracingBatcherStats batcherStats;
+            ptBatcher.Stats(batcherStats);
+            WriteDebugInfo_("Ray batches kept resident: %llu spilled to disk: %llu", batcherStats.residentBatchCount,
+                            batcherStats.spilledBatchCount);
+            WriteDebugInfo_("Ray batches prefetched: %llu loaded on a worker: %llu", batcherStats.prefetchedBatchCount,
+                            batcherStats.synchronousBatchCount);
+            WriteDebugInfo_("Batch spill bytes written: %llu read: %llu", batcherStats.spilledBytesWritten,
+                            batcherStats.spilledBytesRead);
+            WriteDebugInfo_("Rays parked waiting on subscene loads: %llu", batcherStats.parkedRayCount);
+
+            double raysPerSecond = (double)kernelData.tracedRayCount / renderSeconds;
+            double occlusionRaysPerSecond = (double)kernelData.occlusionRayCount / renderSeconds;
+            double hitsPerSecond = (double)kernelData.shadedHitCount / renderSeconds;
+            WriteDebugInfo_("Rays/sec: %.0f occlusion rays/sec: %.0f hits/sec: %.0f", raysPerSecond, occlusionRaysPerSecond,
+                            hitsPerSecond);
+
+            PtexCacheStats ptexStats;
+            textureCache->PtexStats(ptexStats);
+            WriteDebugInfo_("Hit batches shaded: %lld Ptex filter rebinds: %lld (%.2f per batch)", kernelData.shadedBatchCount,
+                            kernelData.filterRebindCount,
+                            (float)kernelData.filterRebindCount / Max<float>((float)kernelData.shadedBatchCount, 1.0f));
+            WriteDebugInfo_("Ptex files accessed: %llu file reopens: %llu block reads: %llu", ptexStats.filesAccessed,
+                            ptexStats.fileReopens, ptexStats.blockReads);
+
+            if(settings.benchmarkTraversal) {
+                TraversalTimings_Log(&kernelData.traversalTimings);
+            }
+
+            if(settings.profile) {
+                ProfilerCounter counters[] =
+                {
+                    { "renderSeconds",       renderSeconds },
+                    { "raysPerSecond",       raysPerSecond },
+                    { "occlusionRaysPerSec", occlusionRaysPerSecond },
+                    { "hitsPerSecond",       hitsPerSecond },
+                    { "spilledBytesWritten", (double)batcherStats.spilledBytesWritten },
+                    { "spilledBytesRead",    (double)batcherStats.spilledBytesRead }
+                };
+
+                FixedString128 root = Environment_Root();
+                FilePathString filepath;
+                FixedStringSprintf(filepath, "%s_Images%c%s_trace.json", root.Ascii(), StringUtil::PathSeperator(), imageName);
+
+                Error err = Profiler_WriteChromeTrace(filepath.Ascii(), counters, CountOf_(counters));
+                if(Failed_(err)) {
+                    WriteDebugInfo_("%s", err.Message());
+                }
+            }
+
             ptBatcher.Shutdown();
         }
     }
@@ -14,10 +14,11 @@ namespace Selas
     class TextureCache;
     struct SceneResource;
     struct RayCastCameraSettings;
+    struct RenderSettings;
 
     namespace DeferredPathTracer
     {
         void GenerateImage(GeometryCache* geometryCache, TextureCache* textureCache, SceneResource* scene,
-                           const RayCastCameraSettings& camera, cpointer imageName);
+                           const RayCastCameraSettings& camera, const RenderSettings& settings, cpointer imageName);
     }
 }
\ No newline at end of file
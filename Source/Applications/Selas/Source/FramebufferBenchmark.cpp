@@ -0,0 +1,124 @@
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#include "FramebufferBenchmark.h"
+#include "RenderSettings.h"
+#include "TextureLib/Framebuffer.h"
+#include "ThreadingLib/Thread.h"
+#include "MathLib/FloatStructs.h"
+#include "SystemLib/Atomic.h"
+#include "SystemLib/MemoryAllocation.h"
+#include "SystemLib/BasicTypes.h"
+#include "SystemLib/MinMax.h"
+#include "SystemLib/SystemTime.h"
+#include "SystemLib/Logging.h"
+
+#define BenchmarkWidth_            1024
+#define BenchmarkHeight_           429
+#define BenchmarkLayerCount_       2
+#define BenchmarkSamplesPerThread_ (4 * 1024 * 1024)
+#define BenchmarkCoherentRun_      256
+
+namespace Selas
+{
+    enum BenchmarkWritePattern
+    {
+        eScatteredWrites,
+        eCoherentWrites
+    };
+
+    struct FramebufferBenchmarkData
+    {
+        Framebuffer*          frame;
+        BenchmarkWritePattern pattern;
+        volatile int64        kernelIndices;
+    };
+
+    //=============================================================================================================================
+    static uint32 XorShift(uint32& state)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    //=============================================================================================================================
+    static void FramebufferBenchmarkKernel(void* userData)
+    {
+        FramebufferBenchmarkData* data = static_cast<FramebufferBenchmarkData*>(userData);
+        int64 kernelIndex = Atomic::Increment64(&data->kernelIndices);
+
+        uint32 pixelCount = data->frame->width * data->frame->height;
+        uint32 state = 0x9E3779B9u * (uint32)(kernelIndex + 1);
+
+        FramebufferWriter writer;
+        FramebufferWriter_Initialize(&writer, data->frame);
+
+        float3 samples[BenchmarkLayerCount_] = { float3(0.25f, 0.5f, 1.0f), float3(1.0f, 0.5f, 0.25f) };
+
+        uint32 pixel = 0;
+        for(uint scan = 0; scan < BenchmarkSamplesPerThread_; ++scan) {
+            if(data->pattern == eScatteredWrites || (scan % BenchmarkCoherentRun_) == 0) {
+                pixel = XorShift(state) % pixelCount;
+            }
+            else {
+                pixel = (pixel + 1) % pixelCount;
+            }
+
+            FramebufferWriter_Write(&writer, samples, BenchmarkLayerCount_, pixel);
+        }
+
+        FramebufferWriter_Shutdown(&writer);
+    }
+
+    //=============================================================================================================================
+    static void RunBenchmark(uint32 flags, BenchmarkWritePattern pattern, ThreadHandle* threadHandles, uint threadCount)
+    {
+        Framebuffer frame;
+        FrameBuffer_Initialize(&frame, BenchmarkWidth_, BenchmarkHeight_, BenchmarkLayerCount_, flags);
+
+        FramebufferBenchmarkData data;
+        data.frame         = &frame;
+        data.pattern       = pattern;
+        data.kernelIndices = 0;
+
+        auto timer = SystemTime::Now();
+
+        for(uint scan = 0; scan < threadCount; ++scan) {
+            threadHandles[scan] = CreateThread(FramebufferBenchmarkKernel, &data);
+        }
+
+        FramebufferBenchmarkKernel(&data);
+
+        for(uint scan = 0; scan < threadCount; ++scan) {
+            ShutdownThread(threadHandles[scan]);
+        }
+
+        float seconds = Max<float>(SystemTime::ElapsedSecondsF(timer), 1e-6f);
+        float sampleCount = (float)(threadCount + 1) * BenchmarkSamplesPerThread_;
+
+        WriteDebugInfo_("Framebuffer %s locks, %s writes: %.2f M samples/sec", (flags & eFramebufferTileLocks) ? "tile" : "global",
+                        pattern == eScatteredWrites ? "scattered" : "coherent", sampleCount / seconds * 1e-6f);
+
+        FrameBuffer_Shutdown(&frame);
+    }
+
+    //=============================================================================================================================
+    void BenchmarkFramebufferAccumulation(const RenderSettings& settings)
+    {
+        uint threadCount = settings.additionalThreadCount;
+        ThreadHandle* threadHandles = AllocArray_(ThreadHandle, Max<uint>(threadCount, 1));
+
+        WriteDebugInfo_("Benchmarking framebuffer accumulation on %u threads", (uint32)(threadCount + 1));
+
+        BenchmarkWritePattern patterns[] = { eScatteredWrites, eCoherentWrites };
+        for(uint scan = 0; scan < 2; ++scan) {
+            RunBenchmark(0, patterns[scan], threadHandles, threadCount);
+            RunBenchmark(eFramebufferTileLocks, patterns[scan], threadHandles, threadCount);
+        }
+
+        Free_(threadHandles);
+    }
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+namespace Selas
+{
+    struct RenderSettings;
+
+    // -- Writes synthetic samples from every thread through each framebuffer accumulation mode and logs samples/sec. Scattered
+    // -- writes land on random pixels like the deferred integrator's. Coherent writes walk short runs of pixels like the
+    // -- path tracer's.
+    void BenchmarkFramebufferAccumulation(const RenderSettings& settings);
+}
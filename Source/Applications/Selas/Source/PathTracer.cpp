@@ -4,6 +4,7 @@
 //=================================================================================================================================
 
 #include "PathTracer.h"
+#include "RenderSettings.h"
 #include "SceneLib/SceneResource.h"
 #include "SceneLib/GeometryCache.h"
 #include "Shading/SurfaceScattering.h"
@@ -41,10 +42,15 @@
 
 #define MaxBounceCount_         2048
 
-#define AdditionalThreadCount_  6
-#define PathsPerPixel_          16
 #define LayerCount_             2
 
+// -- Camera rays are traced as RTCRayHit8 packets. Everything after the first hit is incoherent and traced one ray at a time.
+#define PrimaryPacketWidth_     8
+
+// -- Threads claim whole screen tiles. Adaptive sampling also decides convergence per tile so a lucky pixel can't stop early on
+// -- its own.
+#define TileSize_               16
+
 namespace Selas
 {
     namespace PathTracer
@@ -57,10 +63,19 @@ namespace Selas
             SceneResource* scene;
             RayCastCameraSettings camera;
             uint pathsPerPixel;
+            uint samplesPerPixelX;
+            uint samplesPerPixelY;
+            // -- Picks the correlated multi-jittered pattern so each adaptive round takes new camera samples.
+            uint round;
             uint maxBounceCount;
             std::chrono::high_resolution_clock::time_point integrationStartTime;
 
-            volatile uint64* pixelIndex;
+            // -- Tiles to render this round in Morton order so neighbouring threads work on nearby geometry and textures. Each
+            // -- tile belongs to the thread that claimed it which writes its samples straight to the framebuffer.
+            volatile uint64* tileIndex;
+            const uint32* tiles;
+            uint64 tileCount;
+            uint32 tilesX;
             volatile int64* completedThreads;
             volatile int64* kernelIndices;
 
@@ -91,6 +106,82 @@ namespace Selas
             return (ray.tfar >= 0.0f);
         }
 
+        //=========================================================================================================================
+        struct PrimaryHit
+        {
+            HitParameters hit;
+            bool hasHit;
+        };
+
+        //=========================================================================================================================
+        static void MakeHitParameters(float3 origin, float3 direction, float tfar, float3 normal, float u, float v, uint32 geomId,
+                                      uint32 primId, uint32 instId0, uint32 instId1, HitParameters& hit)
+        {
+            hit.position = origin + tfar * direction;
+            hit.normal = normal;
+            hit.baryCoords = { u, v };
+            hit.geomId = geomId;
+            hit.primId = primId;
+            hit.instId[0] = instId0;
+            hit.instId[1] = instId1;
+            hit.view = -direction;
+
+            const float kErr = 32.0f * 1.19209e-07f;
+            hit.error = kErr * Max(Max(Math::Absf(hit.position.x), Math::Absf(hit.position.y)), Max(Math::Absf(hit.position.z),
+                                                                                                               tfar));
+        }
+
+        //=========================================================================================================================
+        static void PrimaryRayPacket(const RTCScene& rtcScene, const Ray* rays, uint count, PrimaryHit* hits)
+        {
+            Assert_(count <= PrimaryPacketWidth_);
+
+            RTCIntersectContext context;
+            rtcInitIntersectContext(&context);
+            context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+            Align_(32) int32 valid[PrimaryPacketWidth_];
+            Align_(32) RTCRayHit8 rayhit;
+
+            for(uint scan = 0; scan < PrimaryPacketWidth_; ++scan) {
+                // -- Pad the packet with copies of the first ray. They are masked off so Embree ignores them.
+                const Ray& ray = rays[scan < count ? scan : 0];
+                valid[scan] = scan < count ? -1 : 0;
+
+                rayhit.ray.org_x[scan] = ray.origin.x;
+                rayhit.ray.org_y[scan] = ray.origin.y;
+                rayhit.ray.org_z[scan] = ray.origin.z;
+                rayhit.ray.dir_x[scan] = ray.direction.x;
+                rayhit.ray.dir_y[scan] = ray.direction.y;
+                rayhit.ray.dir_z[scan] = ray.direction.z;
+                rayhit.ray.tnear[scan] = 0.0f;
+                rayhit.ray.tfar[scan]  = FloatMax_;
+                rayhit.ray.time[scan]  = 0.0f;
+                rayhit.ray.mask[scan]  = 0xFFFFFFFF;
+                rayhit.ray.id[scan]    = scan;
+                rayhit.ray.flags[scan] = 0;
+
+                rayhit.hit.geomID[scan]    = RTC_INVALID_GEOMETRY_ID;
+                rayhit.hit.primID[scan]    = RTC_INVALID_GEOMETRY_ID;
+                rayhit.hit.instID[0][scan] = RTC_INVALID_GEOMETRY_ID;
+                rayhit.hit.instID[1][scan] = RTC_INVALID_GEOMETRY_ID;
+            }
+
+            rtcIntersect8(valid, rtcScene, &context, &rayhit);
+
+            for(uint scan = 0; scan < count; ++scan) {
+                hits[scan].hasHit = (rayhit.hit.geomID[scan] != RTC_INVALID_GEOMETRY_ID);
+                if(hits[scan].hasHit == false) {
+                    continue;
+                }
+
+                MakeHitParameters(rays[scan].origin, rays[scan].direction, rayhit.ray.tfar[scan],
+                                  float3(rayhit.hit.Ng_x[scan], rayhit.hit.Ng_y[scan], rayhit.hit.Ng_z[scan]),
+                                  rayhit.hit.u[scan], rayhit.hit.v[scan], rayhit.hit.geomID[scan], rayhit.hit.primID[scan],
+                                  rayhit.hit.instID[0][scan], rayhit.hit.instID[1][scan], hits[scan].hit);
+            }
+        }
+
         //=========================================================================================================================
         static bool RayPick(const RTCScene& rtcScene, const Ray& ray, float tfar, HitParameters& hit)
         {
@@ -118,31 +209,18 @@ namespace Selas
             if(rayhit.hit.geomID == -1)
                 return false;
 
-            hit.position.x = rayhit.ray.org_x + rayhit.ray.tfar * ray.direction.x;
-            hit.position.y = rayhit.ray.org_y + rayhit.ray.tfar * ray.direction.y;
-            hit.position.z = rayhit.ray.org_z + rayhit.ray.tfar * ray.direction.z;
-            hit.normal.x = rayhit.hit.Ng_x;
-            hit.normal.y = rayhit.hit.Ng_y;
-            hit.normal.z = rayhit.hit.Ng_z;
-            hit.baryCoords = { rayhit.hit.u, rayhit.hit.v };
-            hit.geomId = rayhit.hit.geomID;
-            hit.primId = rayhit.hit.primID;
-            hit.instId[0] = rayhit.hit.instID[0];
-            hit.instId[1] = rayhit.hit.instID[1];
-            hit.view = -ray.direction;
-
-            const float kErr = 32.0f * 1.19209e-07f;
-            hit.error = kErr * Max(Max(Math::Absf(hit.position.x), Math::Absf(hit.position.y)), Max(Math::Absf(hit.position.z),
-                                                                                                               rayhit.ray.tfar));
+            MakeHitParameters(ray.origin, ray.direction, rayhit.ray.tfar,
+                              float3(rayhit.hit.Ng_x, rayhit.hit.Ng_y, rayhit.hit.Ng_z), rayhit.hit.u, rayhit.hit.v,
+                              rayhit.hit.geomID, rayhit.hit.primID, rayhit.hit.instID[0], rayhit.hit.instID[1], hit);
 
             return true;
         }
 
         //=========================================================================================================================
-        static void EvaluatePath(GIIntegratorContext* __restrict context, Ray ray, uint x, uint y)
+        static void EvaluatePath(GIIntegratorContext* __restrict context, Ray ray, const PrimaryHit& primary,
+                                 float3 Ld[LayerCount_])
         {
-            float3 Ld[LayerCount_];
-            Memory::Zero(Ld, sizeof(Ld));
+            Memory::Zero(Ld, sizeof(float3) * LayerCount_);
 
             float3 throughput = float3::One_;
 
@@ -159,8 +237,16 @@ namespace Selas
                 float pdf;
                 rayDistance = SampleDistance(&context->sampler, currentMedium, &pdf);
 
+                // -- Camera rays start in vacuum so the packet traced them with the same unbounded distance.
                 HitParameters hit;
-                bool rayCastHit = RayPick(context->rtcScene, ray, rayDistance, hit);
+                bool rayCastHit;
+                if(bounceCount == 0) {
+                    hit = primary.hit;
+                    rayCastHit = primary.hasHit;
+                }
+                else {
+                    rayCastHit = RayPick(context->rtcScene, ray, rayDistance, hit);
+                }
 
                 if(rayCastHit) {
                     rayDistance = Length(hit.position - ray.origin);
@@ -253,8 +339,33 @@ namespace Selas
                     throughput = throughput * (1.0f / continuationProb);
                 }
             }
+        }
+
+        //=========================================================================================================================
+        static void TileBounds(uint32 tile, uint32 tilesX, uint32 width, uint32 height,
+                               uint32& x0, uint32& y0, uint32& x1, uint32& y1)
+        {
+            uint32 tileY = tile / tilesX;
+            uint32 tileX = tile - tileY * tilesX;
 
-            FramebufferWriter_Write(&context->frameWriter, Ld, LayerCount_, (uint32)x, (uint32)y);
+            x0 = tileX * TileSize_;
+            y0 = tileY * TileSize_;
+            x1 = Min<uint32>(x0 + TileSize_, width);
+            y1 = Min<uint32>(y0 + TileSize_, height);
+        }
+
+        //=========================================================================================================================
+        static void ShadePrimaryPacket(GIIntegratorContext* context, Framebuffer* frame, const Ray* rays,
+                                       const uint32* pixelIndices, uint count)
+        {
+            PrimaryHit hits[PrimaryPacketWidth_];
+            PrimaryRayPacket(context->rtcScene, rays, count, hits);
+
+            for(uint scan = 0; scan < count; ++scan) {
+                float3 Ld[LayerCount_];
+                EvaluatePath(context, rays[scan], hits[scan], Ld);
+                FrameBuffer_AddSample(frame, pixelIndices[scan], Ld, LayerCount_);
+            }
         }
 
         //=========================================================================================================================
@@ -264,10 +375,14 @@ namespace Selas
             int64 kernelIndex = Atomic::Increment64(integratorContext->kernelIndices);
 
             uint pathsPerPixel = integratorContext->pathsPerPixel;
+            int32 samplesX = (int32)integratorContext->samplesPerPixelX;
+            int32 samplesY = (int32)integratorContext->samplesPerPixelY;
+
+            Framebuffer* frame = integratorContext->frame;
+            uint32 pixelCount = frame->width * frame->height;
 
-            uint width = integratorContext->camera.width;
-            uint height = integratorContext->camera.height;
-            uint64 totalPixelCount = width * height;
+            Ray rays[PrimaryPacketWidth_];
+            uint32 pixelIndices[PrimaryPacketWidth_];
 
             GIIntegratorContext context;
             context.geometryCache    = integratorContext->geometryCache;
@@ -277,37 +392,146 @@ namespace Selas
             context.camera           = &integratorContext->camera;
             context.sampler.Initialize((uint32)kernelIndex);
             context.maxPathLength    = integratorContext->maxBounceCount;
-            FramebufferWriter_Initialize(&context.frameWriter, integratorContext->frame);
 
-            while(*integratorContext->pixelIndex < totalPixelCount) {
+            while(true) {
+                uint64 workIndex = Atomic::AddU64(integratorContext->tileIndex, 1llu);
+                if(workIndex >= integratorContext->tileCount) {
+                    break;
+                }
 
-                uint64 pixelIndex = Atomic::AddU64(integratorContext->pixelIndex, 1llu) % totalPixelCount;
-                uint y = pixelIndex / width;
-                uint x = pixelIndex - y * width;
+                uint32 x0, y0, x1, y1;
+                TileBounds(integratorContext->tiles[workIndex], integratorContext->tilesX, frame->width, frame->height,
+                           x0, y0, x1, y1);
+
+                // -- Camera rays are generated in pixel order and traced a packet at a time before shading any of them.
+                uint packetCount = 0;
+                for(uint32 y = y0; y < y1; ++y) {
+                    for(uint32 x = x0; x < x1; ++x) {
+                        uint32 pixelIndex = y * frame->width + x;
+                        int32 pattern = (int32)(uint32)(pixelIndex + integratorContext->round * pixelCount);
+
+                        for(uint scan = 0; scan < pathsPerPixel; ++scan) {
+                            rays[packetCount] = JitteredCameraRay(context.camera, (int32)x, (int32)y, (int32)scan, samplesX,
+                                                                  samplesY, pattern);
+                            pixelIndices[packetCount] = pixelIndex;
+                            ++packetCount;
+
+                            if(packetCount == PrimaryPacketWidth_) {
+                                ShadePrimaryPacket(&context, frame, rays, pixelIndices, packetCount);
+                                packetCount = 0;
+                            }
+                        }
+                    }
+                }
 
-                for(uint scan = 0; scan < pathsPerPixel; ++scan) {
-                    Ray ray = JitteredCameraRay(context.camera, &context.sampler, (float)x, (float)y);
-                    EvaluatePath(&context, ray, x, y);
+                if(packetCount > 0) {
+                    ShadePrimaryPacket(&context, frame, rays, pixelIndices, packetCount);
                 }
             }
 
             context.sampler.Shutdown();
 
-            FramebufferWriter_Shutdown(&context.frameWriter);
             Atomic::Increment64(integratorContext->completedThreads);
         }
 
+        //=========================================================================================================================
+        static void RenderTiles(PathTracingKernelData* integratorContext, ThreadHandle* threadHandles, uint threadCount)
+        {
+            *integratorContext->tileIndex = 0;
+
+            // -- fork threads
+            for(uint scan = 0; scan < threadCount; ++scan) {
+                threadHandles[scan] = CreateThread(PathTracerKernel, integratorContext);
+            }
+
+            // -- do work on the main thread too
+            PathTracerKernel(integratorContext);
+
+            if(threadCount > 0) {
+                // -- wait for any other threads to finish
+                while(*integratorContext->completedThreads != *integratorContext->kernelIndices);
+
+                for(uint scan = 0; scan < threadCount; ++scan) {
+                    ShutdownThread(threadHandles[scan]);
+                }
+            }
+        }
+
+        //=========================================================================================================================
+        static uint32 CompactMortonBits(uint32 x)
+        {
+            x &= 0x55555555;
+            x = (x ^ (x >> 1)) & 0x33333333;
+            x = (x ^ (x >> 2)) & 0x0F0F0F0F;
+            x = (x ^ (x >> 4)) & 0x00FF00FF;
+            x = (x ^ (x >> 8)) & 0x0000FFFF;
+            return x;
+        }
+
+        //=========================================================================================================================
+        static uint32 BuildMortonTileOrder(uint32 tilesX, uint32 tilesY, uint32* tiles)
+        {
+            uint32 side = 1;
+            while(side < tilesX || side < tilesY) {
+                side <<= 1;
+            }
+
+            // -- Walk the Morton curve over the enclosing power of two square and skip the tiles that fall off the screen.
+            uint32 tileCount = 0;
+            for(uint32 code = 0, codeCount = side * side; code < codeCount; ++code) {
+                uint32 x = CompactMortonBits(code);
+                uint32 y = CompactMortonBits(code >> 1);
+                if(x < tilesX && y < tilesY) {
+                    tiles[tileCount++] = y * tilesX + x;
+                }
+            }
+
+            return tileCount;
+        }
+
+        //=========================================================================================================================
+        static uint64 CollectUnconvergedTiles(const Framebuffer* frame, float threshold, const uint32* tiles, uint64 tileCount,
+                                              uint32 tilesX, uint32* activeTiles, uint64& activePixelCount)
+        {
+            uint64 activeCount = 0;
+            activePixelCount = 0;
+
+            for(uint64 scan = 0; scan < tileCount; ++scan) {
+                uint32 x0, y0, x1, y1;
+                TileBounds(tiles[scan], tilesX, frame->width, frame->height, x0, y0, x1, y1);
+
+                if(FrameBuffer_RelativeVariance(frame, x0, y0, x1, y1) <= threshold) {
+                    continue;
+                }
+
+                activeTiles[activeCount++] = tiles[scan];
+                activePixelCount += (x1 - x0) * (y1 - y0);
+            }
+
+            return activeCount;
+        }
+
         //=========================================================================================================================
         void GenerateImage(GeometryCache* geometryCache, TextureCache* textureCache, SceneResource* scene,
-                           const RayCastCameraSettings& camera, cpointer imageName)
+                           const RayCastCameraSettings& camera, const RenderSettings& settings, cpointer imageName)
         {
+            uint threadCount = settings.additionalThreadCount;
+            uint pathsPerPixel = settings.samplesPerPixelX * settings.samplesPerPixelY;
+
+            bool adaptive = settings.adaptiveThreshold > 0.0f;
+
             Framebuffer frame;
-            FrameBuffer_Initialize(&frame, (uint32)camera.viewportWidth, (uint32)camera.viewportHeight, LayerCount_);
+            FrameBuffer_Initialize(&frame, (uint32)camera.viewportWidth, (uint32)camera.viewportHeight, LayerCount_,
+                                   adaptive ? eFramebufferTrackVariance : 0);
 
             int64 completedThreads = 0;
             int64 kernelIndex = 0;
-            //uint64 pixelIndex = 409600;
-            uint64 pixelIndex = 0;
+            uint64 tileIndex = 0;
+
+            uint32 tilesX = (frame.width + TileSize_ - 1) / TileSize_;
+            uint32 tilesY = (frame.height + TileSize_ - 1) / TileSize_;
+            uint32* tiles = AllocArray_(uint32, tilesX * tilesY);
+            uint32 tileCount = BuildMortonTileOrder(tilesX, tilesY, tiles);
 
             PathTracingKernelData integratorContext;
             integratorContext.geometryCache          = geometryCache;
@@ -315,35 +539,58 @@ namespace Selas
             integratorContext.scene                  = scene;
             integratorContext.camera                 = camera;
             integratorContext.maxBounceCount         = MaxBounceCount_;
-            integratorContext.pathsPerPixel          = PathsPerPixel_;
+            integratorContext.pathsPerPixel          = pathsPerPixel;
+            integratorContext.samplesPerPixelX       = settings.samplesPerPixelX;
+            integratorContext.samplesPerPixelY       = settings.samplesPerPixelY;
+            integratorContext.round                  = 0;
             integratorContext.integrationStartTime   = SystemTime::Now();
-            integratorContext.pixelIndex             = &pixelIndex;
+            integratorContext.tileIndex              = &tileIndex;
+            integratorContext.tiles                  = tiles;
+            integratorContext.tileCount              = tileCount;
+            integratorContext.tilesX                 = tilesX;
             integratorContext.completedThreads       = &completedThreads;
             integratorContext.kernelIndices          = &kernelIndex;
             integratorContext.frame                  = &frame;
 
-            #if AdditionalThreadCount_ > 0
-                ThreadHandle threadHandles[AdditionalThreadCount_];
+            ThreadHandle* threadHandles = AllocArray_(ThreadHandle, Max<uint>(threadCount, 1));
 
-                // -- fork threads
-                for(uint scan = 0; scan < AdditionalThreadCount_; ++scan) {
-                    threadHandles[scan] = CreateThread(PathTracerKernel, &integratorContext);
-                }
-            #endif
+            RenderTiles(&integratorContext, threadHandles, threadCount);
 
-            // -- do work on the main thread too
-            PathTracerKernel(&integratorContext);
+            if(adaptive) {
+                // -- Every round gives each pixel of an unconverged tile another pathsPerPixel paths.
+                uint64 pixelCount = (uint64)frame.width * frame.height;
+                uint64 renderedPixels = pixelCount;
 
-            #if AdditionalThreadCount_ > 0
-                // -- wait for any other threads to finish
-                while(*integratorContext.completedThreads != *integratorContext.kernelIndices);
+                uint32* activeTiles = AllocArray_(uint32, tileCount);
+                integratorContext.tiles = activeTiles;
 
-                for(uint scan = 0; scan < AdditionalThreadCount_; ++scan) {
-                    ShutdownThread(threadHandles[scan]);
+                for(uint round = 0; round < settings.adaptiveMaxRounds; ++round) {
+                    uint64 activePixelCount;
+                    uint64 activeCount = CollectUnconvergedTiles(&frame, settings.adaptiveThreshold, tiles, tileCount, tilesX,
+                                                                 activeTiles, activePixelCount);
+                    if(activeCount == 0) {
+                        break;
+                    }
+
+                    integratorContext.tileCount = activeCount;
+                    integratorContext.round = round + 1;
+                    RenderTiles(&integratorContext, threadHandles, threadCount);
+                    renderedPixels += activePixelCount;
                 }
-            #endif
 
-            FrameBuffer_Scale(&frame, (1.0f / PathsPerPixel_));
+                Free_(activeTiles);
+
+                uint64 uniformPixels = pixelCount * (settings.adaptiveMaxRounds + 1);
+                WriteDebugInfo_("Adaptive sampling traced %llu paths. Sampling uniformly at the same maximum rate would trace %llu.",
+                                renderedPixels * pathsPerPixel, uniformPixels * pathsPerPixel);
+
+                FrameBuffer_Normalize(&frame);
+            }
+            else {
+                FrameBuffer_Scale(&frame, (1.0f / pathsPerPixel));
+            }
+            Free_(threadHandles);
+            Free_(tiles);
 
             FrameBuffer_Save(&frame, imageName);
             FrameBuffer_Shutdown(&frame);
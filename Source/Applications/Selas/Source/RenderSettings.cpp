@@ -0,0 +1,313 @@
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#include "RenderSettings.h"
+#include "UtilityLib/JsonUtilities.h"
+#include "StringLib/StringUtil.h"
+#include "StringLib/FixedString.h"
+#include "SystemLib/OSThreading.h"
+#include "SystemLib/MinMax.h"
+#include "SystemLib/CountOf.h"
+#include "SystemLib/Logging.h"
+
+#define DefaultSamplesPerPixel_      4
+#define DefaultAdaptiveMaxRounds_    8
+#define DefaultRayBatchSize_         4 Mb_
+#define DefaultHitBatchSize_         2 Mb_
+#define DefaultResidentBatchBudget_  2 Gb_
+// -- Stands in for a pass count nobody asked for. Resolved once all the settings have been read.
+#define UnsetPassCount_              0xFFFFFFFF
+
+namespace Selas
+{
+    static cpointer IntegratorTypeNames[] =
+    {
+        "deferred",
+        "pt"
+    };
+    static_assert(CountOf_(IntegratorTypeNames) == IntegratorTypeCount, "Missing integrator name");
+
+    //=============================================================================================================================
+    static bool ParseIntegratorType(cpointer name, IntegratorType& integrator)
+    {
+        for(uint scan = 0; scan < IntegratorTypeCount; ++scan) {
+            if(StringUtil::EqualsIgnoreCase(name, IntegratorTypeNames[scan])) {
+                integrator = (IntegratorType)scan;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    //=============================================================================================================================
+    static bool ReadPositive(const rapidjson::Value& element, cpointer key, uint& value)
+    {
+        int32 read;
+        if(Json::ReadInt32(element, key, read, 0) == false || read <= 0) {
+            return false;
+        }
+
+        value = (uint)read;
+        return true;
+    }
+
+    //=============================================================================================================================
+    static Error ParsePositive(int argc, char* argv[], int index, uint& value)
+    {
+        if(index >= argc) {
+            return Error_("Missing value for command line argument %s", argv[index - 1]);
+        }
+
+        int32 parsed = StringUtil::ToInt32(argv[index]);
+        if(parsed <= 0) {
+            return Error_("Invalid value %s for command line argument %s", argv[index], argv[index - 1]);
+        }
+
+        value = (uint)parsed;
+        return Success_;
+    }
+
+    //=============================================================================================================================
+    static Error ParseNonNegative(int argc, char* argv[], int index, uint& value)
+    {
+        if(index >= argc) {
+            return Error_("Missing value for command line argument %s", argv[index - 1]);
+        }
+
+        int32 parsed = StringUtil::ToInt32(argv[index]);
+        if(parsed < 0) {
+            return Error_("Invalid value %s for command line argument %s", argv[index], argv[index - 1]);
+        }
+
+        value = (uint)parsed;
+        return Success_;
+    }
+
+    //=============================================================================================================================
+    static Error ParseNonNegative(int argc, char* argv[], int index, float& value)
+    {
+        if(index >= argc) {
+            return Error_("Missing value for command line argument %s", argv[index - 1]);
+        }
+
+        value = StringUtil::ToFloat(argv[index]);
+        if(value < 0.0f) {
+            return Error_("Invalid value %s for command line argument %s", argv[index], argv[index - 1]);
+        }
+
+        return Success_;
+    }
+
+    //=============================================================================================================================
+    static Error ResolveSettings(RenderSettings* settings)
+    {
+        // -- A time budget on its own renders until the budget runs out. Without one a single pass is rendered.
+        if(settings->passCount == UnsetPassCount_) {
+            settings->passCount = settings->timeBudgetSeconds > 0.0f ? 0 : 1;
+        }
+
+        if(settings->adaptiveThreshold > 0.0f && settings->integrator != ePathTracerIntegrator) {
+            return Error_("Adaptive sampling is only supported by -integrator pt");
+        }
+
+        if(settings->passCount == 0 && settings->timeBudgetSeconds <= 0.0f) {
+            return Error_("Rendering an unlimited number of passes requires a time budget");
+        }
+
+        return Success_;
+    }
+
+    //=============================================================================================================================
+    void RenderSettings_Initialize(RenderSettings* settings)
+    {
+        settings->integrator            = eDeferredIntegrator;
+        settings->additionalThreadCount = Max<uint>(HardwareThreadCount(), 1) - 1;
+        settings->samplesPerPixelX      = DefaultSamplesPerPixel_;
+        settings->samplesPerPixelY      = DefaultSamplesPerPixel_;
+        settings->passCount             = UnsetPassCount_;
+        settings->timeBudgetSeconds     = 0.0f;
+        settings->adaptiveThreshold     = 0.0f;
+        settings->adaptiveMaxRounds     = DefaultAdaptiveMaxRounds_;
+        settings->rayBatchSize          = DefaultRayBatchSize_;
+        settings->hitBatchSize          = DefaultHitBatchSize_;
+        settings->residentBatchBudget   = DefaultResidentBatchBudget_;
+        settings->traversalMode         = ePacket8Traversal;
+        settings->benchmarkTraversal    = false;
+        settings->nativeInstancing      = false;
+        settings->tileLockedFramebuffer = false;
+        settings->benchmarkFramebuffer  = false;
+        settings->benchmarkShading      = false;
+        settings->profile               = false;
+    }
+
+    //=============================================================================================================================
+    Error RenderSettings_ReadJson(cpointer filepath, RenderSettings* settings)
+    {
+        rapidjson::Document document;
+        ReturnError_(Json::OpenJsonDocument(filepath, document));
+
+        FixedString32 integrator;
+        if(Json::ReadFixedString(document, "integrator", "", integrator)) {
+            if(ParseIntegratorType(integrator.Ascii(), settings->integrator) == false) {
+                return Error_("Unknown integrator %s in %s", integrator.Ascii(), filepath);
+            }
+        }
+
+        uint threadCount;
+        if(ReadPositive(document, "threads", threadCount)) {
+            settings->additionalThreadCount = threadCount - 1;
+        }
+
+        ReadPositive(document, "samplesPerPixelX", settings->samplesPerPixelX);
+        ReadPositive(document, "samplesPerPixelY", settings->samplesPerPixelY);
+
+        int32 passCount;
+        if(Json::ReadInt32(document, "passes", passCount, 0) && passCount >= 0) {
+            settings->passCount = (uint)passCount;
+        }
+
+        float timeBudget;
+        if(Json::ReadFloat(document, "timeBudgetSeconds", timeBudget, 0.0f) && timeBudget >= 0.0f) {
+            settings->timeBudgetSeconds = timeBudget;
+        }
+
+        float adaptiveThreshold;
+        if(Json::ReadFloat(document, "adaptiveThreshold", adaptiveThreshold, 0.0f) && adaptiveThreshold >= 0.0f) {
+            settings->adaptiveThreshold = adaptiveThreshold;
+        }
+        ReadPositive(document, "adaptiveMaxRounds", settings->adaptiveMaxRounds);
+
+        ReadPositive(document, "rayBatchSize", settings->rayBatchSize);
+        ReadPositive(document, "hitBatchSize", settings->hitBatchSize);
+
+        uint residentMb;
+        if(ReadPositive(document, "residentBatchBudgetMb", residentMb)) {
+            settings->residentBatchBudget = (uint64)residentMb * 1 Mb_;
+        }
+
+        FixedString32 traversal;
+        if(Json::ReadFixedString(document, "traversal", "", traversal)) {
+            if(ParseTraversalMode(traversal.Ascii(), settings->traversalMode) == false) {
+                return Error_("Unknown traversal mode %s in %s", traversal.Ascii(), filepath);
+            }
+        }
+
+        Json::ReadBool(document, "benchmarkTraversal", settings->benchmarkTraversal, settings->benchmarkTraversal);
+        Json::ReadBool(document, "nativeInstancing", settings->nativeInstancing, settings->nativeInstancing);
+        Json::ReadBool(document, "tileLockedFramebuffer", settings->tileLockedFramebuffer, settings->tileLockedFramebuffer);
+        Json::ReadBool(document, "benchmarkFramebuffer", settings->benchmarkFramebuffer, settings->benchmarkFramebuffer);
+        Json::ReadBool(document, "benchmarkShading", settings->benchmarkShading, settings->benchmarkShading);
+        Json::ReadBool(document, "profile", settings->profile, settings->profile);
+
+        return Success_;
+    }
+
+    //=============================================================================================================================
+    Error RenderSettings_ParseCommandLine(int argc, char* argv[], RenderSettings* settings)
+    {
+        for(int scan = 1; scan < argc; ++scan) {
+            if(StringUtil::Equals(argv[scan], "-settings")) {
+                if(scan + 1 >= argc) {
+                    return Error_("-settings requires a file path");
+                }
+                ReturnError_(RenderSettings_ReadJson(argv[scan + 1], settings));
+            }
+        }
+
+        for(int scan = 1; scan < argc; ++scan) {
+            cpointer arg = argv[scan];
+
+            if(StringUtil::Equals(arg, "-settings")) {
+                ++scan;
+            }
+            else if(StringUtil::Equals(arg, "-integrator")) {
+                if(++scan >= argc) {
+                    return Error_("Missing value for command line argument %s", arg);
+                }
+                if(ParseIntegratorType(argv[scan], settings->integrator) == false) {
+                    return Error_("Unknown integrator %s", argv[scan]);
+                }
+            }
+            else if(StringUtil::Equals(arg, "-threads")) {
+                uint threadCount;
+                ReturnError_(ParsePositive(argc, argv, ++scan, threadCount));
+                settings->additionalThreadCount = threadCount - 1;
+            }
+            else if(StringUtil::Equals(arg, "-spp")) {
+                ReturnError_(ParsePositive(argc, argv, ++scan, settings->samplesPerPixelX));
+                ReturnError_(ParsePositive(argc, argv, ++scan, settings->samplesPerPixelY));
+            }
+            else if(StringUtil::Equals(arg, "-passes")) {
+                ReturnError_(ParseNonNegative(argc, argv, ++scan, settings->passCount));
+            }
+            else if(StringUtil::Equals(arg, "-budget")) {
+                ReturnError_(ParseNonNegative(argc, argv, ++scan, settings->timeBudgetSeconds));
+            }
+            else if(StringUtil::Equals(arg, "-adaptive")) {
+                ReturnError_(ParseNonNegative(argc, argv, ++scan, settings->adaptiveThreshold));
+            }
+            else if(StringUtil::Equals(arg, "-adaptiverounds")) {
+                ReturnError_(ParsePositive(argc, argv, ++scan, settings->adaptiveMaxRounds));
+            }
+            else if(StringUtil::Equals(arg, "-raybatch")) {
+                ReturnError_(ParsePositive(argc, argv, ++scan, settings->rayBatchSize));
+            }
+            else if(StringUtil::Equals(arg, "-hitbatch")) {
+                ReturnError_(ParsePositive(argc, argv, ++scan, settings->hitBatchSize));
+            }
+            else if(StringUtil::Equals(arg, "-residentmb")) {
+                uint residentMb;
+                ReturnError_(ParsePositive(argc, argv, ++scan, residentMb));
+                settings->residentBatchBudget = (uint64)residentMb * 1 Mb_;
+            }
+            else if(StringUtil::Equals(arg, "-traversal")) {
+                if(++scan >= argc) {
+                    return Error_("Missing value for command line argument %s", arg);
+                }
+                if(ParseTraversalMode(argv[scan], settings->traversalMode) == false) {
+                    return Error_("Unknown traversal mode %s", argv[scan]);
+                }
+            }
+            else if(StringUtil::Equals(arg, "-benchmarktraversal")) {
+                settings->benchmarkTraversal = true;
+            }
+            else if(StringUtil::Equals(arg, "-nativeinstancing")) {
+                settings->nativeInstancing = true;
+            }
+            else if(StringUtil::Equals(arg, "-tilelocks")) {
+                settings->tileLockedFramebuffer = true;
+            }
+            else if(StringUtil::Equals(arg, "-benchmarkframebuffer")) {
+                settings->benchmarkFramebuffer = true;
+            }
+            else if(StringUtil::Equals(arg, "-benchmarkshading")) {
+                settings->benchmarkShading = true;
+            }
+            else if(StringUtil::Equals(arg, "-profile")) {
+                settings->profile = true;
+            }
+            else {
+                return Error_("Unknown command line argument %s", arg);
+            }
+        }
+
+        return ResolveSettings(settings);
+    }
+
+    //=============================================================================================================================
+    void RenderSettings_Log(const RenderSettings* settings)
+    {
+        WriteDebugInfo_("Render settings: integrator %s", IntegratorTypeNames[settings->integrator]);
+        WriteDebugInfo_("Render settings: passes %llu budget %.1fs adaptive threshold %g max rounds %llu framebuffer locks %s",
+                        settings->passCount, settings->timeBudgetSeconds, settings->adaptiveThreshold,
+                        settings->adaptiveMaxRounds, settings->tileLockedFramebuffer ? "tile" : "global");
+        WriteDebugInfo_("Render settings: threads %llu spp %llux%llu ray batch %llu hit batch %llu resident budget %lluMb "
+                        "traversal %s%s",
+                        settings->additionalThreadCount + 1, settings->samplesPerPixelX, settings->samplesPerPixelY,
+                        settings->rayBatchSize, settings->hitBatchSize, settings->residentBatchBudget / (1 Mb_),
+                        TraversalModeName(settings->traversalMode), settings->benchmarkTraversal ? " (benchmarking)" : "");
+        WriteDebugInfo_("Render settings: subscene instancing %s", settings->nativeInstancing ? "native" : "user geometry");
+    }
+}
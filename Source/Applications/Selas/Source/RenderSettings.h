@@ -0,0 +1,81 @@
+#pragma once
+
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#include "Shading/RayBatchTraversal.h"
+#include "SystemLib/Error.h"
+#include "SystemLib/BasicTypes.h"
+
+namespace Selas
+{
+    enum IntegratorType
+    {
+        // -- Wavefront path tracer that sorts rays and hits into batches. Uses the batch, traversal and framebuffer lock settings.
+        eDeferredIntegrator,
+        // -- Path tracer that traces each path to completion in screen tiles. The only integrator with adaptive sampling.
+        ePathTracerIntegrator,
+
+        IntegratorTypeCount
+    };
+
+    struct RenderSettings
+    {
+        // -- The integrator main renders every camera with.
+        IntegratorType integrator;
+
+        // -- Threads forked by the integrators. The calling thread always does work too.
+        uint   additionalThreadCount;
+        uint   samplesPerPixelX;
+        uint   samplesPerPixelY;
+
+        // -- Each pass shoots samplesPerPixelX * samplesPerPixelY samples for every pixel through the batcher and waits for
+        // -- them to finish so the ray population in flight never exceeds one pass. Rendering stops after passCount passes or
+        // -- once the next pass would run past timeBudgetSeconds. Zero disables either limit but not both. Unless a pass count
+        // -- is given a time budget renders until it runs out and no time budget renders a single pass.
+        uint   passCount;
+        float  timeBudgetSeconds;
+
+        // -- The non deferred path tracer keeps adding samplesPerPixelX * samplesPerPixelY paths to any tile whose mean
+        // -- relative variance is above adaptiveThreshold, for at most adaptiveMaxRounds extra rounds. Zero disables it.
+        float  adaptiveThreshold;
+        uint   adaptiveMaxRounds;
+
+        uint   rayBatchSize;
+        uint   hitBatchSize;
+        uint64 residentBatchBudget;
+
+        TraversalMode traversalMode;
+        // -- Traces every ray batch with each traversal mode and logs rays/sec for each of them at the end of the render.
+        bool          benchmarkTraversal;
+        // -- Subscenes resident after preloading become native Embree instances instead of user geometry. They stay pinned in
+        // -- the geometry cache for the whole render.
+        bool          nativeInstancing;
+
+        // -- The deferred integrator accumulates through per tile framebuffer locks rather than one framebuffer wide lock.
+        bool          tileLockedFramebuffer;
+        // -- Times both framebuffer accumulation modes with synthetic samples and exits without rendering.
+        bool          benchmarkFramebuffer;
+        // -- Times scalar and batched bsdf evaluation of synthetic Disney surfaces and exits without rendering.
+        bool          benchmarkShading;
+
+        // -- Records a per thread timeline of each integrator stage and writes it as Chrome trace json next to the image.
+        bool          profile;
+    };
+
+    // -- Defaults use every hardware thread.
+    void  RenderSettings_Initialize(RenderSettings* settings);
+
+    // -- Any value missing from the file keeps its current setting.
+    Error RenderSettings_ReadJson(cpointer filepath, RenderSettings* settings);
+
+    // -- Supports -settings <file.json>, -integrator <deferred|pt>, -threads <n>, -spp <x> <y>, -passes <n>,
+    // -- -budget <seconds>, -adaptive <threshold>, -adaptiverounds <n>, -raybatch <n>, -hitbatch <n>, -residentmb <n>,
+    // -- -traversal <packet8|packet16|stream|twolevel>, -benchmarktraversal, -nativeinstancing, -tilelocks,
+    // -- -benchmarkframebuffer, -benchmarkshading and -profile. A settings file is read first so the other arguments override
+    // -- it regardless of order.
+    Error RenderSettings_ParseCommandLine(int argc, char* argv[], RenderSettings* settings);
+
+    void  RenderSettings_Log(const RenderSettings* settings);
+}
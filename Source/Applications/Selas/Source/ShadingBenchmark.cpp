@@ -0,0 +1,129 @@
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#include "ShadingBenchmark.h"
+#include "Shading/SurfaceScattering.h"
+#include "Shading/SurfaceParameters.h"
+#include "Shading/Disney.h"
+#include "MathLib/FloatFuncs.h"
+#include "MathLib/FloatStructs.h"
+#include "MathLib/Sampler.h"
+#include "SystemLib/MemoryAllocation.h"
+#include "SystemLib/BasicTypes.h"
+#include "SystemLib/MinMax.h"
+#include "SystemLib/SystemTime.h"
+#include "SystemLib/Logging.h"
+
+#define BenchmarkSurfaceCount_ (64 * 1024)
+#define BenchmarkIterations_   16
+
+namespace Selas
+{
+    //=============================================================================================================================
+    static void RandomSurface(CSampler* sampler, SurfaceParameters& surface)
+    {
+        float3 normal = sampler->UniformSphere();
+        float3 helper = Math::Absf(normal.y) < 0.9f ? float3::YAxis_ : float3::XAxis_;
+        float3 tangent = Normalize(Cross(helper, normal));
+        float3 bitangent = Cross(normal, tangent);
+
+        surface.worldToTangent = MatrixTranspose(MakeFloat3x3(tangent, normal, bitangent));
+        surface.position = float3::Zero_;
+        surface.error = 0.0f;
+        surface.view = normal;
+
+        surface.baseColor          = float3(sampler->UniformFloat(), sampler->UniformFloat(), sampler->UniformFloat());
+        surface.transmittanceColor = surface.baseColor;
+        surface.sheen              = sampler->UniformFloat() < 0.5f ? 0.0f : sampler->UniformFloat();
+        surface.sheenTint          = sampler->UniformFloat();
+        surface.clearcoat          = sampler->UniformFloat() < 0.5f ? 0.0f : sampler->UniformFloat();
+        surface.clearcoatGloss     = sampler->UniformFloat();
+        surface.metallic           = sampler->UniformFloat() < 0.7f ? 0.0f : sampler->UniformFloat();
+        surface.diffTrans          = 0.0f;
+        surface.flatness           = 0.0f;
+        surface.anisotropic        = sampler->UniformFloat() < 0.5f ? 0.0f : sampler->UniformFloat();
+        surface.specularTint       = sampler->UniformFloat();
+        surface.roughness          = Max<float>(0.05f, sampler->UniformFloat());
+        surface.scatterDistance    = 0.0f;
+        surface.ior                = 1.0f + sampler->UniformFloat();
+        surface.relativeIOR        = 1.0f / surface.ior;
+        surface.shader             = sampler->UniformFloat() < 0.5f ? eDisneySolid : eDisneyThin;
+        surface.materialFlags      = 0;
+        surface.lightSetIndex      = 0;
+
+        // -- A few transmissive surfaces keep the scalar fallback in the measurement.
+        surface.specTrans          = sampler->UniformFloat() < 0.1f ? sampler->UniformFloat() : 0.0f;
+    }
+
+    //=============================================================================================================================
+    static float RelativeDifference(float a, float b)
+    {
+        return Math::Absf(a - b) / Max<float>(Max<float>(Math::Absf(a), Math::Absf(b)), 1e-3f);
+    }
+
+    //=============================================================================================================================
+    void BenchmarkBsdfEvaluation()
+    {
+        CSampler sampler;
+        sampler.Initialize(0);
+
+        SurfaceParameters* surfaces = AllocArray_(SurfaceParameters, BenchmarkSurfaceCount_);
+        float3* v = AllocArray_(float3, BenchmarkSurfaceCount_);
+        float3* l = AllocArray_(float3, BenchmarkSurfaceCount_);
+        float3* scalarReflectance = AllocArray_(float3, BenchmarkSurfaceCount_);
+        float3* batchReflectance = AllocArray_(float3, BenchmarkSurfaceCount_);
+        float* scalarPdfs = AllocArray_(float, 2 * BenchmarkSurfaceCount_);
+        float* batchPdfs = AllocArray_(float, 2 * BenchmarkSurfaceCount_);
+
+        uint wideCount = 0;
+        for(uint scan = 0; scan < BenchmarkSurfaceCount_; ++scan) {
+            RandomSurface(&sampler, surfaces[scan]);
+            v[scan] = sampler.UniformSphere();
+            l[scan] = sampler.UniformSphere();
+            wideCount += CanEvaluateDisneyWide(surfaces[scan]) ? 1 : 0;
+        }
+
+        auto timer = SystemTime::Now();
+        for(uint iteration = 0; iteration < BenchmarkIterations_; ++iteration) {
+            for(uint scan = 0; scan < BenchmarkSurfaceCount_; ++scan) {
+                scalarReflectance[scan] = EvaluateBsdf(surfaces[scan], v[scan], l[scan], scalarPdfs[2 * scan],
+                                                       scalarPdfs[2 * scan + 1]);
+            }
+        }
+        float scalarMs = SystemTime::ElapsedMillisecondsF(timer);
+
+        float* batchForward = batchPdfs;
+        float* batchReverse = batchPdfs + BenchmarkSurfaceCount_;
+
+        timer = SystemTime::Now();
+        for(uint iteration = 0; iteration < BenchmarkIterations_; ++iteration) {
+            EvaluateBsdfBatch(surfaces, v, l, BenchmarkSurfaceCount_, batchReflectance, batchForward, batchReverse);
+        }
+        float batchMs = SystemTime::ElapsedMillisecondsF(timer);
+
+        float maxDifference = 0.0f;
+        for(uint scan = 0; scan < BenchmarkSurfaceCount_; ++scan) {
+            maxDifference = Max(maxDifference, RelativeDifference(scalarReflectance[scan].x, batchReflectance[scan].x));
+            maxDifference = Max(maxDifference, RelativeDifference(scalarReflectance[scan].y, batchReflectance[scan].y));
+            maxDifference = Max(maxDifference, RelativeDifference(scalarReflectance[scan].z, batchReflectance[scan].z));
+            maxDifference = Max(maxDifference, RelativeDifference(scalarPdfs[2 * scan], batchForward[scan]));
+            maxDifference = Max(maxDifference, RelativeDifference(scalarPdfs[2 * scan + 1], batchReverse[scan]));
+        }
+
+        float evaluationCount = (float)BenchmarkSurfaceCount_ * BenchmarkIterations_;
+        WriteDebugInfo_("Bsdf evaluation: %llu of %u surfaces take the wide path", wideCount, BenchmarkSurfaceCount_);
+        WriteDebugInfo_("Bsdf evaluation: scalar %.2fns per hit, batched %.2fns per hit, largest relative difference %g",
+                        scalarMs * 1e6f / evaluationCount, batchMs * 1e6f / evaluationCount, maxDifference);
+
+        Free_(batchPdfs);
+        Free_(scalarPdfs);
+        Free_(batchReflectance);
+        Free_(scalarReflectance);
+        Free_(l);
+        Free_(v);
+        Free_(surfaces);
+
+        sampler.Shutdown();
+    }
+}
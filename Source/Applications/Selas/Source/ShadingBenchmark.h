@@ -0,0 +1,12 @@
+#pragma once
+
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+namespace Selas
+{
+    // -- Evaluates a batch of random Disney surfaces one at a time through EvaluateBsdf and then through EvaluateBsdfBatch. Logs
+    // -- the cost per evaluation of each and the largest difference between their results.
+    void BenchmarkBsdfEvaluation();
+}
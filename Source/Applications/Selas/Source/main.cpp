@@ -6,6 +6,9 @@
 #include "PathTracer.h"
 #include "DeferredPathTracer.h"
 #include "VCM.h"
+#include "RenderSettings.h"
+#include "FramebufferBenchmark.h"
+#include "ShadingBenchmark.h"
 
 #include "BuildCommon/ImageBasedLightBuildProcessor.h"
 #include "BuildCommon/TextureBuildProcessor.h"
@@ -28,6 +31,7 @@
 #include "SystemLib/BasicTypes.h"
 #include "SystemLib/SystemTime.h"
 #include "SystemLib/Logging.h"
+#include "SystemLib/Profiling.h"
 
 #include "embree3/rtcore.h"
 #include "embree3/rtcore_ray.h"
@@ -86,6 +90,21 @@ int main(int argc, char *argv[])
 
     Environment_Initialize(ProjectRootName_, argv[0]);
 
+    RenderSettings settings;
+    RenderSettings_Initialize(&settings);
+    ExitMainOnError_(RenderSettings_ParseCommandLine(argc, argv, &settings));
+    RenderSettings_Log(&settings);
+
+    if(settings.benchmarkFramebuffer) {
+        BenchmarkFramebufferAccumulation(settings);
+        return 0;
+    }
+
+    if(settings.benchmarkShading) {
+        BenchmarkBsdfEvaluation();
+        return 0;
+    }
+
     TextureCache textureCache;
     textureCache.Initialize(TextureCacheSize_);
 
@@ -109,6 +128,11 @@ int main(int argc, char *argv[])
     geometryCache.RegisterSubscenes(sceneResource.subscenes, sceneResource.data->subsceneNames.Count());
     geometryCache.PreloadAll();
 
+    // -- Leave half the cache for subscenes that stream in during the render.
+    if(settings.nativeInstancing) {
+        EnableNativeSubsceneInstancing(&sceneResource, rtcDevice, GeometryCacheSize_ / 2);
+    }
+
     Selas::uint width  = 1024;
     Selas::uint height = 429;
 
@@ -117,9 +141,14 @@ int main(int argc, char *argv[])
         SetupSceneCamera(&sceneResource, scan, width, height, camera);
 
         timer = SystemTime::Now();
-        //PathTracer::GenerateImage(&geometryCache, &textureCache, &sceneResource, camera, "UnidirectionalPT");
-        DeferredPathTracer::GenerateImage(&geometryCache, &textureCache, &sceneResource, camera,
-                                          sceneResource.data->cameras[scan].name.Ascii());
+        if(settings.integrator == ePathTracerIntegrator) {
+            PathTracer::GenerateImage(&geometryCache, &textureCache, &sceneResource, camera, settings,
+                                      sceneResource.data->cameras[scan].name.Ascii());
+        }
+        else {
+            DeferredPathTracer::GenerateImage(&geometryCache, &textureCache, &sceneResource, camera, settings,
+                                              sceneResource.data->cameras[scan].name.Ascii());
+        }
         //VCM::GenerateImage(&sceneResource, camera, "VCM");
         elapsedMs = SystemTime::ElapsedMillisecondsF(timer);
         WriteDebugInfo_("Scene render time %fms", elapsedMs);
@@ -130,6 +159,7 @@ int main(int argc, char *argv[])
 
     geometryCache.Shutdown();
     textureCache.Shutdown();
+    Profiler_Shutdown();
 
     return 0;
 }
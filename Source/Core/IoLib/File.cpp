@@ -125,6 +125,22 @@ namespace Selas
             return Success_;
         }
 
+        //=========================================================================================================================
+        Error Delete(cpointer filepath)
+        {
+            #if IsWindows_
+                bool deleted = DeleteFileA(filepath) ? true : false;
+            #else
+                bool deleted = unlink(filepath) == 0;
+            #endif
+
+            if(deleted == false) {
+                return Error_("Failed to delete file: %s", filepath);
+            }
+
+            return Success_;
+        }
+
         //=========================================================================================================================
         bool Exists(cpointer filepath)
         {
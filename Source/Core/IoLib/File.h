@@ -19,6 +19,7 @@ namespace Selas
         Error WriteWholeFile(cpointer filepath, const void* data, uint64 size);
 
         Error Size(cpointer filepath, uint64& size);
+        Error Delete(cpointer filepath);
 
         bool Exists(cpointer filepath);
     };
@@ -0,0 +1,39 @@
+#pragma once
+
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#include "SystemLib/Error.h"
+#include "SystemLib/BasicTypes.h"
+
+namespace Selas
+{
+    //=============================================================================================================================
+    struct MappedFile
+    {
+        MappedFile();
+
+        void*  memory;
+        uint64 size;
+
+        #if IsWindows_
+            void* fileHandle;
+            void* mappingHandle;
+        #else
+            int32 fileDescriptor;
+        #endif
+    };
+
+    // -- Creates (or truncates) the file at filepath, reserves size bytes on disk for it and maps it read/write.
+    Error MappedFile_Create(cpointer filepath, uint64 size, MappedFile* file);
+
+    // -- Maps an existing file read only. Pages come straight from the page cache so nothing is copied or double buffered. The
+    // -- file descriptor or handles are closed before this returns so an open mapping doesn't hold any. Close it with
+    // -- MappedFile_Close(file, file->size).
+    Error MappedFile_Open(cpointer filepath, MappedFile* file);
+
+    // -- Unmaps the file and trims it down to usedSize bytes so only written data is ever read back. Files from MappedFile_Open
+    // -- are only unmapped.
+    void  MappedFile_Close(MappedFile* file, uint64 usedSize);
+}
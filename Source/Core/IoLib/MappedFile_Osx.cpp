@@ -0,0 +1,136 @@
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#if IsOsx_
+
+#include "IoLib/MappedFile.h"
+#include "SystemLib/JsAssert.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace Selas
+{
+    //=============================================================================================================================
+    static bool ReserveFileSize(int32 fileDescriptor, uint64 size)
+    {
+        #if defined(__linux__)
+            // -- Allocating the blocks up front keeps page faults on the mapping from having to extend the file one page at a
+            // -- time. Not every filesystem supports it so fall back to a sparse file when it fails.
+            if(fallocate(fileDescriptor, 0, 0, (off_t)size) == 0) {
+                return true;
+            }
+        #endif
+
+        return ftruncate(fileDescriptor, (off_t)size) == 0;
+    }
+
+    //=============================================================================================================================
+    MappedFile::MappedFile()
+        : memory(nullptr)
+        , size(0)
+        , fileDescriptor(-1)
+    {
+
+    }
+
+    //=============================================================================================================================
+    Error MappedFile_Create(cpointer filepath, uint64 size, MappedFile* file)
+    {
+        Assert_(file->memory == nullptr);
+
+        int32 fileDescriptor = open(filepath, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if(fileDescriptor == -1) {
+            return Error_("Failed to create file: %s", filepath);
+        }
+
+        if(ReserveFileSize(fileDescriptor, size) == false) {
+            close(fileDescriptor);
+            return Error_("Failed to reserve %llu bytes for file: %s", size, filepath);
+        }
+
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, 0);
+        if(memory == MAP_FAILED) {
+            close(fileDescriptor);
+            return Error_("Failed to map file: %s", filepath);
+        }
+
+        madvise(memory, size, MADV_SEQUENTIAL);
+
+        file->memory = memory;
+        file->size = size;
+        file->fileDescriptor = fileDescriptor;
+
+        return Success_;
+    }
+
+    //=============================================================================================================================
+    Error MappedFile_Open(cpointer filepath, MappedFile* file)
+    {
+        Assert_(file->memory == nullptr);
+
+        int32 fileDescriptor = open(filepath, O_RDONLY);
+        if(fileDescriptor == -1) {
+            return Error_("Failed to open file: %s", filepath);
+        }
+
+        struct stat filestatus;
+        if(fstat(fileDescriptor, &filestatus) == -1 || filestatus.st_size == 0) {
+            close(fileDescriptor);
+            return Error_("Failed to stat file or file is empty: %s", filepath);
+        }
+
+        uint64 size = (uint64)filestatus.st_size;
+
+        // -- A read only mapping stays valid after the descriptor is closed. Closing it now keeps loaded models from holding a
+        // -- descriptor each for as long as they're resident.
+        void* memory = mmap(nullptr, size, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+        close(fileDescriptor);
+        if(memory == MAP_FAILED) {
+            return Error_("Failed to map file: %s", filepath);
+        }
+
+        // -- Callers read mapped files front to back right away so start the reads now rather than fault one page at a time.
+        madvise(memory, size, MADV_WILLNEED);
+
+        file->memory = memory;
+        file->size = size;
+        file->fileDescriptor = -1;
+
+        return Success_;
+    }
+
+    //=============================================================================================================================
+    void MappedFile_Close(MappedFile* file, uint64 usedSize)
+    {
+        if(file->memory == nullptr) {
+            return;
+        }
+
+        Assert_(usedSize <= file->size);
+
+        // -- Dirty pages stay in the page cache for writeback; we just don't want them counted against this process anymore.
+        madvise(file->memory, file->size, MADV_DONTNEED);
+        munmap(file->memory, file->size);
+
+        // -- Files mapped with MappedFile_Open closed their descriptor as soon as they were mapped.
+        if(file->fileDescriptor != -1) {
+            if(usedSize < file->size) {
+                int32 result = ftruncate(file->fileDescriptor, (off_t)usedSize);
+                Assert_(result == 0);
+                Unused_(result);
+            }
+
+            close(file->fileDescriptor);
+        }
+
+        file->memory = nullptr;
+        file->size = 0;
+        file->fileDescriptor = -1;
+    }
+}
+
+#endif
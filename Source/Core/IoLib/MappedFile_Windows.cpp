@@ -0,0 +1,127 @@
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#if IsWindows_
+
+#include "IoLib/MappedFile.h"
+#include "SystemLib/JsAssert.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+namespace Selas
+{
+    //=============================================================================================================================
+    MappedFile::MappedFile()
+        : memory(nullptr)
+        , size(0)
+        , fileHandle(INVALID_HANDLE_VALUE)
+        , mappingHandle(INVALID_HANDLE_VALUE)
+    {
+
+    }
+
+    //=============================================================================================================================
+    Error MappedFile_Create(cpointer filepath, uint64 size, MappedFile* file)
+    {
+        Assert_(file->memory == nullptr);
+
+        HANDLE fileHandle = CreateFileA(filepath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, 0, NULL);
+        if(fileHandle == INVALID_HANDLE_VALUE) {
+            return Error_("Failed to create file: %s", filepath);
+        }
+
+        HANDLE mappingHandle = CreateFileMapping(fileHandle, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+        if(mappingHandle == NULL) {
+            CloseHandle(fileHandle);
+            return Error_("Failed to create mapping for file: %s", filepath);
+        }
+
+        void* memory = MapViewOfFile(mappingHandle, FILE_MAP_WRITE, 0, 0, 0);
+        if(memory == nullptr) {
+            CloseHandle(mappingHandle);
+            CloseHandle(fileHandle);
+            return Error_("Failed to map file: %s", filepath);
+        }
+
+        file->memory = memory;
+        file->size = size;
+        file->fileHandle = fileHandle;
+        file->mappingHandle = mappingHandle;
+
+        return Success_;
+    }
+
+    //=============================================================================================================================
+    Error MappedFile_Open(cpointer filepath, MappedFile* file)
+    {
+        Assert_(file->memory == nullptr);
+
+        HANDLE fileHandle = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+        if(fileHandle == INVALID_HANDLE_VALUE) {
+            return Error_("Failed to open file: %s", filepath);
+        }
+
+        LARGE_INTEGER size;
+        if(GetFileSizeEx(fileHandle, &size) == 0 || size.QuadPart == 0) {
+            CloseHandle(fileHandle);
+            return Error_("Failed to get size of file or file is empty: %s", filepath);
+        }
+
+        HANDLE mappingHandle = CreateFileMapping(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(mappingHandle == NULL) {
+            CloseHandle(fileHandle);
+            return Error_("Failed to create mapping for file: %s", filepath);
+        }
+
+        // -- The view keeps the mapping and the file alive on its own. Closing the handles now keeps loaded models from holding
+        // -- two handles each for as long as they're resident.
+        void* memory = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mappingHandle);
+        CloseHandle(fileHandle);
+        if(memory == nullptr) {
+            return Error_("Failed to map file: %s", filepath);
+        }
+
+        file->memory = memory;
+        file->size = (uint64)size.QuadPart;
+        file->fileHandle = INVALID_HANDLE_VALUE;
+        file->mappingHandle = INVALID_HANDLE_VALUE;
+
+        return Success_;
+    }
+
+    //=============================================================================================================================
+    void MappedFile_Close(MappedFile* file, uint64 usedSize)
+    {
+        if(file->memory == nullptr) {
+            return;
+        }
+
+        Assert_(usedSize <= file->size);
+
+        UnmapViewOfFile(file->memory);
+
+        // -- Files mapped with MappedFile_Open closed their handles as soon as they were mapped.
+        if(file->fileHandle != INVALID_HANDLE_VALUE) {
+            CloseHandle(file->mappingHandle);
+
+            if(usedSize < file->size) {
+                LARGE_INTEGER end;
+                end.QuadPart = (LONGLONG)usedSize;
+                SetFilePointerEx(file->fileHandle, end, NULL, FILE_BEGIN);
+                SetEndOfFile(file->fileHandle);
+            }
+
+            CloseHandle(file->fileHandle);
+        }
+
+        file->memory = nullptr;
+        file->size = 0;
+        file->fileHandle = INVALID_HANDLE_VALUE;
+        file->mappingHandle = INVALID_HANDLE_VALUE;
+    }
+}
+
+#endif
@@ -0,0 +1,87 @@
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#include "MathLib/PackedFormats.h"
+#include "MathLib/FloatFuncs.h"
+#include "MathLib/Trigonometric.h"
+#include "SystemLib/MinMax.h"
+
+namespace Selas
+{
+    namespace Math
+    {
+        //=========================================================================================================================
+        static float SignNotZero(float x)
+        {
+            return x >= 0.0f ? 1.0f : -1.0f;
+        }
+
+        //=========================================================================================================================
+        static uint32 PackSnorm16(float x)
+        {
+            int32 value = (int32)Math::Floor(Clamp(x, -1.0f, 1.0f) * 32767.0f + 0.5f);
+            return (uint32)(value & 0xFFFF);
+        }
+
+        //=========================================================================================================================
+        static float UnpackSnorm16(uint32 x)
+        {
+            return Max((float)(int16)(x & 0xFFFF) / 32767.0f, -1.0f);
+        }
+
+        //=========================================================================================================================
+        static uint32 PackUnorm16(float x)
+        {
+            return (uint32)Math::Floor(Saturate(x) * 65535.0f + 0.5f);
+        }
+
+        //=========================================================================================================================
+        uint32 PackOctahedral(float3 direction)
+        {
+            // -- See "A Survey of Efficient Representations for Independent Unit Vectors" - Cigolle et al. 2014
+            float l1 = Math::Absf(direction.x) + Math::Absf(direction.y) + Math::Absf(direction.z);
+            if(l1 == 0.0f) {
+                return 0;
+            }
+
+            float u = direction.x / l1;
+            float v = direction.y / l1;
+            if(direction.z < 0.0f) {
+                float fu = (1.0f - Math::Absf(v)) * SignNotZero(u);
+                float fv = (1.0f - Math::Absf(u)) * SignNotZero(v);
+                u = fu;
+                v = fv;
+            }
+
+            return PackSnorm16(u) | (PackSnorm16(v) << 16);
+        }
+
+        //=========================================================================================================================
+        float3 UnpackOctahedral(uint32 packed)
+        {
+            float u = UnpackSnorm16(packed);
+            float v = UnpackSnorm16(packed >> 16);
+
+            float3 result = float3(u, v, 1.0f - Math::Absf(u) - Math::Absf(v));
+            if(result.z < 0.0f) {
+                result.x = (1.0f - Math::Absf(v)) * SignNotZero(u);
+                result.y = (1.0f - Math::Absf(u)) * SignNotZero(v);
+            }
+
+            return Normalize(result);
+        }
+
+        //=========================================================================================================================
+        uint32 PackUnorm16x2(float2 value)
+        {
+            return PackUnorm16(value.x) | (PackUnorm16(value.y) << 16);
+        }
+
+        //=========================================================================================================================
+        float2 UnpackUnorm16x2(uint32 packed)
+        {
+            return float2((float)(packed & 0xFFFF) / 65535.0f, (float)(packed >> 16) / 65535.0f);
+        }
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#include "MathLib/FloatStructs.h"
+#include "SystemLib/BasicTypes.h"
+
+namespace Selas
+{
+    namespace Math
+    {
+        // -- Unit vector stored as two 16 bit snorm octahedral coordinates. Input does not need to be normalized.
+        uint32 PackOctahedral(float3 direction);
+        float3 UnpackOctahedral(uint32 packed);
+
+        // -- Two [0, 1] values stored as 16 bit unorms.
+        uint32 PackUnorm16x2(float2 value);
+        float2 UnpackUnorm16x2(uint32 packed);
+    }
+}
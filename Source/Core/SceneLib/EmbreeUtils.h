@@ -11,4 +11,6 @@ struct RTCSceneTy;
 typedef struct RTCSceneTy* RTCScene;
 
 struct RTCGeometryTy;
-typedef struct RTCGeometryTy* RTCGeometry;
\ No newline at end of file
+typedef struct RTCGeometryTy* RTCGeometry;
+
+struct RTCRayHitNp;
\ No newline at end of file
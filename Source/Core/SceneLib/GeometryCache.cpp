@@ -5,9 +5,13 @@
 #include "SceneLib/GeometryCache.h"
 #include "SceneLib/SubsceneResource.h"
 #include "SystemLib/OSThreading.h"
+#include "SystemLib/MemoryAllocation.h"
 #include "SystemLib/Atomic.h"
 #include "SystemLib/Logging.h"
 
+#define MaxSemaphoreCount_ 0x7FFFFFFF
+#define WaitForever_       0xFFFFFFFF
+
 namespace Selas
 {
     //=============================================================================================================================
@@ -17,7 +21,7 @@ namespace Selas
     }
 
     //=============================================================================================================================
-    void GeometryCache::UnloadLruSubscene()
+    bool GeometryCache::UnloadLruSubscene()
     {
         int64 lruTimestamp = GetAccessDt();
         int64 lruIndex = -1;
@@ -31,34 +35,183 @@ namespace Selas
             }
         }
 
-        if(lruIndex != -1) {
-            subscenes[lruIndex]->geometryLoaded = 0;
+        if(lruIndex == -1) {
+            return false;
+        }
+
+        // -- The exchange is a full barrier so a thread that raises the refcount after this either sees the subscene as unloaded
+        // -- and backs off or was already using it and is waited on below.
+        if(Atomic::CompareExchange64(&subscenes[lruIndex]->geometryLoaded, 0, 1) == false) {
+            return false;
+        }
+
+        // -- This case sucks but we will wait if any threads raised the refcount between when we decided to unload this
+        // -- subscene and now. Those threads don't need the lock to finish.
+        uint32 attempt = 0;
+        while(subscenes[lruIndex]->refCount != 0) {
+            SpinBackoff(attempt);
+        }
+
+        // -- Now we can safely unload it
+        WriteDebugInfo_("Unloading subscene %s: ", subscenes[lruIndex]->data->name.Ascii());
+
+        UnloadSubsceneGeometry(subscenes[lruIndex]);
+
+        loadedGeometrySize -= subscenes[lruIndex]->geometrySizeEstimate;
+        return true;
+    }
+
+    //=============================================================================================================================
+    void GeometryCache::RequestLoad(SubsceneResource* subscene)
+    {
+        if(subscene->geometryLoaded == 1 || subscene->geometryLoading == 1) {
+            return;
+        }
+
+        EnterSpinLock(spinlock);
+
+        bool queueLoad = (subscene->geometryLoaded == 0 && subscene->geometryLoading == 0);
+        if(queueLoad) {
+            subscene->geometryLoading = 1;
+            loadQueue.Add(subscene);
+        }
+
+        LeaveSpinLock(spinlock);
+
+        if(queueLoad) {
+            PostSemaphore(loadSignal, 1);
+        }
+    }
+
+    //=============================================================================================================================
+    void GeometryCache::WaitForLoad(SubsceneResource* subscene)
+    {
+        // -- The loader clears geometryLoading and reads the waiter count under the same lock so a waiter either sees the load
+        // -- finished here or is guaranteed to be posted.
+        EnterSpinLock(spinlock);
+        if(subscene->geometryLoading == 0) {
+            LeaveSpinLock(spinlock);
+            return;
+        }
+
+        ++subscene->loadWaiterCount;
+        LeaveSpinLock(spinlock);
+
+        WaitForSemaphore(subscene->loadedSignal, WaitForever_);
+    }
+
+    //=============================================================================================================================
+    void GeometryCache::LoadNextSubscene()
+    {
+        EnterSpinLock(spinlock);
+
+        Assert_(loadQueueHead < loadQueue.Count());
+        SubsceneResource* subscene = loadQueue[loadQueueHead++];
+        if(loadQueueHead == loadQueue.Count()) {
+            loadQueue.Clear();
+            loadQueueHead = 0;
+        }
+
+        uint64 subsceneSizeEstimate = subscene->geometrySizeEstimate;
+        Assert_(subsceneSizeEstimate <= loadedGeometryCapacity);
+
+        uint32 attempt = 0;
+        while(loadedGeometrySize + subsceneSizeEstimate > loadedGeometryCapacity) {
+            if(UnloadLruSubscene() == false) {
+                // -- Everything resident is in use. Give the render threads a chance to finish with something.
+                LeaveSpinLock(spinlock);
+                SpinBackoff(attempt);
+                EnterSpinLock(spinlock);
+            }
+        }
+
+        loadedGeometrySize += subsceneSizeEstimate;
+        LeaveSpinLock(spinlock);
 
-            // -- This case sucks but we will wait if any threads raised the refcount between when we decided to unload this
-            // -- subscene and now.
-            while(subscenes[lruIndex]->refCount != 0) {}
+        WriteDebugInfo_("Loading subscene: %s", subscene->data->name.Ascii());
+        LoadSubsceneGeometry(subscene);
 
-            // -- Now we can safely unload it
-            WriteDebugInfo_("Unloading subscene %s: ", subscenes[lruIndex]->data->name.Ascii());
+        EnterSpinLock(spinlock);
+        subscene->geometryLoading = 0;
+        uint32 waiterCount = (uint32)subscene->loadWaiterCount;
+        subscene->loadWaiterCount = 0;
+        SubsceneLoadedCallback callback = loadedCallback;
+        void* callbackUserData = loadedCallbackUserData;
+        if(callback != nullptr) {
+            Atomic::Increment64(&runningCallbackCount);
+        }
+        LeaveSpinLock(spinlock);
 
-            UnloadSubsceneGeometry(subscenes[lruIndex]);
+        if(waiterCount > 0) {
+            PostSemaphore(subscene->loadedSignal, waiterCount);
+        }
 
-            loadedGeometrySize -= subscenes[lruIndex]->geometrySizeEstimate;
+        if(callback != nullptr) {
+            callback(callbackUserData, subscene);
+            Atomic::Decrement64(&runningCallbackCount);
         }
     }
 
     //=============================================================================================================================
-    void GeometryCache::Initialize(uint64 cacheSize)
+    void GeometryCache::LoaderThreadFunction(void* userData)
     {
+        GeometryCache* cache = (GeometryCache*)userData;
+
+        while(true) {
+            WaitForSemaphore(cache->loadSignal, WaitForever_);
+            if(cache->loaderShutdown) {
+                break;
+            }
+
+            cache->LoadNextSubscene();
+        }
+    }
+
+    //=============================================================================================================================
+    void GeometryCache::Initialize(uint64 cacheSize, uint loaderThreadCount_)
+    {
+        Assert_(loaderThreadCount_ > 0);
+
         loadedGeometrySize = 0;
         loadedGeometryCapacity = cacheSize;
         spinlock = CreateSpinLock();
         startTime = SystemTime::Now();
+
+        loadQueueHead = 0;
+        loadSignal = CreateOSSemaphore(0, MaxSemaphoreCount_);
+        loaderShutdown = false;
+        loadedCallback = nullptr;
+        loadedCallbackUserData = nullptr;
+        runningCallbackCount = 0;
+
+        loaderThreadCount = loaderThreadCount_;
+        loaderThreads = AllocArray_(ThreadHandle, loaderThreadCount);
+        for(uint scan = 0; scan < loaderThreadCount; ++scan) {
+            loaderThreads[scan] = CreateThread(LoaderThreadFunction, this);
+        }
     }
 
     //=============================================================================================================================
     void GeometryCache::Shutdown()
     {
+        loaderShutdown = true;
+        PostSemaphore(loadSignal, loaderThreadCount);
+        for(uint scan = 0; scan < loaderThreadCount; ++scan) {
+            ShutdownThread(loaderThreads[scan]);
+        }
+        SafeFree_(loaderThreads);
+        loaderThreadCount = 0;
+
+        CloseOSSemaphore(loadSignal);
+        loadSignal = nullptr;
+        loadQueue.Shutdown();
+
+        for(uint scan = 0, count = subscenes.Count(); scan < count; ++scan) {
+            CloseOSSemaphore(subscenes[scan]->loadedSignal);
+            subscenes[scan]->loadedSignal = nullptr;
+        }
+        subscenes.Shutdown();
+
         CloseSpinlock(spinlock);
         spinlock = nullptr;
     }
@@ -71,12 +224,20 @@ namespace Selas
 
         for(uint scan = 0; scan < subsceneCount; ++scan) {
             subscenes[offset + scan] = subscenes_[scan];
+            subscenes_[scan]->cacheIndex = (uint32)(offset + scan);
+            subscenes_[scan]->loadedSignal = CreateOSSemaphore(0, MaxSemaphoreCount_);
+            subscenes_[scan]->loadWaiterCount = 0;
         }
     }
 
     //=============================================================================================================================
     void GeometryCache::PreloadAll()
     {
+        // -- Queue everything up front so the loader threads build several subscenes at once.
+        for(uint scan = 0, count = subscenes.Count(); scan < count; ++scan) {
+            RequestLoad(subscenes[scan]);
+        }
+
         for(uint scan = 0, count = subscenes.Count(); scan < count; ++scan) {
             EnsureSubsceneGeometryLoaded(subscenes[scan]);
         }
@@ -107,36 +268,30 @@ namespace Selas
     //=============================================================================================================================
     void GeometryCache::EnsureSubsceneGeometryLoaded(SubsceneResource* subscene)
     {
-        Atomic::Increment64(&subscene->refCount);
-
-        if(subscene->geometryLoaded == 0 && subscene->geometryLoading == 0) {
-            uint64 subsceneSizeEstimate = subscene->geometrySizeEstimate;
-
-            EnterSpinLock(spinlock);
-
-            if(subscene->geometryLoaded == 0 && subscene->geometryLoading == 0) {
-                Assert_(subsceneSizeEstimate <= loadedGeometryCapacity);
-                while(loadedGeometrySize + subsceneSizeEstimate > loadedGeometryCapacity) {
-                    UnloadLruSubscene();
-                }
-
-                loadedGeometrySize += subsceneSizeEstimate;
-
-                subscene->geometryLoading = 1;
-                LeaveSpinLock(spinlock);
-
-                WriteDebugInfo_("Loading subscene: %s", subscene->data->name.Ascii());
-                LoadSubsceneGeometry(subscene);
+        while(TryUseSubsceneGeometry(subscene) == false) {
+            WaitForLoad(subscene);
+        }
+    }
 
-                subscene->geometryLoading = 0;
-            }
-            else {
-                LeaveSpinLock(spinlock);
-            }
+    //=============================================================================================================================
+    bool GeometryCache::TryUseSubsceneGeometry(SubsceneResource* subscene)
+    {
+        Atomic::Increment64(&subscene->refCount);
+        if(subscene->geometryLoaded == 1) {
+            return true;
         }
 
-        while(subscene->geometryLoading == 1) { }
-        Assert_(subscene->geometryLoaded == 1);
+        // -- Never hold a reference while the subscene isn't resident. Otherwise the loader could wait on us to evict something
+        // -- while we wait on it.
+        Atomic::Decrement64(&subscene->refCount);
+        RequestLoad(subscene);
+        return false;
+    }
+
+    //=============================================================================================================================
+    void GeometryCache::PrefetchSubsceneGeometry(SubsceneResource* subscene)
+    {
+        RequestLoad(subscene);
     }
 
     //=============================================================================================================================
@@ -149,4 +304,18 @@ namespace Selas
 
         Atomic::Decrement64(&subscene->refCount);
     }
-}
\ No newline at end of file
+
+    //=============================================================================================================================
+    void GeometryCache::SetLoadedCallback(SubsceneLoadedCallback callback, void* userData)
+    {
+        EnterSpinLock(spinlock);
+        loadedCallback = callback;
+        loadedCallbackUserData = userData;
+        LeaveSpinLock(spinlock);
+
+        uint32 attempt = 0;
+        while(runningCallbackCount != 0) {
+            SpinBackoff(attempt);
+        }
+    }
+}
@@ -4,6 +4,7 @@
 // Joe Schutte
 //=================================================================================================================================
 
+#include "ThreadingLib/Thread.h"
 #include "ContainersLib/CArray.h"
 #include "SystemLib/SystemTime.h"
 #include "SystemLib/BasicTypes.h"
@@ -12,6 +13,10 @@ namespace Selas
 {
     struct SubsceneResource;
 
+    typedef void (*SubsceneLoadedCallback)(void* userData, SubsceneResource* subscene);
+
+    #define DefaultGeometryLoaderThreadCount_ 2
+
     //=============================================================================================================================
     class GeometryCache
     {
@@ -24,19 +29,46 @@ namespace Selas
 
         CArray<SubsceneResource*> subscenes;
 
+        // -- Subscenes waiting to be loaded. Loader threads read the geometry and build its BVH so render threads never do.
+        CArray<SubsceneResource*> loadQueue;
+        uint                      loadQueueHead;
+        void*                     loadSignal;
+        ThreadHandle*             loaderThreads;
+        uint                      loaderThreadCount;
+        volatile bool             loaderShutdown;
+
+        SubsceneLoadedCallback    loadedCallback;
+        void*                     loadedCallbackUserData;
+        volatile int64            runningCallbackCount;
+
         int64 GetAccessDt();
-        void UnloadLruSubscene();
+        bool UnloadLruSubscene();
+
+        void RequestLoad(SubsceneResource* subscene);
+        void WaitForLoad(SubsceneResource* subscene);
+        void LoadNextSubscene();
+        static void LoaderThreadFunction(void* userData);
 
     public:
 
-        void Initialize(uint64 cacheSize);
+        void Initialize(uint64 cacheSize, uint loaderThreadCount = DefaultGeometryLoaderThreadCount_);
         void Shutdown();
 
         void RegisterSubscenes(SubsceneResource** subscenes, uint64 subsceneCount);
         void PreloadAll();
         void PreloadSubscene(cpointer name);
 
+        // -- Sleeps until the subscene is resident and holds a reference to it until FinishUsingSubceneGeometry.
         void EnsureSubsceneGeometryLoaded(SubsceneResource* subscene);
+        // -- Never waits. Returns true and holds a reference if the subscene is resident. Otherwise queues it for loading and
+        // -- returns false without holding a reference.
+        bool TryUseSubsceneGeometry(SubsceneResource* subscene);
+        // -- Queues the subscene for loading unless it is resident or already on its way. Never waits.
+        void PrefetchSubsceneGeometry(SubsceneResource* subscene);
         void FinishUsingSubceneGeometry(SubsceneResource* subscene);
+
+        // -- The callback runs on a loader thread each time a subscene finishes loading. Pass nullptr to remove it. Returns once
+        // -- no loader thread is still running the previous callback.
+        void SetLoadedCallback(SubsceneLoadedCallback callback, void* userData);
     };
-}
\ No newline at end of file
+}
@@ -9,7 +9,9 @@
 #include "MathLib/FloatFuncs.h"
 #include "MathLib/FloatStructs.h"
 #include "IoLib/File.h"
+#include "IoLib/MappedFile.h"
 #include "IoLib/BinaryStreamSerializer.h"
+#include "SystemLib/Memory.h"
 #include "SystemLib/BasicTypes.h"
 
 #include "embree3/rtcore.h"
@@ -406,6 +408,39 @@ namespace Selas
         return estimate;
     }
 
+    //=============================================================================================================================
+    static Error ResolveGeometryOffset(const MappedFile& file, void*& pointer, uint64 size)
+    {
+        uint64 offset = (uint64)pointer;
+        if(offset > file.size || size > file.size - offset) {
+            return Error_("Geometry data at offset %llu with size %llu runs past the end of the file", offset, size);
+        }
+
+        pointer = (uint8*)file.memory + offset;
+        return Success_;
+    }
+
+    //=============================================================================================================================
+    static Error AttachToMappedGeometry(const MappedFile& file, ModelGeometryData* geometry)
+    {
+        // -- The mapping is read only so the offsets are resolved into a copy of the header rather than patched in place.
+        if(file.size < sizeof(ModelGeometryData)) {
+            return Error_("Geometry file is smaller than its header");
+        }
+        Memory::Copy(geometry, file.memory, sizeof(ModelGeometryData));
+
+        ReturnError_(ResolveGeometryOffset(file, (void*&)geometry->indices, geometry->indexSize));
+        ReturnError_(ResolveGeometryOffset(file, (void*&)geometry->faceIndexCounts, geometry->faceIndexSize));
+        ReturnError_(ResolveGeometryOffset(file, (void*&)geometry->positions, geometry->positionSize));
+        ReturnError_(ResolveGeometryOffset(file, (void*&)geometry->normals, geometry->normalsSize));
+        ReturnError_(ResolveGeometryOffset(file, (void*&)geometry->tangents, geometry->tangentsSize));
+        ReturnError_(ResolveGeometryOffset(file, (void*&)geometry->uvs, geometry->uvsSize));
+        ReturnError_(ResolveGeometryOffset(file, (void*&)geometry->curveIndices, geometry->curveIndexSize));
+        ReturnError_(ResolveGeometryOffset(file, (void*&)geometry->curveVertices, geometry->curveVertexSize));
+
+        return Success_;
+    }
+
     //=============================================================================================================================
     // ModelResource
     //=============================================================================================================================
@@ -452,11 +487,14 @@ namespace Selas
         AssetFileUtils::AssetFilePath(ModelResource::kGeometryDataType, ModelResource::kDataVersion, model->name.Ascii(),
                                       filepath);
 
-        void* fileData = nullptr;
-        uint64 fileSize = 0;
-        ReturnError_(File::ReadWholeFile(filepath.Ascii(), &fileData, &fileSize));
+        ReturnError_(MappedFile_Open(filepath.Ascii(), &model->geometryFile));
 
-        AttachToBinary(model->geometry, (uint8*)fileData, fileSize);
+        model->geometry = AllocArray_(ModelGeometryData, 1);
+        Error err = AttachToMappedGeometry(model->geometryFile, model->geometry);
+        if(Failed_(err)) {
+            UnloadModelGeometry(model);
+            return err;
+        }
 
         RTCScene rtcScene = rtcNewScene(rtcDevice);
         model->rtcScene = rtcScene;
@@ -478,7 +516,8 @@ namespace Selas
         }
         model->rtcScene = nullptr;
 
-        SafeFreeAligned_(model->geometry);
+        SafeFree_(model->geometry);
+        MappedFile_Close(&model->geometryFile, model->geometryFile.size);
     }
 
     //=============================================================================================================================
@@ -11,6 +11,7 @@
 #include "GeometryLib/Camera.h"
 #include "UtilityLib/MurmurHash.h"
 #include "StringLib/FixedString.h"
+#include "IoLib/MappedFile.h"
 #include "MathLib/FloatStructs.h"
 #include "ContainersLib/CArray.h"
 #include "SystemLib/Error.h"
@@ -177,7 +178,10 @@ namespace Selas
         static const uint32 kGeometryDataAlignment;
 
         ModelResourceData* data;
+        // -- The geometry file is mapped rather than read. Its pointer fields hold offsets from the start of the file so
+        // -- geometry is a small heap copy of the header with those offsets resolved into the mapping.
         ModelGeometryData* geometry;
+        MappedFile         geometryFile;
 
         FixedString256 name;
         uint64 geometrySize;
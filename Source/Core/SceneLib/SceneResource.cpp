@@ -10,9 +10,11 @@
 #include "MathLib/Trigonometric.h"
 #include "MathLib/FloatFuncs.h"
 #include "IoLib/BinaryStreamSerializer.h"
+#include "UtilityLib/RadixSort.h"
 #include "SystemLib/BasicTypes.h"
 #include "SystemLib/Atomic.h"
 #include "SystemLib/SystemTime.h"
+#include "SystemLib/Logging.h"
 
 #include "embree3/rtcore.h"
 #include "embree3/rtcore_ray.h"
@@ -29,8 +31,17 @@ namespace Selas
         float4x4 worldToLocal;
         AxisAlignedBox aaBox;
         uint32 instanceID;
+        // -- Set once the instance is a native Embree instance of its subscene. The subscene stays pinned while it is.
+        bool nativeInstance;
     };
 
+    // -- Embree runs the instance callbacks on the thread that called rtcIntersect so this is how traversal knows the caller
+    // -- would rather have rays deferred than wait.
+    static thread_local bool deferSubsceneLoads = false;
+
+    // -- Embree never hands a callback more rays than its widest packet.
+    #define InstanceCallbackMaxLanes_ 16
+
     //=============================================================================================================================
     // Serialization
     //=============================================================================================================================
@@ -84,25 +95,36 @@ namespace Selas
     }
 
     //=============================================================================================================================
-    static void SceneInstanceIntersectFunction(const RTCIntersectFunctionNArguments* args)
+    static bool RayEntersBox(const AxisAlignedBox& box, float3 origin, float3 direction, float tnear, float tfar, float& tEnter)
     {
-        RTCIntersectContext* context = args->context;
-        const SubsceneInstanceUserData* instance = (const SubsceneInstanceUserData*)args->geometryUserPtr;
+        float3 invDirection = float3(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+        float3 t0 = (box.min - origin) * invDirection;
+        float3 t1 = (box.max - origin) * invDirection;
+
+        float entry = Max(Max(Min(t0.x, t1.x), Min(t0.y, t1.y)), Max(Min(t0.z, t1.z), tnear));
+        float exit = Min(Min(Max(t0.x, t1.x), Max(t0.y, t1.y)), Min(Max(t0.z, t1.z), tfar));
 
+        tEnter = entry;
+        return entry <= exit;
+    }
+
+    //=============================================================================================================================
+    static void DeferSubsceneRays(const RTCIntersectFunctionNArguments* args, const SubsceneInstanceUserData* instance)
+    {
         RTCRayN* rays = RTCRayHitN_RayN(args->rayhit, args->N);
         RTCHitN* hits = RTCRayHitN_HitN(args->rayhit, args->N);
 
         const uint32 N = args->N;
 
-        instance->geometryCache->EnsureSubsceneGeometryLoaded(instance->subscene);
-
+        // -- Report a hit where the ray enters the subscene. Anything closer still wins so rays that hit loaded geometry in front
+        // -- of the subscene come back with a usable result.
         for(uint32 scan = 0; scan < N; ++scan) {
             if(args->valid[scan] == 0)
                 continue;
 
             float3 origin;
             float3 direction;
-            
+
             origin.x = RTCRayN_org_x(rays, N, scan);
             origin.y = RTCRayN_org_y(rays, N, scan);
             origin.z = RTCRayN_org_z(rays, N, scan);
@@ -110,31 +132,160 @@ namespace Selas
             direction.y = RTCRayN_dir_y(rays, N, scan);
             direction.z = RTCRayN_dir_z(rays, N, scan);
 
-            float3 localOrigin = MatrixMultiplyPoint(origin, instance->worldToLocal);
-            float3 localDirection = MatrixMultiplyVector(direction, instance->worldToLocal);
-
-            RTCRayHit rayhit;
-            rayhit.ray.org_x = localOrigin.x;
-            rayhit.ray.org_y = localOrigin.y;
-            rayhit.ray.org_z = localOrigin.z;
-            rayhit.ray.dir_x = localDirection.x;
-            rayhit.ray.dir_y = localDirection.y;
-            rayhit.ray.dir_z = localDirection.z;
-            rayhit.ray.tnear = RTCRayN_tnear(rays, N, scan);
-            rayhit.ray.tfar = RTCRayN_tfar(rays, N, scan);
-
-            rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
-            rayhit.hit.primID = RTC_INVALID_GEOMETRY_ID;
-            rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
-            rayhit.hit.instID[1] = RTC_INVALID_GEOMETRY_ID;
-
-            rtcIntersect1(instance->subscene->rtcScene, context, &rayhit);
-
-            if(rayhit.hit.geomID != RTC_INVALID_GEOMETRY_ID) {
-                RTCRayN_tfar(rays, N, scan) = rayhit.ray.tfar;
-                rtcCopyHitToHitN(hits, &rayhit.hit, N, scan);
+            float tEnter;
+            if(RayEntersBox(instance->aaBox, origin, direction, RTCRayN_tnear(rays, N, scan), RTCRayN_tfar(rays, N, scan),
+                            tEnter) == false) {
+                continue;
+            }
+
+            RTCRayN_tfar(rays, N, scan) = tEnter;
+            RTCHitN_Ng_x(hits, N, scan) = -direction.x;
+            RTCHitN_Ng_y(hits, N, scan) = -direction.y;
+            RTCHitN_Ng_z(hits, N, scan) = -direction.z;
+            RTCHitN_u(hits, N, scan) = 0.0f;
+            RTCHitN_v(hits, N, scan) = 0.0f;
+            RTCHitN_primID(hits, N, scan) = 0;
+            RTCHitN_geomID(hits, N, scan) = DeferredSubsceneGeomId_;
+            RTCHitN_instID(hits, N, scan, 0) = instance->instanceID;
+            RTCHitN_instID(hits, N, scan, 1) = RTC_INVALID_GEOMETRY_ID;
+        }
+    }
+
+    //=============================================================================================================================
+    static uint GatherLocalRays(const int* valid, RTCRayN* rays, uint32 N, uint32 start, const float4x4& worldToLocal,
+                                RTCRay16& local, uint32* lanes)
+    {
+        uint32 end = Min<uint32>(N, start + InstanceCallbackMaxLanes_);
+
+        uint count = 0;
+        for(uint32 scan = start; scan < end; ++scan) {
+            if(valid[scan] == 0)
+                continue;
+
+            lanes[count] = scan;
+
+            local.org_x[count] = RTCRayN_org_x(rays, N, scan);
+            local.org_y[count] = RTCRayN_org_y(rays, N, scan);
+            local.org_z[count] = RTCRayN_org_z(rays, N, scan);
+            local.dir_x[count] = RTCRayN_dir_x(rays, N, scan);
+            local.dir_y[count] = RTCRayN_dir_y(rays, N, scan);
+            local.dir_z[count] = RTCRayN_dir_z(rays, N, scan);
+            local.tnear[count] = RTCRayN_tnear(rays, N, scan);
+            local.tfar[count]  = RTCRayN_tfar(rays, N, scan);
+            local.time[count]  = 0.0f;
+            local.mask[count]  = 0xFFFFFFFF;
+            local.id[count]    = count;
+            local.flags[count] = 0;
+            ++count;
+        }
+
+        // -- Transform after compacting so the loop runs over contiguous lanes and vectorizes.
+        const float4x4& m = worldToLocal;
+        for(uint lane = 0; lane < count; ++lane) {
+            float ox = local.org_x[lane];
+            float oy = local.org_y[lane];
+            float oz = local.org_z[lane];
+            float dx = local.dir_x[lane];
+            float dy = local.dir_y[lane];
+            float dz = local.dir_z[lane];
+
+            local.org_x[lane] = ox * m.r0.x + oy * m.r1.x + oz * m.r2.x + m.r3.x;
+            local.org_y[lane] = ox * m.r0.y + oy * m.r1.y + oz * m.r2.y + m.r3.y;
+            local.org_z[lane] = ox * m.r0.z + oy * m.r1.z + oz * m.r2.z + m.r3.z;
+            local.dir_x[lane] = dx * m.r0.x + dy * m.r1.x + dz * m.r2.x;
+            local.dir_y[lane] = dx * m.r0.y + dy * m.r1.y + dz * m.r2.y;
+            local.dir_z[lane] = dx * m.r0.z + dy * m.r1.z + dz * m.r2.z;
+        }
+
+        return count;
+    }
+
+    //=============================================================================================================================
+    static void MakeStreamRays(RTCRay16& packet, RTCRayNp& rays)
+    {
+        rays.org_x = packet.org_x;
+        rays.org_y = packet.org_y;
+        rays.org_z = packet.org_z;
+        rays.tnear = packet.tnear;
+        rays.dir_x = packet.dir_x;
+        rays.dir_y = packet.dir_y;
+        rays.dir_z = packet.dir_z;
+        rays.time  = packet.time;
+        rays.tfar  = packet.tfar;
+        rays.mask  = packet.mask;
+        rays.id    = packet.id;
+        rays.flags = packet.flags;
+    }
+
+    //=============================================================================================================================
+    static void SceneInstanceIntersectFunction(const RTCIntersectFunctionNArguments* args)
+    {
+        RTCIntersectContext* context = args->context;
+        const SubsceneInstanceUserData* instance = (const SubsceneInstanceUserData*)args->geometryUserPtr;
+
+        RTCRayN* rays = RTCRayHitN_RayN(args->rayhit, args->N);
+        RTCHitN* hits = RTCRayHitN_HitN(args->rayhit, args->N);
+
+        const uint32 N = args->N;
+
+        if(deferSubsceneLoads) {
+            if(instance->geometryCache->TryUseSubsceneGeometry(instance->subscene) == false) {
+                DeferSubsceneRays(args, instance);
+                return;
+            }
+        }
+        else {
+            instance->geometryCache->EnsureSubsceneGeometryLoaded(instance->subscene);
+        }
+
+        // -- The valid lanes are traced into the subscene together rather than one at a time so the inner traversal keeps
+        // -- whatever coherence the caller's packet had.
+        for(uint32 start = 0; start < N; start += InstanceCallbackMaxLanes_) {
+            Align_(64) RTCRayHit16 local;
+            uint32 lanes[InstanceCallbackMaxLanes_];
+
+            uint count = GatherLocalRays(args->valid, rays, N, start, instance->worldToLocal, local.ray, lanes);
+            if(count == 0) {
+                continue;
+            }
+
+            for(uint lane = 0; lane < count; ++lane) {
+                local.hit.geomID[lane] = RTC_INVALID_GEOMETRY_ID;
+                local.hit.primID[lane] = RTC_INVALID_GEOMETRY_ID;
+                local.hit.instID[0][lane] = RTC_INVALID_GEOMETRY_ID;
+                local.hit.instID[1][lane] = RTC_INVALID_GEOMETRY_ID;
+            }
+
+            RTCRayHitNp stream;
+            MakeStreamRays(local.ray, stream.ray);
+            stream.hit.Ng_x = local.hit.Ng_x;
+            stream.hit.Ng_y = local.hit.Ng_y;
+            stream.hit.Ng_z = local.hit.Ng_z;
+            stream.hit.u = local.hit.u;
+            stream.hit.v = local.hit.v;
+            stream.hit.primID = local.hit.primID;
+            stream.hit.geomID = local.hit.geomID;
+            stream.hit.instID[0] = local.hit.instID[0];
+            stream.hit.instID[1] = local.hit.instID[1];
+
+            rtcIntersectNp(instance->subscene->rtcScene, context, &stream, count);
+
+            for(uint lane = 0; lane < count; ++lane) {
+                if(local.hit.geomID[lane] == RTC_INVALID_GEOMETRY_ID) {
+                    continue;
+                }
+
+                uint32 scan = lanes[lane];
+                RTCRayN_tfar(rays, N, scan) = local.ray.tfar[lane];
+                RTCHitN_Ng_x(hits, N, scan) = local.hit.Ng_x[lane];
+                RTCHitN_Ng_y(hits, N, scan) = local.hit.Ng_y[lane];
+                RTCHitN_Ng_z(hits, N, scan) = local.hit.Ng_z[lane];
+                RTCHitN_u(hits, N, scan) = local.hit.u[lane];
+                RTCHitN_v(hits, N, scan) = local.hit.v[lane];
+                RTCHitN_primID(hits, N, scan) = local.hit.primID[lane];
+                RTCHitN_geomID(hits, N, scan) = local.hit.geomID[lane];
                 RTCHitN_instID(hits, N, scan, 0) = instance->instanceID;
-                RTCHitN_instID(hits, N, scan, 1) = rayhit.hit.instID[0];
+                RTCHitN_instID(hits, N, scan, 1) = local.hit.instID[0][lane];
             }
         }
 
@@ -152,38 +303,234 @@ namespace Selas
         const uint32 N = args->N;
 
         instance->geometryCache->EnsureSubsceneGeometryLoaded(instance->subscene);
+        for(uint32 start = 0; start < N; start += InstanceCallbackMaxLanes_) {
+            Align_(64) RTCRay16 local;
+            uint32 lanes[InstanceCallbackMaxLanes_];
+
+            uint count = GatherLocalRays(args->valid, rays, N, start, instance->worldToLocal, local, lanes);
+            if(count == 0) {
+                continue;
+            }
+
+            RTCRayNp stream;
+            MakeStreamRays(local, stream);
+
+            rtcOccludedNp(instance->subscene->rtcScene, context, &stream, count);
+
+            for(uint lane = 0; lane < count; ++lane) {
+                RTCRayN_tfar(rays, N, lanes[lane]) = local.tfar[lane];
+            }
+        }
+        instance->geometryCache->FinishUsingSubceneGeometry(instance->subscene);
+    }
+
+    //=============================================================================================================================
+    // Two level traversal
+    //=============================================================================================================================
+
+    #define InstanceQueuePacketWidth_ 8
+
+    struct InstanceBinContext
+    {
+        // -- Must be first. Embree hands the callbacks the RTCIntersectContext pointer we passed in.
+        RTCIntersectContext rtcContext;
+        CArray<uint64>* entries;
+    };
+
+    struct InstanceQueue
+    {
+        uint32 instanceID;
+        uint32 resident;
+        uint32 start;
+        uint32 count;
+    };
+
+    //=============================================================================================================================
+    static void InstanceBoundsIntersectFunction(const RTCIntersectFunctionNArguments* args)
+    {
+        const InstanceBinContext* context = (const InstanceBinContext*)args->context;
+        const SubsceneInstanceUserData* instance = (const SubsceneInstanceUserData*)args->geometryUserPtr;
+
+        RTCRayN* rays = RTCRayHitN_RayN(args->rayhit, args->N);
+
+        const uint32 N = args->N;
+
+        // -- Never report a hit so traversal goes on to every other instance the ray overlaps.
         for(uint32 scan = 0; scan < N; ++scan) {
             if(args->valid[scan] == 0)
                 continue;
 
-            float3 origin;
-            float3 direction;
+            float3 origin = float3(RTCRayN_org_x(rays, N, scan), RTCRayN_org_y(rays, N, scan), RTCRayN_org_z(rays, N, scan));
+            float3 direction = float3(RTCRayN_dir_x(rays, N, scan), RTCRayN_dir_y(rays, N, scan), RTCRayN_dir_z(rays, N, scan));
 
-            origin.x = RTCRayN_org_x(rays, N, scan);
-            origin.y = RTCRayN_org_y(rays, N, scan);
-            origin.z = RTCRayN_org_z(rays, N, scan);
-            direction.x = RTCRayN_dir_x(rays, N, scan);
-            direction.y = RTCRayN_dir_y(rays, N, scan);
-            direction.z = RTCRayN_dir_z(rays, N, scan);
+            float tEnter;
+            if(RayEntersBox(instance->aaBox, origin, direction, RTCRayN_tnear(rays, N, scan), RTCRayN_tfar(rays, N, scan),
+                            tEnter)) {
+                context->entries->Add(((uint64)instance->instanceID << 32) | RTCRayN_id(rays, N, scan));
+            }
+        }
+    }
 
-            float3 localOrigin = MatrixMultiplyPoint(origin, instance->worldToLocal);
-            float3 localDirection = MatrixMultiplyVector(direction, instance->worldToLocal);
+    //=============================================================================================================================
+    static void IntersectInstanceQueue(const SubsceneInstanceUserData* instance, RTCRayHitNp& rayhit, const uint64* entries,
+                                       uint count)
+    {
+        RTCIntersectContext context;
+        rtcInitIntersectContext(&context);
+        context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+        for(uint start = 0; start < count; start += InstanceQueuePacketWidth_) {
+            uint packetSize = Min<uint>(count - start, InstanceQueuePacketWidth_);
+
+            Align_(32) int32 valid[InstanceQueuePacketWidth_];
+            Align_(32) RTCRayHit8 packet;
+            uint32 rayIndices[InstanceQueuePacketWidth_];
+
+            for(uint lane = 0; lane < InstanceQueuePacketWidth_; ++lane) {
+                valid[lane] = 0;
+                packet.hit.geomID[lane] = RTC_INVALID_GEOMETRY_ID;
+                if(lane >= packetSize) {
+                    continue;
+                }
+
+                uint32 ray = (uint32)(entries[start + lane] & 0xFFFFFFFF);
+                rayIndices[lane] = ray;
+                valid[lane] = -1;
+
+                float3 origin = float3(rayhit.ray.org_x[ray], rayhit.ray.org_y[ray], rayhit.ray.org_z[ray]);
+                float3 direction = float3(rayhit.ray.dir_x[ray], rayhit.ray.dir_y[ray], rayhit.ray.dir_z[ray]);
+                float3 localOrigin = MatrixMultiplyPoint(origin, instance->worldToLocal);
+                float3 localDirection = MatrixMultiplyVector(direction, instance->worldToLocal);
+
+                packet.ray.org_x[lane] = localOrigin.x;
+                packet.ray.org_y[lane] = localOrigin.y;
+                packet.ray.org_z[lane] = localOrigin.z;
+                packet.ray.dir_x[lane] = localDirection.x;
+                packet.ray.dir_y[lane] = localDirection.y;
+                packet.ray.dir_z[lane] = localDirection.z;
+                packet.ray.tnear[lane] = rayhit.ray.tnear[ray];
+                packet.ray.time[lane]  = 0.0f;
+                packet.ray.mask[lane]  = 0xFFFFFFFF;
+                packet.ray.id[lane]    = lane;
+                packet.ray.flags[lane] = 0;
+
+                // -- tfar carries the closest hit found in any earlier queue so only closer hits are reported.
+                packet.ray.tfar[lane] = rayhit.ray.tfar[ray];
+                packet.hit.instID[0][lane] = RTC_INVALID_GEOMETRY_ID;
+            }
 
-            RTCRay ray;
-            ray.org_x = localOrigin.x;
-            ray.org_y = localOrigin.y;
-            ray.org_z = localOrigin.z;
-            ray.dir_x = localDirection.x;
-            ray.dir_y = localDirection.y;
-            ray.dir_z = localDirection.z;
-            ray.tnear = RTCRayN_tnear(rays, N, scan);
-            ray.tfar = RTCRayN_tfar(rays, N, scan);
+            rtcIntersect8(valid, instance->subscene->rtcScene, &context, &packet);
+
+            for(uint lane = 0; lane < packetSize; ++lane) {
+                if(packet.hit.geomID[lane] == RTC_INVALID_GEOMETRY_ID) {
+                    continue;
+                }
+
+                uint32 ray = rayIndices[lane];
+                rayhit.ray.tfar[ray]      = packet.ray.tfar[lane];
+                rayhit.hit.Ng_x[ray]      = packet.hit.Ng_x[lane];
+                rayhit.hit.Ng_y[ray]      = packet.hit.Ng_y[lane];
+                rayhit.hit.Ng_z[ray]      = packet.hit.Ng_z[lane];
+                rayhit.hit.u[ray]         = packet.hit.u[lane];
+                rayhit.hit.v[ray]         = packet.hit.v[lane];
+                rayhit.hit.primID[ray]    = packet.hit.primID[lane];
+                rayhit.hit.geomID[ray]    = packet.hit.geomID[lane];
+                rayhit.hit.instID[0][ray] = instance->instanceID;
+                rayhit.hit.instID[1][ray] = packet.hit.instID[0][lane];
+            }
+        }
+    }
 
-            rtcOccluded1(instance->subscene->rtcScene, context, &ray);
+    //=============================================================================================================================
+    static bool TraceQueueBefore(const InstanceQueue& lhs, const InstanceQueue& rhs, const SceneResource* scene)
+    {
+        // -- Resident subscenes first so nothing gets evicted to make room for a subscene we could have traced later. Queues on
+        // -- the same subscene stay together so it is only acquired once.
+        if(lhs.resident != rhs.resident) {
+            return lhs.resident > rhs.resident;
+        }
 
-            RTCRayN_tfar(rays, N, scan) = ray.tfar;
+        uint32 lhsSubscene = scene->subsceneInstanceUserDatas[lhs.instanceID].subscene->cacheIndex;
+        uint32 rhsSubscene = scene->subsceneInstanceUserDatas[rhs.instanceID].subscene->cacheIndex;
+        if(lhsSubscene != rhsSubscene) {
+            return lhsSubscene < rhsSubscene;
         }
-        instance->geometryCache->FinishUsingSubceneGeometry(instance->subscene);
+
+        return lhs.instanceID < rhs.instanceID;
+    }
+
+    //=============================================================================================================================
+    void IntersectSceneTwoLevel(const SceneResource* scene, RTCRayHitNp& rayhit, uint count, InstanceQueueBuffers* buffers)
+    {
+        CArray<uint64>& entries = buffers->entries;
+        entries.Clear();
+
+        // -- Bin every ray into the queue of each instance whose bounds it overlaps.
+        InstanceBinContext binContext;
+        rtcInitIntersectContext(&binContext.rtcContext);
+        binContext.rtcContext.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+        binContext.entries = &entries;
+        rtcIntersectNp(scene->rtcInstanceBoundsScene, &binContext.rtcContext, &rayhit, count);
+
+        uint entryCount = (uint)entries.Count();
+        if(entryCount == 0) {
+            return;
+        }
+
+        // -- Sort by instance. The ray index rides along in the low bits.
+        buffers->scratch.Resize(entryCount);
+        ParallelRadixSort(entries.DataPointer(), buffers->scratch.DataPointer(), entryCount, 32);
+
+        CArray<InstanceQueue> queues;
+        for(uint scan = 0; scan < entryCount;) {
+            uint32 instanceID = (uint32)(entries[scan] >> 32);
+
+            InstanceQueue queue;
+            queue.instanceID = instanceID;
+            queue.resident = (uint32)scene->subsceneInstanceUserDatas[instanceID].subscene->geometryLoaded;
+            queue.start = scan;
+            while(scan < entryCount && (uint32)(entries[scan] >> 32) == instanceID) {
+                ++scan;
+            }
+            queue.count = scan - queue.start;
+
+            // -- There are only ever a handful of queues so an insertion sort is plenty.
+            uint position = (uint)queues.Count();
+            queues.Add(queue);
+            while(position > 0 && TraceQueueBefore(queue, queues[position - 1], scene)) {
+                queues[position] = queues[position - 1];
+                --position;
+            }
+            queues[position] = queue;
+        }
+
+        uint queueCount = (uint)queues.Count();
+        for(uint scan = 0; scan < queueCount;) {
+            const SubsceneInstanceUserData* instance = &scene->subsceneInstanceUserDatas[queues[scan].instanceID];
+            SubsceneResource* subscene = instance->subscene;
+
+            uint groupEnd = scan + 1;
+            while(groupEnd < queueCount && scene->subsceneInstanceUserDatas[queues[groupEnd].instanceID].subscene == subscene) {
+                ++groupEnd;
+            }
+
+            instance->geometryCache->EnsureSubsceneGeometryLoaded(subscene);
+
+            // -- Stream the next subscene in while this one is traced.
+            if(groupEnd < queueCount) {
+                const SubsceneInstanceUserData* next = &scene->subsceneInstanceUserDatas[queues[groupEnd].instanceID];
+                next->geometryCache->PrefetchSubsceneGeometry(next->subscene);
+            }
+
+            for(; scan < groupEnd; ++scan) {
+                IntersectInstanceQueue(&scene->subsceneInstanceUserDatas[queues[scan].instanceID], rayhit,
+                                       entries.DataPointer() + queues[scan].start, queues[scan].count);
+            }
+
+            instance->geometryCache->FinishUsingSubceneGeometry(subscene);
+        }
+
+        queues.Shutdown();
     }
 
     //=============================================================================================================================
@@ -217,6 +564,8 @@ namespace Selas
     //=============================================================================================================================
     static void SetupSceneInstances(SceneResource* scene, RTCDevice rtcDevice, GeometryCache* geometryCache)
     {
+        scene->rtcInstanceBoundsScene = rtcNewScene(rtcDevice);
+
         if(scene->data->subsceneInstances.Count() > 0) {
             scene->subsceneInstanceUserDatas = AllocArray_(SubsceneInstanceUserData, scene->data->subsceneInstances.Count());
 
@@ -231,6 +580,7 @@ namespace Selas
                 scene->subsceneInstanceUserDatas[scan].worldToLocal = MatrixInverse(instance.localToWorld);
                 scene->subsceneInstanceUserDatas[scan].subscene = scene->subscenes[sceneIdx];
                 scene->subsceneInstanceUserDatas[scan].instanceID = (uint32)scan;
+                scene->subsceneInstanceUserDatas[scan].nativeInstance = false;
 
                 MakeInvalid(&scene->subsceneInstanceUserDatas[scan].aaBox);
                 IncludeBox(&scene->subsceneInstanceUserDatas[scan].aaBox, scene->data->subsceneInstances[scan].localToWorld,
@@ -242,15 +592,27 @@ namespace Selas
                 rtcSetGeometryIntersectFunction(geom, SceneInstanceIntersectFunction);
                 rtcSetGeometryOccludedFunction(geom, InstanceOccludedFunction);
                 rtcCommitGeometry(geom);
-                rtcAttachGeometry(scene->rtcScene, geom);
+                rtcAttachGeometryByID(scene->rtcScene, geom, (uint32)scan);
                 rtcReleaseGeometry(geom);
+
+                RTCGeometry boundsGeom = rtcNewGeometry(rtcDevice, RTC_GEOMETRY_TYPE_USER);
+                rtcSetGeometryUserPrimitiveCount(boundsGeom, 1);
+                rtcSetGeometryUserData(boundsGeom, &scene->subsceneInstanceUserDatas[scan]);
+                rtcSetGeometryBoundsFunction(boundsGeom, SceneInstanceBoundsFunction, nullptr);
+                rtcSetGeometryIntersectFunction(boundsGeom, InstanceBoundsIntersectFunction);
+                rtcCommitGeometry(boundsGeom);
+                rtcAttachGeometry(scene->rtcInstanceBoundsScene, boundsGeom);
+                rtcReleaseGeometry(boundsGeom);
             }
         }
+
+        rtcCommitScene(scene->rtcInstanceBoundsScene);
     }
 
     //=============================================================================================================================
     SceneResource::SceneResource()
         : data(nullptr)
+        , rtcInstanceBoundsScene(nullptr)
         , subsceneInstanceUserDatas(nullptr)
         , subscenes(nullptr)
         , iblResource(nullptr)
@@ -322,16 +684,90 @@ namespace Selas
             SafeDelete_(scene->iblResource);
         }
 
+        for(uint scan = 0, count = scene->data->subsceneInstances.Count(); scan < count; ++scan) {
+            SubsceneInstanceUserData* instance = &scene->subsceneInstanceUserDatas[scan];
+            if(instance->nativeInstance) {
+                instance->geometryCache->FinishUsingSubceneGeometry(instance->subscene);
+                instance->nativeInstance = false;
+            }
+        }
+
         for(uint scan = 0, sceneCount = scene->data->subsceneNames.Count(); scan < sceneCount; ++scan) {
             ShutdownSubsceneResource(scene->subscenes[scan], textureCache);
             Delete_(scene->subscenes[scan]);
         }
       
+        if(scene->rtcInstanceBoundsScene != nullptr) {
+            rtcReleaseScene(scene->rtcInstanceBoundsScene);
+            scene->rtcInstanceBoundsScene = nullptr;
+        }
+
         SafeFree_(scene->subsceneInstanceUserDatas);
         SafeFree_(scene->subscenes);
         SafeFreeAligned_(scene->data);
     }
 
+    //=============================================================================================================================
+    void EnableNativeSubsceneInstancing(SceneResource* scene, RTCDevice rtcDevice, uint64 pinBudget)
+    {
+        uint subsceneCount = scene->data->subsceneNames.Count();
+        if(subsceneCount == 0) {
+            return;
+        }
+
+        // -- A native subscene instance puts the subscene's own instances one level deeper. Embree builds with a single level
+        // -- (like the osx middleware) would silently drop or misreport those hits.
+        if(RTC_MAX_INSTANCE_LEVEL_COUNT < 2) {
+            WriteDebugInfo_("Native instancing needs Embree built with at least two instance levels. Staying on user geometry");
+            return;
+        }
+
+        // -- Pick the subscenes that get pinned up front so one used by many instances only counts against the budget once.
+        bool* pinned = AllocArray_(bool, subsceneCount);
+        uint64 pinnedSize = 0;
+        for(uint scan = 0; scan < subsceneCount; ++scan) {
+            SubsceneResource* subscene = scene->subscenes[scan];
+            pinned[scan] = subscene->geometryLoaded == 1 && pinnedSize + subscene->geometrySizeEstimate <= pinBudget;
+            if(pinned[scan]) {
+                pinnedSize += subscene->geometrySizeEstimate;
+            }
+        }
+
+        uint nativeCount = 0;
+        for(uint scan = 0, count = scene->data->subsceneInstances.Count(); scan < count; ++scan) {
+            const Instance& instance = scene->data->subsceneInstances[scan];
+            SubsceneInstanceUserData* userData = &scene->subsceneInstanceUserDatas[scan];
+            if(userData->nativeInstance || pinned[instance.index] == false) {
+                continue;
+            }
+
+            // -- The subscene could have been evicted since it was picked. That instance just stays on the user geometry path.
+            if(userData->geometryCache->TryUseSubsceneGeometry(userData->subscene) == false) {
+                continue;
+            }
+
+            RTCGeometry geom = rtcNewGeometry(rtcDevice, RTC_GEOMETRY_TYPE_INSTANCE);
+            rtcSetGeometryInstancedScene(geom, userData->subscene->rtcScene);
+            rtcSetGeometryTimeStepCount(geom, 1);
+            rtcSetGeometryTransform(geom, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, (void*)&instance.localToWorld);
+            rtcCommitGeometry(geom);
+
+            // -- Same id as the user geometry it replaces so instId[0] still names the subscene instance.
+            rtcDetachGeometry(scene->rtcScene, (uint32)scan);
+            rtcAttachGeometryByID(scene->rtcScene, geom, (uint32)scan);
+            rtcReleaseGeometry(geom);
+
+            userData->nativeInstance = true;
+            ++nativeCount;
+        }
+
+        rtcCommitScene(scene->rtcScene);
+        Free_(pinned);
+
+        WriteDebugInfo_("Native instancing for %llu of %llu subscene instances. %lluMb of geometry pinned", nativeCount,
+                        (uint64)scene->data->subsceneInstances.Count(), pinnedSize / (1 Mb_));
+    }
+
     //=============================================================================================================================
     void SetupSceneCamera(const SceneResource* scene, uint index, uint width, uint height, RayCastCameraSettings& camera)
     {
@@ -376,4 +812,17 @@ namespace Selas
         ModelDataFromRayIds(scene->subscenes[sceneIndex], subsceneID, geomId, localToWorld, modelData);
         localToWorld = MatrixMultiply(localToWorld, scene->data->subsceneInstances[sceneID].localToWorld);
     }
+
+    //=============================================================================================================================
+    void SetDeferSubsceneLoads(bool defer)
+    {
+        deferSubsceneLoads = defer;
+    }
+
+    //=============================================================================================================================
+    SubsceneResource* SubsceneFromInstanceId(const SceneResource* scene, uint32 instId)
+    {
+        Assert_(instId < scene->data->subsceneInstances.Count());
+        return scene->subscenes[scene->data->subsceneInstances[instId].index];
+    }
 }
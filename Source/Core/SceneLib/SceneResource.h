@@ -73,6 +73,8 @@ namespace Selas
         SceneResourceData* data;
 
         RTCScene rtcScene;
+        // -- The top level instance bounds on their own. Only used to bin rays for two level traversal.
+        RTCScene rtcInstanceBoundsScene;
 
         AxisAlignedBox aaBox;
         float4 boundingSphere;
@@ -92,8 +94,37 @@ namespace Selas
     Error InitializeSceneResource(SceneResource* scene, TextureCache* cache, GeometryCache* geometryCache, RTCDevice rtcDevice);
     void ShutdownSceneResource(SceneResource* scene, TextureCache* textureCache);
 
+    // -- Swaps the user geometry of each instance whose subscene is resident for a native Embree instance of the subscene so
+    // -- Embree traverses both levels itself. Those subscenes stay pinned in the geometry cache until shutdown, at most
+    // -- pinBudget bytes of them. Instances of any other subscene keep streaming through the user geometry callbacks.
+    void EnableNativeSubsceneInstancing(SceneResource* scene, RTCDevice rtcDevice, uint64 pinBudget);
+
     void SetupSceneCamera(const SceneResource* scene, uint index, uint width, uint height, RayCastCameraSettings& camera);
 
     void ModelDataFromRayIds(const SceneResource* scene, const int32 instIds[MaxInstanceLevelCount_], int32 geomId,
                             float4x4& localToWorld, ModelGeometryUserData*& modelData);
+
+    // -- Reported as the geomId of a ray that reached a subscene that wasn't resident while loads were deferred on the thread
+    // -- that traced it. instId[0] is the subscene instance and tfar is where the ray enters the instance's bounds.
+    #define DeferredSubsceneGeomId_ 0xFFFFFFFE
+
+    // -- While set, intersect queries traced on this thread don't wait for subscenes to load. They queue the load and report a
+    // -- DeferredSubsceneGeomId_ hit instead so the ray can be traced again once the subscene is resident. Occlusion queries
+    // -- still wait.
+    void SetDeferSubsceneLoads(bool defer);
+
+    SubsceneResource* SubsceneFromInstanceId(const SceneResource* scene, uint32 instId);
+
+    // -- Scratch for IntersectSceneTwoLevel. Grows to fit the largest batch it has seen.
+    struct InstanceQueueBuffers
+    {
+        CArray<uint64> entries;
+        CArray<uint64> scratch;
+    };
+
+    // -- Traversal for scenes that don't fit in the geometry cache. Rays are first traced against the top level instance bounds
+    // -- only and binned into a queue per instance. The queues are then traced in bulk one subscene at a time. Resident
+    // -- subscenes go first and the next subscene is streamed in while the current one is traced. Fills the hit in rayhit the
+    // -- same way rtcIntersectNp would. Ray ids must hold the index of each ray.
+    void IntersectSceneTwoLevel(const SceneResource* scene, RTCRayHitNp& rayhit, uint count, InstanceQueueBuffers* buffers);
 }
@@ -87,6 +87,9 @@ namespace Selas
         , geometryLoaded(0)
         , geometryLoading()
         , lastAccessDt(0)
+        , cacheIndex(0)
+        , loadedSignal(nullptr)
+        , loadWaiterCount(0)
     {
 
     }
@@ -67,6 +67,11 @@ namespace Selas
         Align_(CacheLineSize_) volatile int64 geometryLoading;
         Align_(CacheLineSize_) volatile int64 lastAccessDt;
 
+        // -- Owned by the GeometryCache. cacheIndex also names the subscene's queue of rays parked while it streams in.
+        uint32 cacheIndex;
+        void*  loadedSignal;
+        int64  loadWaiterCount;
+
         SubsceneResource();
         ~SubsceneResource();
     };
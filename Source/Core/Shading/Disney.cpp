@@ -4,6 +4,7 @@
 //=================================================================================================================================
 
 #include "Shading/Disney.h"
+#include "Shading/DisneyWide.h"
 #include "Shading/SurfaceScattering.h"
 #include "Shading/SurfaceParameters.h"
 #include "Shading/IntegratorContexts.h"
@@ -14,6 +15,11 @@
 #include "MathLib/Trigonometric.h"
 #include "MathLib/Projection.h"
 #include "SystemLib/MinMax.h"
+#include "SystemLib/JsAssert.h"
+
+#if IsWindows_
+    #include <intrin.h>
+#endif
 
 namespace Selas
 {
@@ -657,4 +663,144 @@ namespace Selas
 
         return success;
     }
+
+    //=============================================================================================================================
+    static bool CpuSupportsDisneyWide()
+    {
+        // -- DisneyWide.cpp is built with AVX2 which also lets the compiler use FMA.
+        #if IsWindows_
+            int info[4];
+            __cpuid(info, 0);
+            if(info[0] < 7) {
+                return false;
+            }
+
+            __cpuid(info, 1);
+            bool fma = (info[2] & (1 << 12)) != 0;
+            bool osxsave = (info[2] & (1 << 27)) != 0;
+            bool avx = (info[2] & (1 << 28)) != 0;
+            if(fma == false || osxsave == false || avx == false) {
+                return false;
+            }
+
+            // -- The OS also has to save the ymm registers on context switches.
+            if((_xgetbv(0) & 0x6) != 0x6) {
+                return false;
+            }
+
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+        #else
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        #endif
+    }
+
+    //=============================================================================================================================
+    static bool DisneyWideSupported()
+    {
+        static bool supported = CpuSupportsDisneyWide();
+        return supported;
+    }
+
+    //=============================================================================================================================
+    bool CanEvaluateDisneyWide(const SurfaceParameters& surface)
+    {
+        if(DisneyWideSupported() == false) {
+            return false;
+        }
+
+        if(surface.shader != eDisneyThin && surface.shader != eDisneySolid) {
+            return false;
+        }
+
+        // -- The transmission lobe and the thin surface subsurface approximation are left to the scalar path.
+        bool thin = (surface.shader == eDisneyThin);
+        float transWeight = (1.0f - surface.metallic) * surface.specTrans;
+        return transWeight <= 0.0f && (thin == false || surface.flatness == 0.0f);
+    }
+
+    //=============================================================================================================================
+    static void FillDisneyLane(DisneyLanes& lanes, uint lane, const SurfaceParameters& surface, float3 v, float3 l)
+    {
+        float3 wo = Normalize(MatrixMultiply(v, surface.worldToTangent));
+        float3 wi = Normalize(MatrixMultiply(l, surface.worldToTangent));
+
+        lanes.woX[lane] = wo.x;
+        lanes.woY[lane] = wo.y;
+        lanes.woZ[lane] = wo.z;
+        lanes.wiX[lane] = wi.x;
+        lanes.wiY[lane] = wi.y;
+        lanes.wiZ[lane] = wi.z;
+
+        float3 tint = CalculateTint(surface.baseColor);
+        float3 R0 = Fresnel::SchlickR0FromRelativeIOR(surface.relativeIOR) * Lerp(float3(1.0f), tint, surface.specularTint);
+               R0 = Lerp(R0, surface.baseColor, surface.metallic);
+        float3 sheen = surface.sheen > 0.0f ? surface.sheen * Lerp(float3(1.0f), tint, surface.sheenTint) : float3::Zero_;
+
+        lanes.baseColorR[lane] = surface.baseColor.x;
+        lanes.baseColorG[lane] = surface.baseColor.y;
+        lanes.baseColorB[lane] = surface.baseColor.z;
+        lanes.r0R[lane] = R0.x;
+        lanes.r0G[lane] = R0.y;
+        lanes.r0B[lane] = R0.z;
+        lanes.sheenR[lane] = sheen.x;
+        lanes.sheenG[lane] = sheen.y;
+        lanes.sheenB[lane] = sheen.z;
+
+        CalculateAnisotropicParams(surface.roughness, surface.anisotropic, lanes.ax[lane], lanes.ay[lane]);
+        lanes.roughness2[lane] = surface.roughness * surface.roughness;
+        lanes.metallic[lane] = surface.metallic;
+        lanes.ior[lane] = surface.ior;
+
+        // -- GTR1 is written as clearcoatScale / (1 + clearcoatA2Minus1 * cos^2) so the log only runs once per lane.
+        float a = Lerp(0.1f, 0.001f, surface.clearcoatGloss);
+        float a2 = a * a;
+        lanes.clearcoat[lane] = surface.clearcoat;
+        lanes.clearcoatScale[lane] = (a >= 1.0f) ? InvPi_ : (a2 - 1.0f) / (Pi_ * Log2(a2));
+        lanes.clearcoatA2Minus1[lane] = (a >= 1.0f) ? 0.0f : a2 - 1.0f;
+        lanes.diffuseWeight[lane] = (1.0f - surface.metallic) * (1.0f - surface.specTrans);
+
+        float pSpecTrans;
+        CalculateLobePdfs(surface, lanes.pSpecular[lane], lanes.pDiffuse[lane], lanes.pClearcoat[lane], pSpecTrans);
+    }
+
+    //=============================================================================================================================
+    void EvaluateDisneyWide(const SurfaceParameters* const* surfaces, const float3* v, const float3* l, uint count,
+                            float3* reflectance, float* forwardPdf, float* reversePdf)
+    {
+        Assert_(count <= DisneyWideLaneCount_);
+
+        if(DisneyWideSupported() == false) {
+            for(uint lane = 0; lane < count; ++lane) {
+                bool thin = (surfaces[lane]->shader == eDisneyThin);
+                reflectance[lane] = EvaluateDisney(*surfaces[lane], v[lane], l[lane], thin, forwardPdf[lane], reversePdf[lane]);
+            }
+            return;
+        }
+
+        if(count == 0) {
+            return;
+        }
+
+        DisneyLanes lanes;
+        for(uint lane = 0; lane < DisneyWideLaneCount_; ++lane) {
+            // -- Unused lanes repeat the first entry so they stay finite. Their results are dropped.
+            uint index = lane < count ? lane : 0;
+            Assert_(CanEvaluateDisneyWide(*surfaces[index]));
+            FillDisneyLane(lanes, lane, *surfaces[index], v[index], l[index]);
+        }
+
+        Align_(32) float r[DisneyWideLaneCount_];
+        Align_(32) float g[DisneyWideLaneCount_];
+        Align_(32) float b[DisneyWideLaneCount_];
+        Align_(32) float forward[DisneyWideLaneCount_];
+        Align_(32) float reverse[DisneyWideLaneCount_];
+        EvaluateDisneyLanes(lanes, r, g, b, forward, reverse);
+
+        for(uint lane = 0; lane < count; ++lane) {
+            reflectance[lane] = float3(r[lane], g[lane], b[lane]);
+            forwardPdf[lane] = forward[lane];
+            reversePdf[lane] = reverse[lane];
+        }
+    }
 }
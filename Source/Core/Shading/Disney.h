@@ -5,6 +5,7 @@
 //=================================================================================================================================
 
 #include "MathLib/FloatStructs.h"
+#include "SystemLib/BasicTypes.h"
 
 namespace Selas
 {
@@ -18,4 +19,14 @@ namespace Selas
 
     // -- Shaders
     bool SampleDisney(CSampler* sampler, const SurfaceParameters& surface, float3 v, bool thin, BsdfSample& sample);
+
+    #define DisneyWideLaneCount_ 8
+
+    // -- True when EvaluateDisneyWide handles this surface. The wide path covers the BRDF, clearcoat, sheen and diffuse lobes
+    // -- and is only used when the cpu supports AVX2.
+    bool CanEvaluateDisneyWide(const SurfaceParameters& surface);
+
+    // -- EvaluateDisney for up to DisneyWideLaneCount_ surfaces at once. Every surface must pass CanEvaluateDisneyWide.
+    void EvaluateDisneyWide(const SurfaceParameters* const* surfaces, const float3* v, const float3* l, uint count,
+                            float3* reflectance, float* forwardPdf, float* reversePdf);
 }
\ No newline at end of file
@@ -0,0 +1,261 @@
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#include "Shading/DisneyWide.h"
+#include "MathLib/Trigonometric.h"
+
+#include <immintrin.h>
+
+// -- Shading/LibraryDependencies.lua turns on AVX2 for this file alone. Only intrinsics are used in here so no inline function
+// -- from a shared header gets an AVX2 copy that the linker could hand to the rest of the library.
+#if !defined(__AVX2__)
+    #error "DisneyWide.cpp must be built with AVX2"
+#endif
+
+namespace Selas
+{
+    using namespace Math;
+
+    //=============================================================================================================================
+    static __m256 Wide(float value)
+    {
+        return _mm256_set1_ps(value);
+    }
+
+    //=============================================================================================================================
+    static __m256 AbsWide(__m256 x)
+    {
+        return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x);
+    }
+
+    //=============================================================================================================================
+    static __m256 SelectWide(__m256 mask, __m256 a)
+    {
+        return _mm256_and_ps(mask, a);
+    }
+
+    //=============================================================================================================================
+    static __m256 SchlickWeightWide(__m256 u)
+    {
+        __m256 m = _mm256_min_ps(_mm256_max_ps(_mm256_sub_ps(Wide(1.0f), u), Wide(0.0f)), Wide(1.0f));
+        __m256 m2 = _mm256_mul_ps(m, m);
+        return _mm256_mul_ps(m, _mm256_mul_ps(m2, m2));
+    }
+
+    //=============================================================================================================================
+    static __m256 DielectricWide(__m256 cosThetaI, __m256 ior)
+    {
+        // -- Fresnel::Dielectric with ni = 1 and nt = ior.
+        cosThetaI = _mm256_min_ps(_mm256_max_ps(cosThetaI, Wide(-1.0f)), Wide(1.0f));
+
+        __m256 inside = _mm256_cmp_ps(cosThetaI, Wide(0.0f), _CMP_LT_OQ);
+        __m256 ni = _mm256_blendv_ps(Wide(1.0f), ior, inside);
+        __m256 nt = _mm256_blendv_ps(ior, Wide(1.0f), inside);
+        cosThetaI = AbsWide(cosThetaI);
+
+        __m256 cos2ThetaI = _mm256_mul_ps(cosThetaI, cosThetaI);
+        __m256 sinThetaI = _mm256_sqrt_ps(_mm256_max_ps(Wide(0.0f), _mm256_sub_ps(Wide(1.0f), cos2ThetaI)));
+        __m256 sinThetaT = _mm256_mul_ps(_mm256_div_ps(ni, nt), sinThetaI);
+        __m256 totalInternalReflection = _mm256_cmp_ps(sinThetaT, Wide(1.0f), _CMP_GE_OQ);
+
+        __m256 sin2ThetaT = _mm256_mul_ps(sinThetaT, sinThetaT);
+        __m256 cosThetaT = _mm256_sqrt_ps(_mm256_max_ps(Wide(0.0f), _mm256_sub_ps(Wide(1.0f), sin2ThetaT)));
+
+        __m256 ntCosI = _mm256_mul_ps(nt, cosThetaI);
+        __m256 niCosT = _mm256_mul_ps(ni, cosThetaT);
+        __m256 niCosI = _mm256_mul_ps(ni, cosThetaI);
+        __m256 ntCosT = _mm256_mul_ps(nt, cosThetaT);
+
+        __m256 rParallel = _mm256_div_ps(_mm256_sub_ps(ntCosI, niCosT), _mm256_add_ps(ntCosI, niCosT));
+        __m256 rPerpendicular = _mm256_div_ps(_mm256_sub_ps(niCosI, ntCosT), _mm256_add_ps(niCosI, ntCosT));
+        __m256 result = _mm256_mul_ps(Wide(0.5f), _mm256_add_ps(_mm256_mul_ps(rParallel, rParallel),
+                                                                 _mm256_mul_ps(rPerpendicular, rPerpendicular)));
+
+        return _mm256_blendv_ps(result, Wide(1.0f), totalInternalReflection);
+    }
+
+    //=============================================================================================================================
+    static __m256 SeparableSmithGGXG1Wide(__m256 x, __m256 y, __m256 z, __m256 ax2, __m256 ay2)
+    {
+        // -- (Cos2Phi * ax^2 + Sin2Phi * ay^2) * Tan2Theta simplifies to (x^2 * ax^2 + z^2 * ay^2) / y^2 for unit vectors. Only
+        // -- called for vectors in the upper hemisphere so y is never zero.
+        __m256 a2Tan2Theta = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(x, x), ax2),
+                                                         _mm256_mul_ps(_mm256_mul_ps(z, z), ay2)), _mm256_mul_ps(y, y));
+        __m256 lambda = _mm256_mul_ps(Wide(0.5f), _mm256_sub_ps(_mm256_sqrt_ps(_mm256_add_ps(Wide(1.0f), a2Tan2Theta)),
+                                                                Wide(1.0f)));
+        return _mm256_div_ps(Wide(1.0f), _mm256_add_ps(Wide(1.0f), lambda));
+    }
+
+    //=============================================================================================================================
+    static __m256 SeparableSmithGGXG1Wide(__m256 y, float a)
+    {
+        float a2 = a * a;
+        __m256 absDotNV = AbsWide(y);
+        __m256 root = _mm256_sqrt_ps(_mm256_add_ps(Wide(a2), _mm256_mul_ps(Wide(1.0f - a2), _mm256_mul_ps(absDotNV, absDotNV))));
+        return _mm256_div_ps(Wide(2.0f), _mm256_add_ps(Wide(1.0f), root));
+    }
+
+    //=============================================================================================================================
+    static __m256 DotWide(__m256 ax, __m256 ay, __m256 az, __m256 bx, __m256 by, __m256 bz)
+    {
+        return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, bx), _mm256_mul_ps(ay, by)), _mm256_mul_ps(az, bz));
+    }
+
+    //=============================================================================================================================
+    void EvaluateDisneyLanes(const DisneyLanes& lanes, float* outR, float* outG, float* outB, float* outForward,
+                             float* outReverse)
+    {
+        __m256 woX = _mm256_load_ps(lanes.woX);
+        __m256 woY = _mm256_load_ps(lanes.woY);
+        __m256 woZ = _mm256_load_ps(lanes.woZ);
+        __m256 wiX = _mm256_load_ps(lanes.wiX);
+        __m256 wiY = _mm256_load_ps(lanes.wiY);
+        __m256 wiZ = _mm256_load_ps(lanes.wiZ);
+
+        // -- wm = Normalize(wo + wi)
+        __m256 wmX = _mm256_add_ps(woX, wiX);
+        __m256 wmY = _mm256_add_ps(woY, wiY);
+        __m256 wmZ = _mm256_add_ps(woZ, wiZ);
+        __m256 invLength = _mm256_div_ps(Wide(1.0f), _mm256_sqrt_ps(DotWide(wmX, wmY, wmZ, wmX, wmY, wmZ)));
+        wmX = _mm256_mul_ps(wmX, invLength);
+        wmY = _mm256_mul_ps(wmY, invLength);
+        wmZ = _mm256_mul_ps(wmZ, invLength);
+
+        __m256 dotNV = woY;
+        __m256 dotNL = wiY;
+        __m256 absDotNV = AbsWide(dotNV);
+        __m256 absDotNL = AbsWide(dotNL);
+        __m256 dotHL = DotWide(wmX, wmY, wmZ, wiX, wiY, wiZ);
+        __m256 dotHV = DotWide(wmX, wmY, wmZ, woX, woY, woZ);
+        __m256 absDotHL = AbsWide(dotHL);
+        __m256 absDotHV = AbsWide(dotHV);
+
+        __m256 upperHemisphere = _mm256_and_ps(_mm256_cmp_ps(dotNL, Wide(0.0f), _CMP_GT_OQ),
+                                               _mm256_cmp_ps(dotNV, Wide(0.0f), _CMP_GT_OQ));
+
+        __m256 reflectanceR = Wide(0.0f);
+        __m256 reflectanceG = Wide(0.0f);
+        __m256 reflectanceB = Wide(0.0f);
+        __m256 forwardPdf = Wide(0.0f);
+        __m256 reversePdf = Wide(0.0f);
+
+        // -- Clearcoat
+        {
+            __m256 clearcoat = _mm256_load_ps(lanes.clearcoat);
+            __m256 mask = _mm256_and_ps(upperHemisphere, _mm256_cmp_ps(clearcoat, Wide(0.0f), _CMP_GT_OQ));
+
+            __m256 absDotNH = AbsWide(wmY);
+            __m256 d = _mm256_div_ps(_mm256_load_ps(lanes.clearcoatScale),
+                                     _mm256_add_ps(Wide(1.0f), _mm256_mul_ps(_mm256_load_ps(lanes.clearcoatA2Minus1),
+                                                                             _mm256_mul_ps(absDotNH, absDotNH))));
+            __m256 f = _mm256_add_ps(Wide(1.0f - 0.04f), _mm256_mul_ps(Wide(0.04f), SchlickWeightWide(dotHL)));
+            __m256 gl = SeparableSmithGGXG1Wide(wiY, 0.25f);
+            __m256 gv = SeparableSmithGGXG1Wide(woY, 0.25f);
+
+            __m256 value = _mm256_mul_ps(_mm256_mul_ps(Wide(0.25f), clearcoat), _mm256_mul_ps(_mm256_mul_ps(d, f),
+                                                                                              _mm256_mul_ps(gl, gv)));
+            value = SelectWide(mask, value);
+            reflectanceR = _mm256_add_ps(reflectanceR, value);
+            reflectanceG = _mm256_add_ps(reflectanceG, value);
+            reflectanceB = _mm256_add_ps(reflectanceB, value);
+
+            __m256 pClearcoat = _mm256_load_ps(lanes.pClearcoat);
+            __m256 fPdf = _mm256_div_ps(d, _mm256_mul_ps(Wide(4.0f), absDotHV));
+            __m256 rPdf = _mm256_div_ps(d, _mm256_mul_ps(Wide(4.0f), absDotHL));
+            forwardPdf = _mm256_add_ps(forwardPdf, SelectWide(mask, _mm256_mul_ps(pClearcoat, fPdf)));
+            reversePdf = _mm256_add_ps(reversePdf, SelectWide(mask, _mm256_mul_ps(pClearcoat, rPdf)));
+        }
+
+        // -- Diffuse and sheen
+        {
+            __m256 diffuseWeight = _mm256_load_ps(lanes.diffuseWeight);
+            __m256 mask = _mm256_cmp_ps(diffuseWeight, Wide(0.0f), _CMP_GT_OQ);
+
+            __m256 fl = SchlickWeightWide(absDotNL);
+            __m256 fv = SchlickWeightWide(absDotNV);
+
+            __m256 rr = _mm256_add_ps(Wide(0.5f), _mm256_mul_ps(_mm256_mul_ps(Wide(2.0f), _mm256_mul_ps(absDotNL, absDotNL)),
+                                                                _mm256_load_ps(lanes.roughness2)));
+            __m256 retro = _mm256_mul_ps(rr, _mm256_add_ps(_mm256_add_ps(fl, fv),
+                                                           _mm256_mul_ps(_mm256_mul_ps(fl, fv), _mm256_sub_ps(rr, Wide(1.0f)))));
+            __m256 lambert = _mm256_mul_ps(_mm256_sub_ps(Wide(1.0f), _mm256_mul_ps(Wide(0.5f), fl)),
+                                           _mm256_sub_ps(Wide(1.0f), _mm256_mul_ps(Wide(0.5f), fv)));
+            __m256 diffuse = _mm256_mul_ps(Wide(InvPi_), _mm256_add_ps(retro, lambert));
+            __m256 sheenWeight = SchlickWeightWide(absDotHL);
+
+            __m256 r = _mm256_add_ps(_mm256_mul_ps(diffuse, _mm256_load_ps(lanes.baseColorR)),
+                                     _mm256_mul_ps(_mm256_load_ps(lanes.sheenR), sheenWeight));
+            __m256 g = _mm256_add_ps(_mm256_mul_ps(diffuse, _mm256_load_ps(lanes.baseColorG)),
+                                     _mm256_mul_ps(_mm256_load_ps(lanes.sheenG), sheenWeight));
+            __m256 b = _mm256_add_ps(_mm256_mul_ps(diffuse, _mm256_load_ps(lanes.baseColorB)),
+                                     _mm256_mul_ps(_mm256_load_ps(lanes.sheenB), sheenWeight));
+            reflectanceR = _mm256_add_ps(reflectanceR, SelectWide(mask, _mm256_mul_ps(diffuseWeight, r)));
+            reflectanceG = _mm256_add_ps(reflectanceG, SelectWide(mask, _mm256_mul_ps(diffuseWeight, g)));
+            reflectanceB = _mm256_add_ps(reflectanceB, SelectWide(mask, _mm256_mul_ps(diffuseWeight, b)));
+
+            __m256 pDiffuse = _mm256_load_ps(lanes.pDiffuse);
+            forwardPdf = _mm256_add_ps(forwardPdf, SelectWide(mask, _mm256_mul_ps(pDiffuse, absDotNL)));
+            reversePdf = _mm256_add_ps(reversePdf, SelectWide(mask, _mm256_mul_ps(pDiffuse, absDotNV)));
+        }
+
+        // -- Specular
+        {
+            __m256 ax = _mm256_load_ps(lanes.ax);
+            __m256 ay = _mm256_load_ps(lanes.ay);
+            __m256 ax2 = _mm256_mul_ps(ax, ax);
+            __m256 ay2 = _mm256_mul_ps(ay, ay);
+
+            __m256 dTerm = _mm256_add_ps(_mm256_add_ps(_mm256_div_ps(_mm256_mul_ps(wmX, wmX), ax2),
+                                                       _mm256_div_ps(_mm256_mul_ps(wmZ, wmZ), ay2)), _mm256_mul_ps(wmY, wmY));
+            __m256 d = _mm256_div_ps(Wide(1.0f), _mm256_mul_ps(_mm256_mul_ps(Wide(Pi_), _mm256_mul_ps(ax, ay)),
+                                                               _mm256_mul_ps(dTerm, dTerm)));
+            __m256 gl = SeparableSmithGGXG1Wide(wiX, wiY, wiZ, ax2, ay2);
+            __m256 gv = SeparableSmithGGXG1Wide(woX, woY, woZ, ax2, ay2);
+
+            __m256 metallic = _mm256_load_ps(lanes.metallic);
+            __m256 dielectric = DielectricWide(dotHV, _mm256_load_ps(lanes.ior));
+
+            __m256 m = _mm256_sub_ps(Wide(1.0f), dotHL);
+            __m256 m2 = _mm256_mul_ps(m, m);
+            __m256 schlick = _mm256_mul_ps(m, _mm256_mul_ps(m2, m2));
+
+            __m256 r0R = _mm256_load_ps(lanes.r0R);
+            __m256 r0G = _mm256_load_ps(lanes.r0G);
+            __m256 r0B = _mm256_load_ps(lanes.r0B);
+            __m256 fresnelR = _mm256_add_ps(r0R, _mm256_mul_ps(_mm256_sub_ps(Wide(1.0f), r0R), schlick));
+            __m256 fresnelG = _mm256_add_ps(r0G, _mm256_mul_ps(_mm256_sub_ps(Wide(1.0f), r0G), schlick));
+            __m256 fresnelB = _mm256_add_ps(r0B, _mm256_mul_ps(_mm256_sub_ps(Wide(1.0f), r0B), schlick));
+
+            __m256 dielectricPart = _mm256_mul_ps(_mm256_sub_ps(Wide(1.0f), metallic), dielectric);
+            fresnelR = _mm256_add_ps(dielectricPart, _mm256_mul_ps(metallic, fresnelR));
+            fresnelG = _mm256_add_ps(dielectricPart, _mm256_mul_ps(metallic, fresnelG));
+            fresnelB = _mm256_add_ps(dielectricPart, _mm256_mul_ps(metallic, fresnelB));
+
+            __m256 scale = _mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(d, gl), gv),
+                                         _mm256_mul_ps(Wide(4.0f), _mm256_mul_ps(dotNL, dotNV)));
+            reflectanceR = _mm256_add_ps(reflectanceR, SelectWide(upperHemisphere, _mm256_mul_ps(scale, fresnelR)));
+            reflectanceG = _mm256_add_ps(reflectanceG, SelectWide(upperHemisphere, _mm256_mul_ps(scale, fresnelG)));
+            reflectanceB = _mm256_add_ps(reflectanceB, SelectWide(upperHemisphere, _mm256_mul_ps(scale, fresnelB)));
+
+            // -- GgxVndfAnisotropicPdf followed by the reflection jacobian. EvaluateDisney applies the jacobian a second time
+            // -- when it weights the lobe so that is repeated here to keep both paths identical.
+            __m256 jacobianV = _mm256_div_ps(Wide(1.0f), _mm256_mul_ps(Wide(4.0f), absDotHV));
+            __m256 jacobianL = _mm256_div_ps(Wide(1.0f), _mm256_mul_ps(Wide(4.0f), absDotHL));
+            __m256 fPdf = _mm256_mul_ps(_mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(gv, absDotHL), d), absDotNL), jacobianV);
+            __m256 rPdf = _mm256_mul_ps(_mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(gl, absDotHV), d), absDotNV), jacobianL);
+
+            __m256 pSpecular = _mm256_load_ps(lanes.pSpecular);
+            forwardPdf = _mm256_add_ps(forwardPdf, SelectWide(upperHemisphere, _mm256_mul_ps(_mm256_mul_ps(pSpecular, fPdf),
+                                                                                             jacobianV)));
+            reversePdf = _mm256_add_ps(reversePdf, SelectWide(upperHemisphere, _mm256_mul_ps(_mm256_mul_ps(pSpecular, rPdf),
+                                                                                             jacobianL)));
+        }
+
+        _mm256_store_ps(outR, _mm256_mul_ps(reflectanceR, absDotNL));
+        _mm256_store_ps(outG, _mm256_mul_ps(reflectanceG, absDotNL));
+        _mm256_store_ps(outB, _mm256_mul_ps(reflectanceB, absDotNL));
+        _mm256_store_ps(outForward, forwardPdf);
+        _mm256_store_ps(outReverse, reversePdf);
+    }
+}
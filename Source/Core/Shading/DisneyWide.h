@@ -0,0 +1,52 @@
+#pragma once
+
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#include "Shading/Disney.h"
+#include "SystemLib/BasicTypes.h"
+
+namespace Selas
+{
+    // -- Per lane inputs for EvaluateDisneyLanes. Anything that only depends on the material is worked out one lane at a time
+    // -- in Disney.cpp while transposing since it needs logs and branches that aren't worth vectorizing.
+    struct DisneyLanes
+    {
+        Align_(32) float woX[DisneyWideLaneCount_];
+        Align_(32) float woY[DisneyWideLaneCount_];
+        Align_(32) float woZ[DisneyWideLaneCount_];
+        Align_(32) float wiX[DisneyWideLaneCount_];
+        Align_(32) float wiY[DisneyWideLaneCount_];
+        Align_(32) float wiZ[DisneyWideLaneCount_];
+
+        Align_(32) float baseColorR[DisneyWideLaneCount_];
+        Align_(32) float baseColorG[DisneyWideLaneCount_];
+        Align_(32) float baseColorB[DisneyWideLaneCount_];
+        Align_(32) float r0R[DisneyWideLaneCount_];
+        Align_(32) float r0G[DisneyWideLaneCount_];
+        Align_(32) float r0B[DisneyWideLaneCount_];
+        Align_(32) float sheenR[DisneyWideLaneCount_];
+        Align_(32) float sheenG[DisneyWideLaneCount_];
+        Align_(32) float sheenB[DisneyWideLaneCount_];
+
+        Align_(32) float ax[DisneyWideLaneCount_];
+        Align_(32) float ay[DisneyWideLaneCount_];
+        Align_(32) float roughness2[DisneyWideLaneCount_];
+        Align_(32) float metallic[DisneyWideLaneCount_];
+        Align_(32) float ior[DisneyWideLaneCount_];
+        Align_(32) float clearcoat[DisneyWideLaneCount_];
+        Align_(32) float clearcoatScale[DisneyWideLaneCount_];
+        Align_(32) float clearcoatA2Minus1[DisneyWideLaneCount_];
+        Align_(32) float diffuseWeight[DisneyWideLaneCount_];
+
+        Align_(32) float pSpecular[DisneyWideLaneCount_];
+        Align_(32) float pDiffuse[DisneyWideLaneCount_];
+        Align_(32) float pClearcoat[DisneyWideLaneCount_];
+    };
+
+    // -- The vectorized half of EvaluateDisneyWide. DisneyWide.cpp is the only file built with AVX2 so this must only be called
+    // -- once the cpu has been checked.
+    void EvaluateDisneyLanes(const DisneyLanes& lanes, float* outR, float* outG, float* outB, float* outForward,
+                             float* outReverse);
+}
@@ -2,4 +2,13 @@
 local platform = ...
 
 loadfile(RootDirectory .. "ProjectGen\\Middlewares\\embree.lua")(platform)
-loadfile(RootDirectory .. "ProjectGen\\Middlewares\\ptex.lua")(platform)
\ No newline at end of file
+loadfile(RootDirectory .. "ProjectGen\\Middlewares\\ptex.lua")(platform)
+
+-- Only the vectorized Disney lanes are built with AVX2. Disney.cpp checks the cpu before calling into them.
+configuration { "**/DisneyWide.cpp" }
+    if platform == "Win64" then
+        buildoptions { "/arch:AVX2" }
+    else
+        buildoptions { "-mavx2" }
+    end
+configuration {}
@@ -1,56 +1,42 @@
-
 //=================================================================================================================================
 // Joe Schutte
 //=================================================================================================================================
 
 #include "Shading/PathTracingBatcher.h"
-#include "UtilityLib/QuickSort.h"
+#include "UtilityLib/RadixSort.h"
 #include "StringLib/FixedString.h"
 #include "StringLib/StringUtil.h"
 #include "MathLib/Trigonometric.h"
 #include "MathLib/FloatFuncs.h"
+#include "MathLib/PackedFormats.h"
+#include "IoLib/MappedFile.h"
+#include "IoLib/File.h"
 #include "IoLib/Directory.h"
 #include "IoLib/Environment.h"
 #include "SystemLib/Atomic.h"
 #include "SystemLib/OSThreading.h"
 #include "SystemLib/MinMax.h"
+#include "SystemLib/Memory.h"
+#include "SystemLib/MemoryAllocation.h"
+#include "SystemLib/Profiling.h"
+#include "ThreadingLib/Thread.h"
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 namespace Selas
 {
-    // -- Hmm... maybe just add array operators for float2/float3/float4?
-    struct DeferredRaySortX : public DeferredRay
-    {
-        float Position() const { return ray.origin.x; }
-        float Direction() const { return ray.direction.x; }
-    };
-    struct DeferredRaySortY : public DeferredRay
-    {
-        float Position() const { return ray.origin.y; }
-        float Direction() const { return ray.direction.y; }
-    };
-    struct DeferredRaySortZ : public DeferredRay
-    {
-        float Position() const { return ray.origin.z; }
-        float Direction() const { return ray.direction.z; }
-    };
-    struct OcclusionRaySortX : public OcclusionRay
-    {
-        float Position() const { return ray.origin.x; }
-        float Direction() const { return ray.direction.x; }
-    };
-    struct OcclusionRaySortY : public OcclusionRay
-    {
-        float Position() const { return ray.origin.y; }
-        float Direction() const { return ray.direction.y; }
-    };
-    struct OcclusionRaySortZ : public OcclusionRay
-    {
-        float Position() const { return ray.origin.z; }
-        float Direction() const { return ray.direction.z; }
-    };
+    #define PreparedBatchCount_ 2
+    #define MaxSemaphoreCount_  0x7FFFFFFF
+    #define WaitForever_        0xFFFFFFFF
+
+    // -- Ray sort values are a 33 bit coherence key with the ray's index in the batch packed below it.
+    #define CoherenceIndexBits_ 31
+    #define CoherenceIndexMask_ ((1ull << CoherenceIndexBits_) - 1)
+    #define HitSortIndexBits_   32
+    #define HitSortIndexMask_   ((1ull << HitSortIndexBits_) - 1)
+    #define HitSortFieldCount_  (MaxInstanceLevelCount_ + 2)
+    #define MortonAxisCells_    1024
 
     //=================================================================================================================================
     static FilePathString CreateBatchFilePath(int64 index)
@@ -66,24 +52,385 @@ namespace Selas
     }
 
     //=================================================================================================================================
-    struct DeferredBatch
+    // Spilled batches are written in a packed format to cut down on disk traffic. Positions stay at full precision since the
+    // batches are sorted and traced by them. Throughput and occlusion values also stay at full precision since they can be far
+    // outside the range of any compact color format after low pdf bounces. Directions and normals are stored octahedral and the
+    // indices as zigzag varints of the delta from the previous entry.
+    //=================================================================================================================================
+    #define MaxVarintSize_              5
+    #define PackedDeferredRaySize_      (2 * sizeof(float3) + 2 * sizeof(uint32) + MaxVarintSize_)
+    #define PackedOcclusionRaySize_     (2 * sizeof(float3) + 2 * sizeof(uint32) + MaxVarintSize_)
+    #define PackedHitSize_              (2 * sizeof(float3) + 4 * sizeof(uint32) + (3 + MaxInstanceLevelCount_) * MaxVarintSize_)
+
+    //=================================================================================================================================
+    static uint32 ZigZag(int32 value)
     {
-        DeferredBatch()
-            : fileHandle(INVALID_HANDLE_VALUE)
-            , mappingHandle(INVALID_HANDLE_VALUE)
-        {
+        return ((uint32)value << 1) ^ (uint32)(value >> 31);
+    }
+
+    //=================================================================================================================================
+    static int32 UnZigZag(uint32 value)
+    {
+        return (int32)(value >> 1) ^ -(int32)(value & 1);
+    }
+
+    //=================================================================================================================================
+    static void WriteVarint(uint8*& cursor, uint32 value)
+    {
+        while(value >= 0x80) {
+            *cursor++ = (uint8)(value | 0x80);
+            value >>= 7;
+        }
+        *cursor++ = (uint8)value;
+    }
+
+    //=================================================================================================================================
+    static uint32 ReadVarint(const uint8*& cursor)
+    {
+        uint32 value = 0;
+        uint32 shift = 0;
+        while(*cursor & 0x80) {
+            value |= (uint32)(*cursor++ & 0x7F) << shift;
+            shift += 7;
+        }
+        value |= (uint32)(*cursor++) << shift;
+
+        return value;
+    }
+
+    //=================================================================================================================================
+    template<typename Type_>
+    static void WriteValue(uint8*& cursor, const Type_& value)
+    {
+        Memory::Copy(cursor, &value, sizeof(Type_));
+        cursor += sizeof(Type_);
+    }
+
+    //=================================================================================================================================
+    template<typename Type_>
+    static Type_ ReadValue(const uint8*& cursor)
+    {
+        Type_ value;
+        Memory::Copy(&value, cursor, sizeof(Type_));
+        cursor += sizeof(Type_);
+
+        return value;
+    }
+
+    //=================================================================================================================================
+    static uint64 MaxPackedSize(const DeferredRay* rays, uint64 count)
+    {
+        Unused_(rays);
+        return count * PackedDeferredRaySize_;
+    }
+
+    //=================================================================================================================================
+    static void PackEntries(const DeferredRay* rays, uint64 count, uint8*& cursor)
+    {
+        uint32 prevIndex = 0;
+        for(uint64 scan = 0; scan < count; ++scan) {
+            const DeferredRay& dray = rays[scan];
+
+            WriteValue(cursor, dray.ray.origin);
+            WriteValue(cursor, Math::PackOctahedral(dray.ray.direction));
+            WriteValue(cursor, dray.throughput);
+            WriteValue(cursor, dray.error);
+
+            uint32 flags = dray.trackedBounces | (dray.diracScatterOnly << 3);
+            WriteVarint(cursor, (ZigZag((int32)dray.index - (int32)prevIndex) << 4) | flags);
+            prevIndex = dray.index;
+        }
+    }
+
+    //=================================================================================================================================
+    static void UnpackEntries(const uint8*& cursor, uint64 count, DeferredRay* rays)
+    {
+        uint32 prevIndex = 0;
+        for(uint64 scan = 0; scan < count; ++scan) {
+            DeferredRay& dray = rays[scan];
+
+            float3 origin = ReadValue<float3>(cursor);
+            float3 direction = Math::UnpackOctahedral(ReadValue<uint32>(cursor));
+            dray.ray = MakeRay(origin, direction);
+            dray.throughput = ReadValue<float3>(cursor);
+            dray.error = ReadValue<float>(cursor);
+
+            uint32 packed = ReadVarint(cursor);
+            dray.index = (uint32)((int32)prevIndex + UnZigZag(packed >> 4));
+            dray.trackedBounces = packed & 0x7;
+            dray.diracScatterOnly = (packed >> 3) & 0x1;
+            dray.unused = 0;
+            prevIndex = dray.index;
+        }
+    }
+
+    //=================================================================================================================================
+    static uint64 MaxPackedSize(const OcclusionRay* rays, uint64 count)
+    {
+        Unused_(rays);
+        return count * PackedOcclusionRaySize_;
+    }
 
+    //=================================================================================================================================
+    static void PackEntries(const OcclusionRay* rays, uint64 count, uint8*& cursor)
+    {
+        uint32 prevIndex = 0;
+        for(uint64 scan = 0; scan < count; ++scan) {
+            const OcclusionRay& oray = rays[scan];
+
+            WriteValue(cursor, oray.ray.origin);
+            WriteValue(cursor, Math::PackOctahedral(oray.ray.direction));
+            WriteValue(cursor, oray.distance);
+            WriteValue(cursor, oray.value);
+            WriteVarint(cursor, ZigZag((int32)oray.index - (int32)prevIndex));
+            prevIndex = oray.index;
         }
+    }
 
+    //=================================================================================================================================
+    static void UnpackEntries(const uint8*& cursor, uint64 count, OcclusionRay* rays)
+    {
+        uint32 prevIndex = 0;
+        for(uint64 scan = 0; scan < count; ++scan) {
+            OcclusionRay& oray = rays[scan];
+
+            float3 origin = ReadValue<float3>(cursor);
+            float3 direction = Math::UnpackOctahedral(ReadValue<uint32>(cursor));
+            oray.ray = MakeRay(origin, direction);
+            oray.distance = ReadValue<float>(cursor);
+            oray.value = ReadValue<float3>(cursor);
+            oray.index = (uint32)((int32)prevIndex + UnZigZag(ReadVarint(cursor)));
+            prevIndex = oray.index;
+        }
+    }
+
+    //=================================================================================================================================
+    static uint64 MaxPackedSize(const HitParameters* hits, uint64 count)
+    {
+        Unused_(hits);
+        return count * PackedHitSize_;
+    }
+
+    //=================================================================================================================================
+    static void PackEntries(const HitParameters* hits, uint64 count, uint8*& cursor)
+    {
+        uint32 prevIndex = 0;
+        for(uint64 scan = 0; scan < count; ++scan) {
+            const HitParameters& hit = hits[scan];
+
+            WriteValue(cursor, hit.position);
+            WriteValue(cursor, Math::PackOctahedral(hit.normal));
+            WriteValue(cursor, Math::PackOctahedral(hit.view));
+            WriteValue(cursor, hit.throughput);
+            WriteValue(cursor, hit.error);
+            WriteValue(cursor, Math::PackUnorm16x2(hit.baryCoords));
+
+            uint32 flags = hit.trackedBounces | (hit.diracScatterOnly << 3);
+            WriteVarint(cursor, (ZigZag((int32)hit.index - (int32)prevIndex) << 4) | flags);
+            prevIndex = hit.index;
+
+            WriteVarint(cursor, ZigZag(hit.geomId));
+            WriteVarint(cursor, ZigZag(hit.primId));
+            for(uint level = 0; level < MaxInstanceLevelCount_; ++level) {
+                WriteVarint(cursor, ZigZag(hit.instId[level]));
+            }
+        }
+    }
+
+    //=================================================================================================================================
+    static void UnpackEntries(const uint8*& cursor, uint64 count, HitParameters* hits)
+    {
+        uint32 prevIndex = 0;
+        for(uint64 scan = 0; scan < count; ++scan) {
+            HitParameters& hit = hits[scan];
+
+            hit.position = ReadValue<float3>(cursor);
+            hit.normal = Math::UnpackOctahedral(ReadValue<uint32>(cursor));
+            hit.view = Math::UnpackOctahedral(ReadValue<uint32>(cursor));
+            hit.throughput = ReadValue<float3>(cursor);
+            hit.error = ReadValue<float>(cursor);
+            hit.baryCoords = Math::UnpackUnorm16x2(ReadValue<uint32>(cursor));
+
+            uint32 packed = ReadVarint(cursor);
+            hit.index = (uint32)((int32)prevIndex + UnZigZag(packed >> 4));
+            hit.trackedBounces = packed & 0x7;
+            hit.diracScatterOnly = (packed >> 3) & 0x1;
+            hit.unused = 0;
+            prevIndex = hit.index;
+
+            hit.geomId = UnZigZag(ReadVarint(cursor));
+            hit.primId = UnZigZag(ReadVarint(cursor));
+            for(uint level = 0; level < MaxInstanceLevelCount_; ++level) {
+                hit.instId[level] = UnZigZag(ReadVarint(cursor));
+            }
+        }
+    }
+
+    //=================================================================================================================================
+    template<typename Type_>
+    static Error WriteBatchFile(int64 index, const Type_* entries, uint64 count, uint64& fileSize)
+    {
+        ProfileScope_("WriteBatchFile");
+
+        FilePathString filepath = CreateBatchFilePath(index);
+
+        Directory::EnsureDirectoryExists(filepath.Ascii());
+
+        MappedFile file;
+        ReturnError_(MappedFile_Create(filepath.Ascii(), sizeof(uint64) + MaxPackedSize(entries, count), &file));
+
+        uint8* cursor = (uint8*)file.memory;
+        WriteValue(cursor, count);
+        PackEntries(entries, count, cursor);
+
+        fileSize = (uint64)(cursor - (uint8*)file.memory);
+        MappedFile_Close(&file, fileSize);
+
+        return Success_;
+    }
+
+    //=================================================================================================================================
+    template<typename Type_>
+    static Error ReadAndDeleteBatchFile(int64 index, uint64 capacity, volatile uint64* bytesRead, Type_*& entries)
+    {
+        ProfileScope_("ReadBatchFile");
+
+        FilePathString filepath = CreateBatchFilePath(index);
+
+        // -- Entries are unpacked straight out of the mapping so the file is never copied whole into the heap.
+        MappedFile file;
+        ReturnError_(MappedFile_Open(filepath.Ascii(), &file));
+
+        uint64 fileSize = file.size;
+        Atomic::AddU64(bytesRead, fileSize);
+
+        const uint8* cursor = (const uint8*)file.memory;
+        uint64 count = ReadValue<uint64>(cursor);
+        if(count > capacity) {
+            MappedFile_Close(&file, fileSize);
+            return Error_("Batch file %s holds more entries than a batch can", filepath.Ascii());
+        }
+
+        entries = AllocArrayAligned_(Type_, capacity, CacheLineSize_);
+        UnpackEntries(cursor, count, entries);
+        uint64 unpackedSize = (uint64)(cursor - (const uint8*)file.memory);
+
+        MappedFile_Close(&file, fileSize);
+
+        if(unpackedSize != fileSize) {
+            FreeAligned_(entries);
+            entries = nullptr;
+            return Error_("Batch file %s is truncated or corrupt", filepath.Ascii());
+        }
+
+        return File::Delete(filepath.Ascii());
+    }
+
+    //=================================================================================================================================
+    static void ExitOnSpillError(Error err)
+    {
+        // -- A batch that can't be written or read back would silently drop paths or shade garbage. There is no recovering
+        // -- from that mid render so stop with the reason instead.
+        if(Failed_(err)) {
+            printf("Failed to spill a ray batch: %s\n", err.Message());
+            exit(-1);
+        }
+    }
+
+    //=================================================================================================================================
+    static uint SoaStride(uint count)
+    {
+        return (count + RayBatchLaneCount_ - 1) & ~(RayBatchLaneCount_ - 1);
+    }
+
+    //=================================================================================================================================
+    static void TransposeRays(const DeferredRay* rays, uint count, DeferredRaySoa& soa)
+    {
+        uint stride = SoaStride(count);
+
+        // -- The float arrays and the index go first so they all stay cache line aligned. The byte arrays go at the end.
+        uint8* memory = (uint8*)AllocAligned_((uint64)stride * (11 * sizeof(float) + 2 * sizeof(uint8)), CacheLineSize_);
+        float* floats = (float*)memory;
+
+        soa.memory           = memory;
+        soa.count            = count;
+        soa.originX          = floats + 0 * stride;
+        soa.originY          = floats + 1 * stride;
+        soa.originZ          = floats + 2 * stride;
+        soa.directionX       = floats + 3 * stride;
+        soa.directionY       = floats + 4 * stride;
+        soa.directionZ       = floats + 5 * stride;
+        soa.throughputX      = floats + 6 * stride;
+        soa.throughputY      = floats + 7 * stride;
+        soa.throughputZ      = floats + 8 * stride;
+        soa.error            = floats + 9 * stride;
+        soa.index            = (uint32*)(floats + 10 * stride);
+        soa.trackedBounces   = memory + 11 * sizeof(float) * stride;
+        soa.diracScatterOnly = soa.trackedBounces + stride;
+
+        for(uint scan = 0; scan < count; ++scan) {
+            const DeferredRay& ray = rays[scan];
+            soa.originX[scan]          = ray.ray.origin.x;
+            soa.originY[scan]          = ray.ray.origin.y;
+            soa.originZ[scan]          = ray.ray.origin.z;
+            soa.directionX[scan]       = ray.ray.direction.x;
+            soa.directionY[scan]       = ray.ray.direction.y;
+            soa.directionZ[scan]       = ray.ray.direction.z;
+            soa.throughputX[scan]      = ray.throughput.x;
+            soa.throughputY[scan]      = ray.throughput.y;
+            soa.throughputZ[scan]      = ray.throughput.z;
+            soa.error[scan]            = ray.error;
+            soa.index[scan]            = ray.index;
+            soa.trackedBounces[scan]   = (uint8)ray.trackedBounces;
+            soa.diracScatterOnly[scan] = (uint8)ray.diracScatterOnly;
+        }
+    }
+
+    //=================================================================================================================================
+    static void TransposeRays(const OcclusionRay* rays, uint count, OcclusionRaySoa& soa)
+    {
+        uint stride = SoaStride(count);
+
+        float* floats = AllocArrayAligned_(float, (uint64)stride * 11, CacheLineSize_);
+
+        soa.memory     = floats;
+        soa.count      = count;
+        soa.originX    = floats + 0 * stride;
+        soa.originY    = floats + 1 * stride;
+        soa.originZ    = floats + 2 * stride;
+        soa.directionX = floats + 3 * stride;
+        soa.directionY = floats + 4 * stride;
+        soa.directionZ = floats + 5 * stride;
+        soa.distance   = floats + 6 * stride;
+        soa.valueX     = floats + 7 * stride;
+        soa.valueY     = floats + 8 * stride;
+        soa.valueZ     = floats + 9 * stride;
+        soa.index      = (uint32*)(floats + 10 * stride);
+
+        for(uint scan = 0; scan < count; ++scan) {
+            const OcclusionRay& ray = rays[scan];
+            soa.originX[scan]    = ray.ray.origin.x;
+            soa.originY[scan]    = ray.ray.origin.y;
+            soa.originZ[scan]    = ray.ray.origin.z;
+            soa.directionX[scan] = ray.ray.direction.x;
+            soa.directionY[scan] = ray.ray.direction.y;
+            soa.directionZ[scan] = ray.ray.direction.z;
+            soa.distance[scan]   = ray.distance;
+            soa.valueX[scan]     = ray.value.x;
+            soa.valueY[scan]     = ray.value.y;
+            soa.valueZ[scan]     = ray.value.z;
+            soa.index[scan]      = ray.index;
+        }
+    }
+
+    //=================================================================================================================================
+    struct DeferredBatch
+    {
         ~DeferredBatch()
         {
-            if(fileHandle != INVALID_HANDLE_VALUE) {
-                UnmapViewOfFile(rays);
-                CloseHandle(fileHandle);
-                CloseHandle(mappingHandle);
-
-                FilePathString filepath = CreateBatchFilePath(batchIndex);
-                DeleteFileA(filepath.Ascii());
+            // -- Batch buffers come from the batcher's pool and are freed with it. Once handed out the rays belong to the caller.
+            if(soa.memory != nullptr) {
+                FreeAligned_(soa.memory);
             }
         }
 
@@ -91,30 +438,20 @@ namespace Selas
         volatile int64 batchTail;
         int64 batchIndex;
         RayBatchCategory category;
-        HANDLE fileHandle;
-        HANDLE mappingHandle;
+        bool resident;
         DeferredRay* rays;
+
+        // -- Filled in once the batch is sorted. The AoS rays are released at that point.
+        DeferredRaySoa soa;
     };
 
     //=================================================================================================================================
     struct OcclusionBatch
     {
-        OcclusionBatch()
-            : fileHandle(INVALID_HANDLE_VALUE)
-            , mappingHandle(INVALID_HANDLE_VALUE)
-        {
-
-        }
-
         ~OcclusionBatch()
         {
-            if(fileHandle != INVALID_HANDLE_VALUE) {
-                UnmapViewOfFile(rays);
-                CloseHandle(fileHandle);
-                CloseHandle(mappingHandle);
-
-                FilePathString filepath = CreateBatchFilePath(batchIndex);
-                DeleteFileA(filepath.Ascii());
+            if(soa.memory != nullptr) {
+                FreeAligned_(soa.memory);
             }
         }
 
@@ -122,38 +459,18 @@ namespace Selas
         volatile int64 batchTail;
         int64 batchIndex;
         RayBatchCategory category;
-        HANDLE fileHandle;
-        HANDLE mappingHandle;
+        bool resident;
         OcclusionRay* rays;
+        OcclusionRaySoa soa;
     };
 
     struct HitBatch
     {
-        HitBatch()
-            : fileHandle(INVALID_HANDLE_VALUE)
-            , mappingHandle(INVALID_HANDLE_VALUE)
-        {
-
-        }
-
-        ~HitBatch()
-        {
-            if(fileHandle != INVALID_HANDLE_VALUE) {
-                UnmapViewOfFile(hits);
-                CloseHandle(fileHandle);
-                CloseHandle(mappingHandle);
-
-                FilePathString filepath = CreateBatchFilePath(batchIndex);
-                DeleteFileA(filepath.Ascii());
-            }
-        }
-
         volatile int64 batchHead;
         volatile int64 batchTail;
 
         int64 batchIndex;
-        HANDLE fileHandle;
-        HANDLE mappingHandle;
+        bool resident;
         HitParameters* hits;
     };
 
@@ -179,82 +496,186 @@ namespace Selas
     }
 
     //=================================================================================================================================
-    template<typename Type_>
-    static float Sample(const Type_* ray, uint count)
+    static uint32 ExpandMortonBits(uint32 x)
+    {
+        // -- Spreads the low 10 bits of x out so there are two zero bits between each of them.
+        x &= 0x3FF;
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x <<  8)) & 0x0300F00F;
+        x = (x | (x <<  4)) & 0x030C30C3;
+        x = (x | (x <<  2)) & 0x09249249;
+
+        return x;
+    }
+
+    //=================================================================================================================================
+    static uint64 CalculateCoherenceKey(const Ray& ray, float3 boundsOrigin, float3 boundsScale)
     {
-        return count > 64 ? ray->Position() : ray->Direction();
+        float3 cell = (ray.origin - boundsOrigin) * boundsScale;
+        uint32 x = (uint32)Clamp<float>(cell.x, 0.0f, MortonAxisCells_ - 1);
+        uint32 y = (uint32)Clamp<float>(cell.y, 0.0f, MortonAxisCells_ - 1);
+        uint32 z = (uint32)Clamp<float>(cell.z, 0.0f, MortonAxisCells_ - 1);
+        uint32 morton = (ExpandMortonBits(x) << 2) | (ExpandMortonBits(y) << 1) | ExpandMortonBits(z);
+
+        uint32 octant = (ray.direction.x < 0.0f ? 4 : 0) | (ray.direction.y < 0.0f ? 2 : 0) | (ray.direction.z < 0.0f ? 1 : 0);
+
+        // -- Direction octant is the most significant so each octant ends up as one spatially sorted run.
+        return ((uint64)octant << 30) | morton;
     }
 
     //=================================================================================================================================
     template<typename Type_>
-    static void SortRaysInternal(Type_* rays, uint count)
+    static void CoherenceSort(Type_* rays, uint count, float3 boundsOrigin, float3 boundsScale)
     {
         if(count < 2) {
             return;
         }
 
-        Type_* left = rays;
-        Type_* right = rays + count - 1;
-        float pivot = Sample(&rays[count / 2], count);
+        uint64* values = AllocArrayAligned_(uint64, 2 * (uint64)count, CacheLineSize_);
+        uint64* scratch = values + count;
 
-        while(left <= right) {
-            if(Sample(left, count) < pivot) {
-                left++;
-            }
-            else if(Sample(right, count) > pivot) {
-                right--;
-            }
-            else {
-                Type_ temp = *left;
-                *left = *right;
-                *right = temp;
-                left++;
-                right--;
-            }
+        for(uint scan = 0; scan < count; ++scan) {
+            values[scan] = (CalculateCoherenceKey(rays[scan].ray, boundsOrigin, boundsScale) << CoherenceIndexBits_) | scan;
         }
 
-        SortRaysInternal(rays, right - rays + 1);
-        SortRaysInternal(left, rays + count - left);
+        ParallelRadixSort(values, scratch, count, CoherenceIndexBits_);
+
+        for(uint scan = 0; scan < count; ++scan) {
+            values[scan] &= CoherenceIndexMask_;
+        }
+        ApplyPermutation(rays, values, count);
+
+        FreeAligned_(values);
     }
 
     //=================================================================================================================================
-    static bool operator<(const HitParameters& lhs, const HitParameters& rhs)
+    static int32 HitSortField(const HitParameters& hit, uint field)
     {
-        for(uint scan = 0; scan < MaxInstanceLevelCount_; ++scan) {
-            if(lhs.instId[scan] < rhs.instId[scan]) {
-                return true;
-            }
+        // -- Fields in order of significance: each instance level, then geometry and finally primitive.
+        if(field < MaxInstanceLevelCount_) {
+            return hit.instId[field];
+        }
+        if(field == MaxInstanceLevelCount_) {
+            return hit.geomId;
+        }
+        return hit.primId;
+    }
+
+    //=================================================================================================================================
+    static void SortHitsByField(const HitParameters* hits, uint64* values, uint64* scratch, uint count, uint field)
+    {
+        for(uint scan = 0; scan < count; ++scan) {
+            uint64 index = values[scan] & HitSortIndexMask_;
+            uint32 key = (uint32)HitSortField(hits[index], field);
+
+            values[scan] = ((uint64)key << HitSortIndexBits_) | index;
         }
-        
-        if(lhs.geomId < rhs.geomId) {
-            return true;
+
+        ParallelRadixSort(values, scratch, count, HitSortIndexBits_);
+    }
+
+    //=================================================================================================================================
+    static void SortHits(HitParameters* hits, uint count)
+    {
+        if(count < 2) {
+            return;
         }
 
-        if(lhs.primId < rhs.primId) {
-            return true;
+        uint64* values = AllocArrayAligned_(uint64, 2 * (uint64)count, CacheLineSize_);
+        uint64* scratch = values + count;
+
+        for(uint scan = 0; scan < count; ++scan) {
+            values[scan] = scan;
+        }
+
+        // -- The radix sort is stable so sorting by each field from least to most significant gives hits ordered by instance,
+        // -- then geometry, then primitive. Material is per geometry so this also keeps material and texture runs together.
+        // -- Ids that are the same for the whole batch (an unused instance level for example) cost almost nothing since the
+        // -- radix sort skips passes where every value lands in one bucket.
+        for(uint field = HitSortFieldCount_; field > 0; --field) {
+            SortHitsByField(hits, values, scratch, count, field - 1);
+        }
+
+        for(uint scan = 0; scan < count; ++scan) {
+            values[scan] &= HitSortIndexMask_;
         }
+        ApplyPermutation(hits, values, count);
 
-        return false;
+        FreeAligned_(values);
     }
 
     //=================================================================================================================================
-    static bool operator>(const HitParameters& lhs, const HitParameters& rhs)
+    template<typename Type_>
+    static void WaitForBatchTail(Type_* batch, int64 tail)
     {
-        for(uint scan = 0; scan < MaxInstanceLevelCount_; ++scan) {
-            if(lhs.instId[scan] > rhs.instId[scan]) {
-                return true;
+        uint32 attempt = 0;
+        while(batch->batchTail != tail) {
+            SpinBackoff(attempt);
+        }
+    }
+
+    //=================================================================================================================================
+    void* PathTracingBatcher::AcquireBatchBuffer()
+    {
+        // -- Called with the lock held.
+        uint64 freeCount = freeBatchBuffers.Count();
+        if(freeCount > 0) {
+            void* buffer = freeBatchBuffers[freeCount - 1];
+            freeBatchBuffers.RemoveFast(freeCount - 1);
+            return buffer;
+        }
+
+        void* buffer = AllocAligned_(batchBufferSize, CacheLineSize_);
+        Assert_(buffer != nullptr);
+        batchBuffers.Add(buffer);
+
+        return buffer;
+    }
+
+    //=================================================================================================================================
+    bool PathTracingBatcher::ReleaseBatchBuffer(void* buffer)
+    {
+        // -- There are only ever a few dozen pooled buffers so a linear search is fine. Spilled batches are read back into
+        // -- their own allocations, which aren't part of the pool.
+        EnterSpinLock(lock);
+
+        bool pooled = false;
+        for(uint scan = 0, count = batchBuffers.Count(); scan < count; ++scan) {
+            if(batchBuffers[scan] == buffer) {
+                pooled = true;
+                break;
             }
         }
 
-        if(lhs.geomId > rhs.geomId) {
-            return true;
+        if(pooled) {
+            freeBatchBuffers.Add(buffer);
         }
 
-        if(lhs.primId > rhs.primId) {
-            return true;
+        LeaveSpinLock(lock);
+
+        return pooled;
+    }
+
+    //=================================================================================================================================
+    bool PathTracingBatcher::HoldResidentBatch()
+    {
+        EnterSpinLock(lock);
+        bool resident = (residentBatchesHeld < residentBatchLimit);
+        if(resident) {
+            ++residentBatchesHeld;
         }
+        LeaveSpinLock(lock);
 
-        return false;
+        return resident;
+    }
+
+    //=================================================================================================================================
+    void PathTracingBatcher::ReleaseResidentBatch()
+    {
+        EnterSpinLock(lock);
+        Assert_(residentBatchesHeld > 0);
+        --residentBatchesHeld;
+        LeaveSpinLock(lock);
     }
 
     //=================================================================================================================================
@@ -266,24 +687,10 @@ namespace Selas
         batch->batchHead = 0;
         batch->batchTail = 0;
         batch->category = category;
+        batch->soa.memory = nullptr;
 
-        FilePathString path = CreateBatchFilePath(batch->batchIndex);
-
-        Directory::EnsureDirectoryExists(path.Ascii());
-
-        batch->fileHandle = CreateFileA(path.Ascii(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, 0, NULL);
-        Assert_(batch->fileHandle != INVALID_HANDLE_VALUE);
-
-        Assert_(rayBatchCapacity * sizeof(DeferredRay) < 0xFFFFFFFF);
-        DWORD size = (DWORD)(rayBatchCapacity * sizeof(DeferredRay));
-
-        batch->mappingHandle = CreateFileMapping(batch->fileHandle, NULL, PAGE_READWRITE, 0, size, NULL);
-        Assert_(batch->mappingHandle != INVALID_HANDLE_VALUE);
-
-        void* memory = MapViewOfFile(batch->mappingHandle, FILE_MAP_WRITE, 0, 0, 0);
-        Assert_(memory != nullptr);
-
-        batch->rays = (DeferredRay*)memory;
+        batch->rays = (DeferredRay*)AcquireBatchBuffer();
+        batch->resident = false;
 
         deferredBatches.Add(batch);
 
@@ -291,41 +698,75 @@ namespace Selas
     }
 
     //=================================================================================================================================
-    void PathTracingBatcher::FlushCompletedBatch(DeferredBatch* batch)
+    bool PathTracingBatcher::RetireBatch(DeferredBatch* batch)
     {
+        // -- Called with the lock held. Returns false if there was nothing in the batch to flush.
         if(batch->batchTail == 0) {
             // -- Flush was called on a batch that hadn't been touched at all. We can safely reset this batch here.
             batch->batchHead = 0;
-            return;
+            return false;
         }
 
         if(currentDeferred[batch->category] == batch) {
             currentDeferred[batch->category] = AllocateRayBatch(batch->category);
         }
 
-        UnmapViewOfFile((void*)batch->rays);
-        CloseHandle(batch->fileHandle);
-        CloseHandle(batch->mappingHandle);
+        return true;
+    }
 
-        batch->fileHandle = INVALID_HANDLE_VALUE;
-        batch->mappingHandle = INVALID_HANDLE_VALUE;
+    //=================================================================================================================================
+    void PathTracingBatcher::FlushCompletedBatch(DeferredBatch* batch)
+    {
+        // -- Called without the lock held so packing a spilled batch doesn't stall every other thread.
+        batch->resident = HoldResidentBatch();
+        if(batch->resident == false) {
+            uint64 fileSize;
+            ExitOnSpillError(WriteBatchFile(batch->batchIndex, batch->rays, (uint64)batch->batchTail, fileSize));
+            Atomic::AddU64(&spilledBytesWritten, fileSize);
+            ReleaseBatchBuffer(batch->rays);
+            batch->rays = nullptr;
+        }
 
+        EnterSpinLock(lock);
+        if(batch->resident) {
+            ++residentBatchCount;
+        }
+        else {
+            ++spilledBatchCount;
+        }
         readyDeferredBatches.Add(batch);
+        LeaveSpinLock(lock);
+
+        PostSemaphore(prefetchSignal, 1);
+        PostSemaphore(workSignal, 1);
     }
 
     //=================================================================================================================================
     void PathTracingBatcher::LoadBatch(DeferredBatch* batch)
     {
-        FilePathString filepath = CreateBatchFilePath(batch->batchIndex);
+        if(batch->resident == false) {
+            ExitOnSpillError(ReadAndDeleteBatchFile(batch->batchIndex, rayBatchCapacity, &spilledBytesRead, batch->rays));
+        }
+    }
 
-        void* fileData;
-        uint64 fileSize;
-        Error err = File::ReadWholeFile(filepath.Ascii(), &fileData, &fileSize);
-        Assert_(Successful_(err));
+    //=================================================================================================================================
+    void PathTracingBatcher::PrepareBatch(DeferredBatch* batch)
+    {
+        ProfileScope_("PrepareRayBatch");
 
-        DeleteFileA(filepath.Ascii());
+        LoadBatch(batch);
 
-        batch->rays = (DeferredRay*)fileData;
+        CoherenceSort(batch->rays, (uint)batch->batchTail, coherenceOrigin, coherenceScale);
+        TransposeRays(batch->rays, (uint)batch->batchTail, batch->soa);
+
+        if(ReleaseBatchBuffer(batch->rays) == false) {
+            FreeAligned_(batch->rays);
+        }
+        batch->rays = nullptr;
+
+        if(batch->resident) {
+            ReleaseResidentBatch();
+        }
     }
 
     //=================================================================================================================================
@@ -337,136 +778,234 @@ namespace Selas
         batch->batchHead = 0;
         batch->batchTail = 0;
         batch->category = category;
+        batch->soa.memory = nullptr;
 
-        FilePathString path = CreateBatchFilePath(batch->batchIndex);
+        batch->rays = (OcclusionRay*)AcquireBatchBuffer();
+        batch->resident = false;
 
-        Directory::EnsureDirectoryExists(path.Ascii());
+        occlusionBatches.Add(batch);
 
-        batch->fileHandle = CreateFileA(path.Ascii(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, 0, NULL);
-        Assert_(batch->fileHandle != INVALID_HANDLE_VALUE);
+        return batch;
+    }
 
-        Assert_(rayBatchCapacity * sizeof(OcclusionRay) < 0xFFFFFFFF);
-        DWORD size = (DWORD)(rayBatchCapacity * sizeof(OcclusionRay));
+    //=================================================================================================================================
+    bool PathTracingBatcher::RetireBatch(OcclusionBatch* batch)
+    {
+        if(batch->batchTail == 0) {
+            // -- Flush was called on a batch that hadn't been touched at all. We can safely reset this batch here.
+            batch->batchHead = 0;
+            return false;
+        }
 
-        batch->mappingHandle = CreateFileMapping(batch->fileHandle, NULL, PAGE_READWRITE, 0, size, NULL);
-        Assert_(batch->mappingHandle != INVALID_HANDLE_VALUE);
+        if(currentOcclusion[batch->category] == batch) {
+            currentOcclusion[batch->category] = AllocateOcclusionBatch(batch->category);
+        }
 
-        void* memory = MapViewOfFile(batch->mappingHandle, FILE_MAP_WRITE, 0, 0, 0);
-        Assert_(memory != nullptr);
+        return true;
+    }
 
-        batch->rays = (OcclusionRay*)memory;
+    //=================================================================================================================================
+    void PathTracingBatcher::FlushCompletedBatch(OcclusionBatch* batch)
+    {
+        batch->resident = HoldResidentBatch();
+        if(batch->resident == false) {
+            uint64 fileSize;
+            ExitOnSpillError(WriteBatchFile(batch->batchIndex, batch->rays, (uint64)batch->batchTail, fileSize));
+            Atomic::AddU64(&spilledBytesWritten, fileSize);
+            ReleaseBatchBuffer(batch->rays);
+            batch->rays = nullptr;
+        }
 
-        occlusionBatches.Add(batch);
+        EnterSpinLock(lock);
+        if(batch->resident) {
+            ++residentBatchCount;
+        }
+        else {
+            ++spilledBatchCount;
+        }
+        readyOcclusionBatches.Add(batch);
+        LeaveSpinLock(lock);
+
+        PostSemaphore(prefetchSignal, 1);
+        PostSemaphore(workSignal, 1);
+    }
+
+    //=================================================================================================================================
+    void PathTracingBatcher::LoadBatch(OcclusionBatch* batch)
+    {
+        if(batch->resident == false) {
+            ExitOnSpillError(ReadAndDeleteBatchFile(batch->batchIndex, rayBatchCapacity, &spilledBytesRead, batch->rays));
+        }
+    }
+
+    //=================================================================================================================================
+    void PathTracingBatcher::PrepareBatch(OcclusionBatch* batch)
+    {
+        ProfileScope_("PrepareOcclusionBatch");
+
+        LoadBatch(batch);
+
+        CoherenceSort(batch->rays, (uint)batch->batchTail, coherenceOrigin, coherenceScale);
+        TransposeRays(batch->rays, (uint)batch->batchTail, batch->soa);
+
+        if(ReleaseBatchBuffer(batch->rays) == false) {
+            FreeAligned_(batch->rays);
+        }
+        batch->rays = nullptr;
+
+        if(batch->resident) {
+            ReleaseResidentBatch();
+        }
+    }
+
+    //=================================================================================================================================
+    HitBatch* PathTracingBatcher::AllocateHitBatch()
+    {
+        HitBatch* batch = New_(HitBatch);
+
+        batch->batchIndex = Atomic::Increment64(&batchIndex);
+        batch->batchHead = 0;
+        batch->batchTail = 0;
+
+        batch->hits = (HitParameters*)AcquireBatchBuffer();
+        batch->resident = false;
+
+        hitBatches.Add(batch);
 
         return batch;
     }
 
     //=================================================================================================================================
-    void PathTracingBatcher::FlushCompletedBatch(OcclusionBatch* batch)
+    bool PathTracingBatcher::RetireBatch(HitBatch* batch)
     {
         if(batch->batchTail == 0) {
             // -- Flush was called on a batch that hadn't been touched at all. We can safely reset this batch here.
             batch->batchHead = 0;
-            return;
+            return false;
         }
 
-        if(currentOcclusion[batch->category] == batch) {
-            currentOcclusion[batch->category] = AllocateOcclusionBatch(batch->category);
+        if(currentHits == batch) {
+            currentHits = AllocateHitBatch();
         }
 
-        UnmapViewOfFile((void*)batch->rays);
-        CloseHandle(batch->fileHandle);
-        CloseHandle(batch->mappingHandle);
-
-        batch->fileHandle = INVALID_HANDLE_VALUE;
-        batch->mappingHandle = INVALID_HANDLE_VALUE;
-
-        readyOcclusionBatches.Add(batch);
+        return true;
     }
 
     //=================================================================================================================================
-    void PathTracingBatcher::LoadBatch(OcclusionBatch* batch)
+    void PathTracingBatcher::FlushCompletedBatch(HitBatch* batch)
     {
-        FilePathString filepath = CreateBatchFilePath(batch->batchIndex);
-
-        void* fileData;
-        uint64 fileSize;
-        Error err = File::ReadWholeFile(filepath.Ascii(), &fileData, &fileSize);
-        Assert_(Successful_(err));
+        batch->resident = HoldResidentBatch();
+        if(batch->resident == false) {
+            uint64 fileSize;
+            ExitOnSpillError(WriteBatchFile(batch->batchIndex, batch->hits, (uint64)batch->batchTail, fileSize));
+            Atomic::AddU64(&spilledBytesWritten, fileSize);
+            ReleaseBatchBuffer(batch->hits);
+            batch->hits = nullptr;
+        }
 
-        DeleteFileA(filepath.Ascii());
+        EnterSpinLock(lock);
+        if(batch->resident) {
+            ++residentBatchCount;
+        }
+        else {
+            ++spilledBatchCount;
+        }
+        readyHitBatches.Add(batch);
+        LeaveSpinLock(lock);
 
-        batch->rays = (OcclusionRay*)fileData;
+        PostSemaphore(prefetchSignal, 1);
+        PostSemaphore(workSignal, 1);
     }
 
     //=================================================================================================================================
-    HitBatch* PathTracingBatcher::AllocateHitBatch()
+    void PathTracingBatcher::LoadBatch(HitBatch* batch)
     {
-        HitBatch* batch = New_(HitBatch);
-
-        batch->batchIndex = Atomic::Increment64(&batchIndex);
-        batch->batchHead = 0;
-        batch->batchTail = 0;
-
-        FilePathString path = CreateBatchFilePath(batch->batchIndex);
+        if(batch->resident == false) {
+            ExitOnSpillError(ReadAndDeleteBatchFile(batch->batchIndex, hitBatchCapacity, &spilledBytesRead, batch->hits));
+        }
+    }
 
-        Directory::EnsureDirectoryExists(path.Ascii());
+    //=================================================================================================================================
+    void PathTracingBatcher::PrepareBatch(HitBatch* batch)
+    {
+        ProfileScope_("PrepareHitBatch");
 
-        batch->fileHandle = CreateFileA(path.Ascii(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, 0, NULL);
-        Assert_(batch->fileHandle != INVALID_HANDLE_VALUE);
+        LoadBatch(batch);
+        SortHits(batch->hits, (uint)batch->batchTail);
+    }
 
-        Assert_(hitBatchCapacity * sizeof(HitParameters) < 0xFFFFFFFF);
-        DWORD size = (DWORD)(hitBatchCapacity * sizeof(HitParameters));
+    //=================================================================================================================================
+    template<typename Type_>
+    bool PathTracingBatcher::ClaimBatch(CArray<Type_*>& batches, Type_*& batch)
+    {
+        // -- Check before locking to see if it's possible to claim a batch.
+        if(batches.Count() == 0) {
+            return false;
+        }
 
-        batch->mappingHandle = CreateFileMapping(batch->fileHandle, NULL, PAGE_READWRITE, 0, size, NULL);
-        Assert_(batch->mappingHandle != INVALID_HANDLE_VALUE);
+        EnterSpinLock(lock);
 
-        void* memory = MapViewOfFile(batch->mappingHandle, FILE_MAP_WRITE, 0, 0, 0);
-        Assert_(memory != nullptr);
+        // -- Check again to make sure another thread didn't claim it before we could enter the lock
+        if(batches.Count() == 0) {
+            LeaveSpinLock(lock);
+            return false;
+        }
 
-        batch->hits = (HitParameters*)memory;
+        batch = batches[batches.Count() - 1];
+        batches.RemoveFast(batches.Count() - 1);
 
-        hitBatches.Add(batch);
+        LeaveSpinLock(lock);
 
-        return batch;
+        return true;
     }
 
     //=================================================================================================================================
-    void PathTracingBatcher::FlushCompletedBatch(HitBatch* batch)
+    template<typename Type_>
+    bool PathTracingBatcher::PrefetchBatch(CArray<Type_*>& ready, CArray<Type_*>& prepared)
     {
-        if(batch->batchTail == 0) {
-            // -- Flush was called on a batch that hadn't been touched at all. We can safely reset this batch here.
-            batch->batchHead = 0;
-            return;
+        // -- Only the reader thread adds to the prepared lists so this count can only shrink behind our back.
+        if(prepared.Count() >= PreparedBatchCount_) {
+            return false;
         }
 
-        if(currentHits == batch) {
-            currentHits = AllocateHitBatch();
+        Type_* batch;
+        if(ClaimBatch(ready, batch) == false) {
+            return false;
         }
 
-        UnmapViewOfFile((void*)batch->hits);
-        CloseHandle(batch->fileHandle);
-        CloseHandle(batch->mappingHandle);
+        PrepareBatch(batch);
 
-        batch->fileHandle = INVALID_HANDLE_VALUE;
-        batch->mappingHandle = INVALID_HANDLE_VALUE;
+        EnterSpinLock(lock);
+        prepared.Add(batch);
+        LeaveSpinLock(lock);
 
-        readyHitBatches.Add(batch);
+        // -- A worker may have gone to sleep while this batch was in neither list.
+        PostSemaphore(workSignal, 1);
+
+        return true;
     }
 
     //=================================================================================================================================
-    void PathTracingBatcher::LoadBatch(HitBatch* batch)
+    void PathTracingBatcher::PrefetchThreadFunction(void* userData)
     {
-        FilePathString filepath = CreateBatchFilePath(batch->batchIndex);
-
-        void* fileData;
-        uint64 fileSize;
-        Error err = File::ReadWholeFile(filepath.Ascii(), &fileData, &fileSize);
-        Assert_(Successful_(err));
+        PathTracingBatcher* batcher = (PathTracingBatcher*)userData;
 
-        DeleteFileA(filepath.Ascii());
+        while(true) {
+            WaitForSemaphore(batcher->prefetchSignal, WaitForever_);
+            if(batcher->prefetchShutdown) {
+                break;
+            }
 
-        batch->hits = (HitParameters*)fileData;
+            // -- Keep going until there is nothing left to do. Any signals that queued up while we were working will just
+            // -- cause an extra pass that finds nothing.
+            bool prefetched = true;
+            while(prefetched) {
+                prefetched = false;
+                prefetched |= batcher->PrefetchBatch(batcher->readyHitBatches, batcher->preparedHitBatches);
+                prefetched |= batcher->PrefetchBatch(batcher->readyOcclusionBatches, batcher->preparedOcclusionBatches);
+                prefetched |= batcher->PrefetchBatch(batcher->readyDeferredBatches, batcher->preparedDeferredBatches);
+            }
+        }
     }
 
     //=================================================================================================================================
@@ -475,8 +1014,31 @@ namespace Selas
         , batchIndex(0)
         , rayBatchCapacity(0)
         , hitBatchCapacity(0)
+        , coherenceOrigin(float3::Zero_)
+        , coherenceScale(float3::Zero_)
+        , batchBufferSize(0)
+        , residentBatchLimit(0)
+        , residentBatchesHeld(0)
+        , residentBatchCount(0)
+        , spilledBatchCount(0)
+        , spilledBytesWritten(0)
+        , spilledBytesRead(0)
+        , prefetchThread(nullptr)
+        , prefetchSignal(nullptr)
+        , prefetchShutdown(false)
+        , prefetchedBatchCount(0)
+        , synchronousBatchCount(0)
+        , workSignal(nullptr)
+        , workerCount(0)
+        , idleWorkerCount(0)
+        , workFinished(false)
+        , outstandingBatchCount(0)
         , totalEntriesAdded(0)
         , totalEntriesConsumed(0)
+        , parkedLock(nullptr)
+        , parkedRays(nullptr)
+        , parkedQueueCount(0)
+        , parkedRayCount(0)
     {
 
     }
@@ -488,23 +1050,86 @@ namespace Selas
     }
 
     //=================================================================================================================================
-    void PathTracingBatcher::Initialize(uint rayBatchCapacity_, uint hitBatchCapacity_)
+    void PathTracingBatcher::Initialize(uint rayBatchCapacity_, uint hitBatchCapacity_, uint64 residentMemoryBudget,
+                                        const AxisAlignedBox& sceneBounds, uint workerCount_, uint parkedQueueCount_)
     {
+        Assert_((uint64)rayBatchCapacity_ <= CoherenceIndexMask_ + 1);
+
         rayBatchCapacity = rayBatchCapacity_;
         hitBatchCapacity = hitBatchCapacity_;
         lock = CreateSpinLock();
 
+        float3 extents = sceneBounds.max - sceneBounds.min;
+        coherenceOrigin = sceneBounds.min;
+        coherenceScale.x = MortonAxisCells_ / Max(extents.x, SmallFloatEpsilon_);
+        coherenceScale.y = MortonAxisCells_ / Max(extents.y, SmallFloatEpsilon_);
+        coherenceScale.z = MortonAxisCells_ / Max(extents.z, SmallFloatEpsilon_);
+
+        // -- All batch kinds share one pool so each buffer is sized for the largest of them.
+        uint64 bufferSize = Max<uint64>(rayBatchCapacity * sizeof(DeferredRay), rayBatchCapacity * sizeof(OcclusionRay));
+        bufferSize = Max<uint64>(bufferSize, hitBatchCapacity * sizeof(HitParameters));
+        bufferSize = (bufferSize + CacheLineSize_ - 1) & ~(uint64)(CacheLineSize_ - 1);
+
+        // -- The budget only covers completed batches. Each batch being filled has a staging buffer on top of it.
+        batchBufferSize = bufferSize;
+        residentBatchLimit = residentMemoryBudget / bufferSize;
+        residentBatchesHeld = 0;
+
         for(uint scan = 0; scan < RayBatchCategoryCount; ++scan) {
             currentDeferred[scan] = AllocateRayBatch((RayBatchCategory)scan);
             currentOcclusion[scan] = AllocateOcclusionBatch((RayBatchCategory)scan);
         }
 
         currentHits = AllocateHitBatch();
+
+        workerCount = workerCount_;
+        idleWorkerCount = 0;
+        workFinished = false;
+        workSignal = CreateOSSemaphore(0, MaxSemaphoreCount_);
+
+        prefetchShutdown = false;
+        prefetchSignal = CreateOSSemaphore(0, MaxSemaphoreCount_);
+        prefetchThread = CreateThread(PrefetchThreadFunction, this);
+
+        parkedLock = CreateSpinLock();
+        parkedQueueCount = parkedQueueCount_;
+        if(parkedQueueCount > 0) {
+            parkedRays = AllocArray_(CArray<DeferredRay>, parkedQueueCount);
+            for(uint scan = 0; scan < parkedQueueCount; ++scan) {
+                PlacementNew_(CArray<DeferredRay>, &parkedRays[scan]);
+            }
+        }
     }
 
     //=================================================================================================================================
     void PathTracingBatcher::Shutdown()
     {
+        prefetchShutdown = true;
+        PostSemaphore(prefetchSignal, 1);
+        ShutdownThread(prefetchThread);
+        prefetchThread = nullptr;
+
+        CloseOSSemaphore(prefetchSignal);
+        prefetchSignal = nullptr;
+
+        CloseOSSemaphore(workSignal);
+        workSignal = nullptr;
+
+        if(parkedRays != nullptr) {
+            for(uint scan = 0; scan < parkedQueueCount; ++scan) {
+                Assert_(parkedRays[scan].Count() == 0);
+                PlacementDelete_(CArray<DeferredRay>, &parkedRays[scan]);
+            }
+            SafeFree_(parkedRays);
+        }
+        parkedQueueCount = 0;
+        CloseSpinlock(parkedLock);
+        parkedLock = nullptr;
+
+        preparedDeferredBatches.Shutdown();
+        preparedOcclusionBatches.Shutdown();
+        preparedHitBatches.Shutdown();
+
         for(uint scan = 0, count = deferredBatches.Count(); scan < count; ++scan) {
             Delete_(deferredBatches[scan]);
         }
@@ -520,108 +1145,163 @@ namespace Selas
         }
         hitBatches.Shutdown();
 
+        for(uint scan = 0, count = batchBuffers.Count(); scan < count; ++scan) {
+            FreeAligned_(batchBuffers[scan]);
+        }
+        batchBuffers.Shutdown();
+        freeBatchBuffers.Shutdown();
+        residentBatchLimit = 0;
+
         Assert_(lock != nullptr);
         CloseSpinlock(lock);
         lock = nullptr;
     }
 
     //=================================================================================================================================
-    void PathTracingBatcher::AddUnsortedDeferredRay(const DeferredRay& dray)
+    void PathTracingBatcher::AddUnsortedDeferredRays(RayBatchCategory category, const DeferredRay* rays, uint count)
     {
-        Atomic::AddU64(&totalEntriesAdded, 1);
-
-        RayBatchCategory category = DetermineRayCategory(dray);
+        // -- Space is reserved with a single atomic add for the whole run. A reservation that runs past the end of the batch only
+        // -- keeps the part that fits and the remainder goes into the replacement batch.
+        Atomic::AddU64(&totalEntriesAdded, count);
 
-        while(true) {
+        uint32 attempt = 0;
+        while(count > 0) {
             DeferredBatch* batch = currentDeferred[category];
 
+            // -- Check before reserving so threads waiting on a full batch don't keep hammering its cache line.
             int64 head = batch->batchHead;
             if(head >= rayBatchCapacity) {
                 // -- we need to wait for the last thread writing to this batch to replace it.
+                SpinBackoff(attempt);
+                continue;
+            }
+
+            head = Atomic::Add64(&batch->batchHead, count);
+            if(head >= rayBatchCapacity) {
+                // -- Other threads filled the batch between the check and the reservation.
+                SpinBackoff(attempt);
                 continue;
             }
 
-            if(Atomic::CompareExchange64(&batch->batchHead, head + 1, head)) {
-                
-                batch->rays[head] = dray;
+            int64 reserved = Min<int64>(count, rayBatchCapacity - head);
+            Memory::Copy(batch->rays + head, rays, reserved * sizeof(DeferredRay));
+
+            int64 after = Atomic::Add64(&batch->batchTail, reserved) + reserved;
+            if(after == rayBatchCapacity) {
+                EnterSpinLock(lock);
+                bool retired = RetireBatch(batch);
+                LeaveSpinLock(lock);
 
-                int64 after = Atomic::Add64(&batch->batchTail, 1) + 1;
-                if(after == rayBatchCapacity) {
-                    EnterSpinLock(lock);
+                if(retired) {
                     FlushCompletedBatch(batch);
-                    LeaveSpinLock(lock);
                 }
-
-                break;
             }
+
+            rays += reserved;
+            count -= (uint)reserved;
+            attempt = 0;
         }
     }
 
     //=================================================================================================================================
-    void PathTracingBatcher::AddUnsortedOcclusionRay(const OcclusionRay& oray)
+    void PathTracingBatcher::AddUnsortedOcclusionRays(RayBatchCategory category, const OcclusionRay* rays, uint count)
     {
-        Atomic::AddU64(&totalEntriesAdded, 1);
-
-        RayBatchCategory category = DetermineRayCategory(oray);
+        Atomic::AddU64(&totalEntriesAdded, count);
 
-        while(true) {
+        uint32 attempt = 0;
+        while(count > 0) {
             OcclusionBatch* batch = currentOcclusion[category];
 
+            // -- Check before reserving so threads waiting on a full batch don't keep hammering its cache line.
             int64 head = batch->batchHead;
             if(head >= rayBatchCapacity) {
                 // -- we need to wait for the last thread writing to this batch to replace it.
+                SpinBackoff(attempt);
+                continue;
+            }
+
+            head = Atomic::Add64(&batch->batchHead, count);
+            if(head >= rayBatchCapacity) {
+                // -- Other threads filled the batch between the check and the reservation.
+                SpinBackoff(attempt);
                 continue;
             }
 
-            if(Atomic::CompareExchange64(&batch->batchHead, head + 1, head)) {
+            int64 reserved = Min<int64>(count, rayBatchCapacity - head);
+            Memory::Copy(batch->rays + head, rays, reserved * sizeof(OcclusionRay));
 
-                batch->rays[head] = oray;
+            int64 after = Atomic::Add64(&batch->batchTail, reserved) + reserved;
+            if(after == rayBatchCapacity) {
+                EnterSpinLock(lock);
+                bool retired = RetireBatch(batch);
+                LeaveSpinLock(lock);
 
-                int64 after = Atomic::Add64(&batch->batchTail, 1) + 1;
-                if(after == rayBatchCapacity) {
-                    EnterSpinLock(lock);
+                if(retired) {
                     FlushCompletedBatch(batch);
-                    LeaveSpinLock(lock);
                 }
-
-                break;
             }
+
+            rays += reserved;
+            count -= (uint)reserved;
+            attempt = 0;
         }
     }
 
     //=================================================================================================================================
-    void PathTracingBatcher::AddUnsortedHit(const HitParameters& hit)
+    void PathTracingBatcher::AddUnsortedHits(const HitParameters* hits, uint count)
     {
-        Atomic::AddU64(&totalEntriesAdded, 1);
+        Atomic::AddU64(&totalEntriesAdded, count);
 
-        while(true) {
+        uint32 attempt = 0;
+        while(count > 0) {
             HitBatch* batch = currentHits;
 
+            // -- Check before reserving so threads waiting on a full batch don't keep hammering its cache line.
             int64 head = batch->batchHead;
             if(head >= hitBatchCapacity) {
                 // -- we need to wait for the last thread writing to this batch to replace it.
+                SpinBackoff(attempt);
+                continue;
+            }
+
+            head = Atomic::Add64(&batch->batchHead, count);
+            if(head >= hitBatchCapacity) {
+                // -- Other threads filled the batch between the check and the reservation.
+                SpinBackoff(attempt);
                 continue;
             }
 
-            if(Atomic::CompareExchange64(&batch->batchHead, head + 1, head)) {
+            int64 reserved = Min<int64>(count, hitBatchCapacity - head);
+            Memory::Copy(batch->hits + head, hits, reserved * sizeof(HitParameters));
 
-                batch->hits[head] = hit;
+            int64 after = Atomic::Add64(&batch->batchTail, reserved) + reserved;
+            if(after == hitBatchCapacity) {
+                EnterSpinLock(lock);
+                bool retired = RetireBatch(batch);
+                LeaveSpinLock(lock);
 
-                int64 after = Atomic::Add64(&batch->batchTail, 1) + 1;
-                if(after == hitBatchCapacity) {
-                    EnterSpinLock(lock);
+                if(retired) {
                     FlushCompletedBatch(batch);
-                    LeaveSpinLock(lock);
                 }
-
-                break;
             }
+
+            hits += reserved;
+            count -= (uint)reserved;
+            attempt = 0;
         }
     }
 
     //=================================================================================================================================
     void PathTracingBatcher::Flush()
     {
+        ProfileScope_("BatcherFlush");
+
+        DeferredBatch* retiredDeferred[RayBatchCategoryCount];
+        OcclusionBatch* retiredOcclusion[RayBatchCategoryCount];
+        HitBatch* retiredHits = nullptr;
+        uint retiredDeferredCount = 0;
+        uint retiredOcclusionCount = 0;
+
         EnterSpinLock(lock);
        
         for(uint scan = 0; scan < RayBatchCategoryCount; ++scan) {
@@ -630,11 +1310,11 @@ namespace Selas
                 int64 currentHead = batch->batchHead;
                 int64 diff = rayBatchCapacity - currentHead;
 
-                if(diff == 0) {
+                if(diff <= 0) {
 
                     // -- Another thread has already filled this batch so we just wait for that thread to finish the copy.
                     // -- That thread will also call FlushCompletedBatch after we release the lock
-                    while(batch->batchTail != rayBatchCapacity) {}
+                    WaitForBatchTail(batch, rayBatchCapacity);
                     break;
                 }
 
@@ -642,9 +1322,11 @@ namespace Selas
                 if(Atomic::CompareExchange64(&batch->batchHead, currentHead + diff, currentHead)) {
 
                     // -- Wait until any other threads finish copying their rays into this batch
-                    while(batch->batchTail != rayBatchCapacity - diff) {}
+                    WaitForBatchTail(batch, currentHead);
 
-                    FlushCompletedBatch(batch);
+                    if(RetireBatch(batch)) {
+                        retiredDeferred[retiredDeferredCount++] = batch;
+                    }
                     break;
                 }
             }
@@ -656,10 +1338,10 @@ namespace Selas
                 int64 currentHead = batch->batchHead;
                 int64 diff = rayBatchCapacity - currentHead;
 
-                if(diff == 0) {
+                if(diff <= 0) {
                     // -- Another thread has already filled this batch so we just wait for that thread to finish the copy.
                     // -- That thread will also call FlushCompletedBatch after we release the lock
-                    while(batch->batchTail != rayBatchCapacity) {}
+                    WaitForBatchTail(batch, rayBatchCapacity);
                     break;
                 }
 
@@ -667,9 +1349,11 @@ namespace Selas
                 if(Atomic::CompareExchange64(&batch->batchHead, currentHead + diff, currentHead)) {
 
                     // -- Wait until any other threads finish copying their rays into this batch
-                    while(batch->batchTail != rayBatchCapacity - diff) {}
+                    WaitForBatchTail(batch, currentHead);
 
-                    FlushCompletedBatch(batch);
+                    if(RetireBatch(batch)) {
+                        retiredOcclusion[retiredOcclusionCount++] = batch;
+                    }
                     break;
                 }
             }
@@ -680,10 +1364,10 @@ namespace Selas
             int64 currentHead = batch->batchHead;
             int64 diff = hitBatchCapacity - currentHead;
 
-            if(diff == 0) {
+            if(diff <= 0) {
                 // -- Another thread has already filled this batch so we just wait for that thread to finish the copy.
                 // -- That thread will also call FlushCompletedBatch after we release the lock
-                while(batch->batchTail != hitBatchCapacity) {}
+                WaitForBatchTail(batch, hitBatchCapacity);
                 break;
             }
 
@@ -691,152 +1375,366 @@ namespace Selas
             if(Atomic::CompareExchange64(&batch->batchHead, currentHead + diff, currentHead)) {
 
                 // -- Wait until any other threads finish copying their rays into this batch
-                while(batch->batchTail != hitBatchCapacity - diff) {}
+                WaitForBatchTail(batch, currentHead);
 
-                FlushCompletedBatch(batch);
+                if(RetireBatch(batch)) {
+                    retiredHits = batch;
+                }
                 break;
             }
         }
 
         LeaveSpinLock(lock);
+
+        for(uint scan = 0; scan < retiredDeferredCount; ++scan) {
+            FlushCompletedBatch(retiredDeferred[scan]);
+        }
+        for(uint scan = 0; scan < retiredOcclusionCount; ++scan) {
+            FlushCompletedBatch(retiredOcclusion[scan]);
+        }
+        if(retiredHits != nullptr) {
+            FlushCompletedBatch(retiredHits);
+        }
     }
 
     //=================================================================================================================================
-    bool PathTracingBatcher::GetSortedBatch(DeferredRay*& rays, uint& rayCount)
+    void PathTracingBatcher::ParkDeferredRays(uint queue, const DeferredRay* rays, uint count)
     {
-        // -- Check before locking to see if it's possible to claim a batch.
-        if(readyDeferredBatches.Count() == 0) {
-            return false;
+        Assert_(queue < parkedQueueCount);
+
+        Atomic::AddU64(&totalEntriesAdded, count);
+        Atomic::AddU64(&parkedRayCount, count);
+
+        EnterSpinLock(parkedLock);
+        for(uint scan = 0; scan < count; ++scan) {
+            parkedRays[queue].Add(rays[scan]);
         }
-        
-        EnterSpinLock(lock);
+        LeaveSpinLock(parkedLock);
+    }
 
-        // -- Check again to make sure another thread didn't claim it before we could enter the lock
-        if(readyDeferredBatches.Count() == 0) {
-            LeaveSpinLock(lock);
-            return false;
+    //=================================================================================================================================
+    void PathTracingBatcher::ResumeParkedRays(uint queue)
+    {
+        Assert_(queue < parkedQueueCount);
+
+        CArray<DeferredRay> resumed;
+
+        EnterSpinLock(parkedLock);
+        uint count = (uint)parkedRays[queue].Count();
+        if(count > 0) {
+            resumed.Append(parkedRays[queue]);
+            parkedRays[queue].Clear();
         }
+        LeaveSpinLock(parkedLock);
 
-        DeferredBatch* batch = readyDeferredBatches[readyDeferredBatches.Count() - 1];
-        readyDeferredBatches.RemoveFast(readyDeferredBatches.Count() - 1);
+        if(count == 0) {
+            return;
+        }
 
-        LeaveSpinLock(lock);
+        // -- Group the rays by category in place so each category goes in with a single reservation.
+        uint start = 0;
+        for(uint category = 0; category < RayBatchCategoryCount; ++category) {
+            uint end = start;
+            for(uint scan = start; scan < count; ++scan) {
+                if(DetermineRayCategory(resumed[scan]) == (RayBatchCategory)category) {
+                    DeferredRay swap = resumed[end];
+                    resumed[end] = resumed[scan];
+                    resumed[scan] = swap;
+                    ++end;
+                }
+            }
 
-        LoadBatch(batch);
+            if(end > start) {
+                AddUnsortedDeferredRays((RayBatchCategory)category, &resumed[start], end - start);
+            }
+            start = end;
+        }
 
-        rays = batch->rays;
-        rayCount = (uint)batch->batchTail;
+        // -- The rays were counted when they were parked and again just now. Consume the parked copies only after the new ones
+        // -- are in so the batcher never looks empty in between.
+        Atomic::AddU64(&totalEntriesConsumed, count);
+
+        Flush();
+        resumed.Shutdown();
+    }
 
-        if(batch->category == PositiveX || batch->category == NegativeX) {
-            SortRaysInternal((DeferredRaySortX*)rays, rayCount);
+    //=================================================================================================================================
+    bool PathTracingBatcher::GetSortedBatch(DeferredRaySoa& rays)
+    {
+        DeferredBatch* batch;
+        if(ClaimBatch(preparedDeferredBatches, batch)) {
+            Atomic::AddU64(&prefetchedBatchCount, 1);
+            PostSemaphore(prefetchSignal, 1);
         }
-        else if(batch->category == PositiveY || batch->category == NegativeY) {
-            SortRaysInternal((DeferredRaySortY*)rays, rayCount);
+        else if(ClaimBatch(readyDeferredBatches, batch)) {
+            // -- The reader thread hasn't gotten to this one yet so there's no point in waiting on it.
+            Atomic::AddU64(&synchronousBatchCount, 1);
+            PrepareBatch(batch);
         }
         else {
-            SortRaysInternal((DeferredRaySortZ*)rays, rayCount);
+            return false;
         }
 
-        Atomic::AddU64(&totalEntriesConsumed, rayCount);
+        rays = batch->soa;
+        batch->soa.memory = nullptr;
+
+        Atomic::AddU64(&totalEntriesConsumed, rays.count);
+        Atomic::Increment64(&outstandingBatchCount);
 
         return true;
     }
 
     //=================================================================================================================================
-    void PathTracingBatcher::FreeRays(DeferredRay* rays)
+    void PathTracingBatcher::FreeRays(DeferredRaySoa& rays)
     {
-        FreeAligned_(rays);
+        FreeAligned_(rays.memory);
+        rays.memory = nullptr;
+
+        Atomic::Decrement64(&outstandingBatchCount);
     }
 
     //=================================================================================================================================
-    bool PathTracingBatcher::GetSortedBatch(OcclusionRay*& rays, uint& rayCount)
+    bool PathTracingBatcher::GetSortedBatch(OcclusionRaySoa& rays)
     {
-        // -- Check before locking to see if it's possible to claim a batch.
-        if(readyOcclusionBatches.Count() == 0) {
-            return false;
+        OcclusionBatch* batch;
+        if(ClaimBatch(preparedOcclusionBatches, batch)) {
+            Atomic::AddU64(&prefetchedBatchCount, 1);
+            PostSemaphore(prefetchSignal, 1);
         }
-
-        EnterSpinLock(lock);
-
-        // -- Check again to make sure another thread didn't claim it before we could enter the lock
-        if(readyOcclusionBatches.Count() == 0) {
-            LeaveSpinLock(lock);
+        else if(ClaimBatch(readyOcclusionBatches, batch)) {
+            Atomic::AddU64(&synchronousBatchCount, 1);
+            PrepareBatch(batch);
+        }
+        else {
             return false;
         }
 
-        OcclusionBatch* batch = readyOcclusionBatches[readyOcclusionBatches.Count() - 1];
-        readyOcclusionBatches.RemoveFast(readyOcclusionBatches.Count() - 1);
+        rays = batch->soa;
+        batch->soa.memory = nullptr;
 
-        LeaveSpinLock(lock);
+        Atomic::AddU64(&totalEntriesConsumed, rays.count);
+        Atomic::Increment64(&outstandingBatchCount);
 
-        LoadBatch(batch);
+        return true;
+    }
+
+    //=================================================================================================================================
+    void PathTracingBatcher::FreeRays(OcclusionRaySoa& rays)
+    {
+        FreeAligned_(rays.memory);
+        rays.memory = nullptr;
 
-        rays = batch->rays;
-        rayCount = (uint)batch->batchTail;
+        Atomic::Decrement64(&outstandingBatchCount);
+    }
 
-        if(batch->category == PositiveX || batch->category == NegativeX) {
-            SortRaysInternal((OcclusionRaySortX*)rays, rayCount);
+    //=================================================================================================================================
+    bool PathTracingBatcher::GetSortedHits(HitParameters*& hits, uint& hitCount)
+    {
+        HitBatch* batch;
+        if(ClaimBatch(preparedHitBatches, batch)) {
+            Atomic::AddU64(&prefetchedBatchCount, 1);
+            PostSemaphore(prefetchSignal, 1);
         }
-        else if(batch->category == PositiveY || batch->category == NegativeY) {
-            SortRaysInternal((OcclusionRaySortY*)rays, rayCount);
+        else if(ClaimBatch(readyHitBatches, batch)) {
+            Atomic::AddU64(&synchronousBatchCount, 1);
+            PrepareBatch(batch);
         }
         else {
-            SortRaysInternal((OcclusionRaySortZ*)rays, rayCount);
+            return false;
+        }
+
+        hits = batch->hits;
+        hitCount = (uint)batch->batchTail;
+        batch->hits = nullptr;
+
+        // -- The hits belong to the caller now so they no longer count as waiting in memory.
+        if(batch->resident) {
+            ReleaseResidentBatch();
         }
 
-        Atomic::AddU64(&totalEntriesConsumed, rayCount);
+        Atomic::AddU64(&totalEntriesConsumed, hitCount);
+        Atomic::Increment64(&outstandingBatchCount);
 
         return true;
     }
 
     //=================================================================================================================================
-    void PathTracingBatcher::FreeRays(OcclusionRay* rays)
+    void PathTracingBatcher::FreeHits(HitParameters* hits)
     {
-        FreeAligned_(rays);
+        if(ReleaseBatchBuffer(hits) == false) {
+            FreeAligned_(hits);
+        }
+
+        Atomic::Decrement64(&outstandingBatchCount);
     }
 
     //=================================================================================================================================
-    bool PathTracingBatcher::GetSortedHits(HitParameters*& hits, uint& hitCount)
+    bool PathTracingBatcher::Empty()
     {
-        // -- Check before locking to see if it's possible to claim a batch.
-        if(readyHitBatches.Count() == 0) {
-            return false;
+        // -- Entries produced while processing a batch are added before that batch is freed so the outstanding count has to be
+        // -- read first. Otherwise we could see the batch freed but not the entries it produced.
+        int64 outstanding = outstandingBatchCount;
+
+        return (outstanding == 0) && (totalEntriesConsumed == totalEntriesAdded);
+    }
+
+    //=================================================================================================================================
+    bool PathTracingBatcher::HasQueuedBatches()
+    {
+        return readyHitBatches.Count() > 0 || preparedHitBatches.Count() > 0
+            || readyOcclusionBatches.Count() > 0 || preparedOcclusionBatches.Count() > 0
+            || readyDeferredBatches.Count() > 0 || preparedDeferredBatches.Count() > 0;
+    }
+
+    //=================================================================================================================================
+    bool PathTracingBatcher::WaitForWork()
+    {
+        ProfileScope_("WaitForWork");
+
+        while(true) {
+            if(workFinished) {
+                return false;
+            }
+
+            // -- Push out any partially filled batches before going to sleep. If that produced anything go do it.
+            Flush();
+            if(HasQueuedBatches()) {
+                return true;
+            }
+
+            // -- Only once every worker is in here is it safe to call it done. Idle workers have already flushed everything they
+            // -- produced so at that point Empty() can't be fooled by work that hasn't been added yet.
+            int64 idleCount = Atomic::Increment64(&idleWorkerCount) + 1;
+            if(idleCount == (int64)workerCount && Empty()) {
+                workFinished = true;
+                PostSemaphore(workSignal, workerCount);
+                return false;
+            }
+
+            WaitForSemaphore(workSignal, WaitForever_);
+            Atomic::Decrement64(&idleWorkerCount);
         }
+    }
 
-        EnterSpinLock(lock);
+    //=================================================================================================================================
+    void PathTracingBatcher::ResetWork()
+    {
+        Assert_(workFinished);
+        Assert_(Empty());
 
-        // -- Check again to make sure another thread didn't claim it before we could enter the lock
-        if(readyHitBatches.Count() == 0) {
-            LeaveSpinLock(lock);
-            return false;
+        // -- The worker that declared the work finished never went to sleep so it is still counted as idle.
+        idleWorkerCount = 0;
+        workFinished = false;
+    }
+
+    //=================================================================================================================================
+    void BatchWriter_Initialize(BatchWriter* writer, PathTracingBatcher* batcher, uint32 capacity)
+    {
+        writer->batcher = batcher;
+        writer->capacity = capacity;
+
+        for(uint scan = 0; scan < RayBatchCategoryCount; ++scan) {
+            writer->deferredCounts[scan] = 0;
+            writer->occlusionCounts[scan] = 0;
+            writer->deferredRays[scan] = AllocArrayAligned_(DeferredRay, capacity, CacheLineSize_);
+            writer->occlusionRays[scan] = AllocArrayAligned_(OcclusionRay, capacity, CacheLineSize_);
         }
 
-        HitBatch* batch = readyHitBatches[readyHitBatches.Count() - 1];
-        readyHitBatches.RemoveFast(readyHitBatches.Count() - 1);
+        writer->hitCount = 0;
+        writer->hits = AllocArrayAligned_(HitParameters, capacity, CacheLineSize_);
+    }
 
-        LeaveSpinLock(lock);
+    //=================================================================================================================================
+    void BatchWriter_AddDeferredRay(BatchWriter* writer, const DeferredRay& ray)
+    {
+        RayBatchCategory category = DetermineRayCategory(ray);
 
-        LoadBatch(batch);
+        uint32 count = writer->deferredCounts[category];
+        writer->deferredRays[category][count] = ray;
+        ++count;
 
-        hits = batch->hits;
-        hitCount = (uint)batch->batchTail;
+        if(count == writer->capacity) {
+            writer->batcher->AddUnsortedDeferredRays(category, writer->deferredRays[category], count);
+            count = 0;
+        }
+        writer->deferredCounts[category] = count;
+    }
 
-        QuickSort(hits, hitCount);
+    //=================================================================================================================================
+    void BatchWriter_AddOcclusionRay(BatchWriter* writer, const OcclusionRay& ray)
+    {
+        RayBatchCategory category = DetermineRayCategory(ray);
 
-        Atomic::AddU64(&totalEntriesConsumed, hitCount);
+        uint32 count = writer->occlusionCounts[category];
+        writer->occlusionRays[category][count] = ray;
+        ++count;
 
-        return true;
+        if(count == writer->capacity) {
+            writer->batcher->AddUnsortedOcclusionRays(category, writer->occlusionRays[category], count);
+            count = 0;
+        }
+        writer->occlusionCounts[category] = count;
     }
 
     //=================================================================================================================================
-    void PathTracingBatcher::FreeHits(HitParameters* hits)
+    void BatchWriter_AddHit(BatchWriter* writer, const HitParameters& hit)
     {
-        FreeAligned_(hits);
+        writer->hits[writer->hitCount] = hit;
+        ++writer->hitCount;
+
+        if(writer->hitCount == writer->capacity) {
+            writer->batcher->AddUnsortedHits(writer->hits, writer->hitCount);
+            writer->hitCount = 0;
+        }
     }
 
     //=================================================================================================================================
-    bool PathTracingBatcher::Empty()
+    void BatchWriter_Flush(BatchWriter* writer)
+    {
+        ProfileScope_("BatchWriterFlush");
+
+        for(uint scan = 0; scan < RayBatchCategoryCount; ++scan) {
+            if(writer->deferredCounts[scan] > 0) {
+                writer->batcher->AddUnsortedDeferredRays((RayBatchCategory)scan, writer->deferredRays[scan],
+                                                         writer->deferredCounts[scan]);
+                writer->deferredCounts[scan] = 0;
+            }
+            if(writer->occlusionCounts[scan] > 0) {
+                writer->batcher->AddUnsortedOcclusionRays((RayBatchCategory)scan, writer->occlusionRays[scan],
+                                                          writer->occlusionCounts[scan]);
+                writer->occlusionCounts[scan] = 0;
+            }
+        }
+
+        if(writer->hitCount > 0) {
+            writer->batcher->AddUnsortedHits(writer->hits, writer->hitCount);
+            writer->hitCount = 0;
+        }
+    }
+
+    //=================================================================================================================================
+    void BatchWriter_Shutdown(BatchWriter* writer)
+    {
+        BatchWriter_Flush(writer);
+
+        for(uint scan = 0; scan < RayBatchCategoryCount; ++scan) {
+            FreeAligned_(writer->deferredRays[scan]);
+            FreeAligned_(writer->occlusionRays[scan]);
+        }
+        FreeAligned_(writer->hits);
+    }
+
+    //=================================================================================================================================
+    void PathTracingBatcher::Stats(PathTracingBatcherStats& stats)
     {
-        return (totalEntriesConsumed == totalEntriesAdded);
+        EnterSpinLock(lock);
+        stats.residentBatchCount = residentBatchCount;
+        stats.spilledBatchCount = spilledBatchCount;
+        stats.spilledBytesWritten = spilledBytesWritten;
+        stats.spilledBytesRead = spilledBytesRead;
+        stats.prefetchedBatchCount = prefetchedBatchCount;
+        stats.synchronousBatchCount = synchronousBatchCount;
+        stats.parkedRayCount = parkedRayCount;
+        LeaveSpinLock(lock);
     }
 }
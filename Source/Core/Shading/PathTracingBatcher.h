@@ -6,6 +6,7 @@
 
 #include "Shading/IntegratorContexts.h"
 #include "GeometryLib/Ray.h"
+#include "GeometryLib/AxisAlignedBox.h"
 #include "ContainersLib/CArray.h"
 #include "MathLib/FloatStructs.h"
 #include "SystemLib/BasicTypes.h"
@@ -16,8 +17,7 @@ namespace Selas
     struct OcclusionBatch;
     struct HitBatch;
 
-    // JSTODO - Octrahedral format for direction
-    // JSTODO - RGB9e5 or half format for throughput
+    // -- Spilled batches store direction as octahedral. See PackEntries in PathTracingBatcher.cpp.
     struct DeferredRay
     {
         Ray ray;
@@ -39,6 +39,48 @@ namespace Selas
         uint32 index;
     };
 
+    // -- Sorted ray batches are handed out as SoA so traversal can fill packets with whole vector loads and the stream api can
+    // -- read them in place. Every array holds a multiple of RayBatchLaneCount_ lanes and starts on a cache line.
+    #define RayBatchLaneCount_ 16
+
+    struct DeferredRaySoa
+    {
+        void*   memory;
+        uint    count;
+
+        float*  originX;
+        float*  originY;
+        float*  originZ;
+        float*  directionX;
+        float*  directionY;
+        float*  directionZ;
+        float*  throughputX;
+        float*  throughputY;
+        float*  throughputZ;
+        float*  error;
+        uint32* index;
+        uint8*  trackedBounces;
+        uint8*  diracScatterOnly;
+    };
+
+    struct OcclusionRaySoa
+    {
+        void*   memory;
+        uint    count;
+
+        float*  originX;
+        float*  originY;
+        float*  originZ;
+        float*  directionX;
+        float*  directionY;
+        float*  directionZ;
+        float*  distance;
+        float*  valueX;
+        float*  valueY;
+        float*  valueZ;
+        uint32* index;
+    };
+
     enum RayBatchCategory
     {
         PositiveX,
@@ -51,6 +93,17 @@ namespace Selas
         RayBatchCategoryCount
     };
 
+    struct PathTracingBatcherStats
+    {
+        uint64 residentBatchCount;
+        uint64 spilledBatchCount;
+        uint64 spilledBytesWritten;
+        uint64 spilledBytesRead;
+        uint64 prefetchedBatchCount;
+        uint64 synchronousBatchCount;
+        uint64 parkedRayCount;
+    };
+
     class PathTracingBatcher
     {
     private:
@@ -69,45 +122,147 @@ namespace Selas
 
         int64 rayBatchCapacity;
         int64 hitBatchCapacity;
+
+        // -- Maps ray origins within the scene bounds onto the grid used for the Morton part of the ray sort key.
+        float3 coherenceOrigin;
+        float3 coherenceScale;
+
+        // -- Every batch is filled in a buffer from this pool. Buffers are allocated the first time they are needed and reused
+        // -- after that. The pool holds one staging buffer per batch being filled on top of the budget below.
+        CArray<void*>  batchBuffers;
+        uint64         batchBufferSize;
+        CArray<void*>  freeBatchBuffers;
+
+        // -- Completed batches stay in their buffer until residentBatchLimit of them are waiting in memory. Only then do we spill
+        // -- to disk. The resident memory budget only bounds these, not the staging buffers.
+        uint64         residentBatchLimit;
+        uint64         residentBatchesHeld;
+
+        uint64 residentBatchCount;
+        uint64 spilledBatchCount;
+        volatile uint64 spilledBytesWritten;
+        volatile uint64 spilledBytesRead;
+
+        // -- A reader thread loads and sorts the next few ready batches of each kind so workers don't stall on disk reads.
+        void*                   prefetchThread;
+        void*                   prefetchSignal;
+        volatile bool           prefetchShutdown;
+        CArray<DeferredBatch*>  preparedDeferredBatches;
+        CArray<OcclusionBatch*> preparedOcclusionBatches;
+        CArray<HitBatch*>       preparedHitBatches;
+
+        uint64 prefetchedBatchCount;
+        uint64 synchronousBatchCount;
         
-        uint64 totalEntriesAdded;
-        uint64 totalEntriesConsumed;
+        // -- Workers with nothing to do sleep on workSignal. It is posted whenever a batch becomes available.
+        void*          workSignal;
+        uint           workerCount;
+        volatile int64 idleWorkerCount;
+        volatile bool  workFinished;
+
+        // -- Batches handed out that haven't been freed yet. Work produced by them might not have been added yet.
+        volatile int64 outstandingBatchCount;
+        volatile uint64 totalEntriesAdded;
+        volatile uint64 totalEntriesConsumed;
+
+        // -- Rays waiting on geometry that is still streaming in. Parked rays count as added but not consumed so the batcher
+        // -- can't run out of work while any of them are waiting.
+        void*                parkedLock;
+        CArray<DeferredRay>* parkedRays;
+        uint                 parkedQueueCount;
+        volatile uint64      parkedRayCount;
+
+        void* AcquireBatchBuffer();
+        bool ReleaseBatchBuffer(void* buffer);
+        bool HoldResidentBatch();
+        void ReleaseResidentBatch();
 
         DeferredBatch* AllocateRayBatch(RayBatchCategory category);
+        bool RetireBatch(DeferredBatch* batch);
         void FlushCompletedBatch(DeferredBatch* batch);
         void LoadBatch(DeferredBatch* batch);
+        void PrepareBatch(DeferredBatch* batch);
 
         OcclusionBatch* AllocateOcclusionBatch(RayBatchCategory category);
+        bool RetireBatch(OcclusionBatch* batch);
         void FlushCompletedBatch(OcclusionBatch* batch);
         void LoadBatch(OcclusionBatch* batch);
+        void PrepareBatch(OcclusionBatch* batch);
 
         HitBatch* AllocateHitBatch();
+        bool RetireBatch(HitBatch* batch);
         void FlushCompletedBatch(HitBatch* batch);
         void LoadBatch(HitBatch* batch);
+        void PrepareBatch(HitBatch* batch);
+
+        bool HasQueuedBatches();
+
+        template<typename Type_> bool ClaimBatch(CArray<Type_*>& batches, Type_*& batch);
+        template<typename Type_> bool PrefetchBatch(CArray<Type_*>& ready, CArray<Type_*>& prepared);
+        static void PrefetchThreadFunction(void* userData);
 
     public:
 
         PathTracingBatcher();
         ~PathTracingBatcher();
 
-        void Initialize(uint rayBatchCapacity, uint hitBatchCapacity);
+        void Initialize(uint rayBatchCapacity, uint hitBatchCapacity, uint64 residentMemoryBudget,
+                        const AxisAlignedBox& sceneBounds, uint workerCount, uint parkedQueueCount = 0);
         void Shutdown();
 
-        void AddUnsortedDeferredRay(const DeferredRay& ray);
-        void AddUnsortedOcclusionRay(const OcclusionRay& ray);
-        void AddUnsortedHit(const HitParameters& hit);
+        // -- Adding one entry at a time contends heavily on the current batches. Use a BatchWriter per thread instead.
+        void AddUnsortedDeferredRays(RayBatchCategory category, const DeferredRay* rays, uint count);
+        void AddUnsortedOcclusionRays(RayBatchCategory category, const OcclusionRay* rays, uint count);
+        void AddUnsortedHits(const HitParameters* hits, uint count);
 
         void Flush();
 
-        bool GetSortedBatch(DeferredRay*& rays, uint& rayCount);
-        void FreeRays(DeferredRay* rays);
+        // -- Holds rays in queue until ResumeParkedRays(queue) hands them back as new deferred rays. Resuming can happen on any
+        // -- thread and flushes the batcher so sleeping workers pick the rays up.
+        void ParkDeferredRays(uint queue, const DeferredRay* rays, uint count);
+        void ResumeParkedRays(uint queue);
+
+        bool GetSortedBatch(DeferredRaySoa& rays);
+        void FreeRays(DeferredRaySoa& rays);
 
-        bool GetSortedBatch(OcclusionRay*& rays, uint& rayCount);
-        void FreeRays(OcclusionRay* rays);
+        bool GetSortedBatch(OcclusionRaySoa& rays);
+        void FreeRays(OcclusionRaySoa& rays);
 
         bool GetSortedHits(HitParameters*& rays, uint& hitCount);
         void FreeHits(HitParameters* hits);
 
         bool Empty();
+
+        // -- Call when none of the GetSorted functions returned anything. Sleeps until there is something to do and returns
+        // -- false once every one of the workerCount workers is waiting and there is nothing left anywhere.
+        bool WaitForWork();
+
+        // -- Lets the batcher run another wavefront once every worker has returned false from WaitForWork.
+        void ResetWork();
+
+        void Stats(PathTracingBatcherStats& stats);
+    };
+
+    #define DefaultBatchWriterCapacity_ 1024
+
+    // -- Per thread staging for new entries. Entries are handed to the batcher a full buffer at a time. Anything still staged
+    // -- must be flushed before the batch that produced it is freed so the batcher never looks empty while work is pending.
+    struct BatchWriter
+    {
+        PathTracingBatcher* batcher;
+        uint32              capacity;
+        uint32              hitCount;
+        uint32              deferredCounts[RayBatchCategoryCount];
+        uint32              occlusionCounts[RayBatchCategoryCount];
+        DeferredRay*        deferredRays[RayBatchCategoryCount];
+        OcclusionRay*       occlusionRays[RayBatchCategoryCount];
+        HitParameters*      hits;
     };
+
+    void BatchWriter_Initialize(BatchWriter* writer, PathTracingBatcher* batcher, uint32 capacity = DefaultBatchWriterCapacity_);
+    void BatchWriter_AddDeferredRay(BatchWriter* writer, const DeferredRay& ray);
+    void BatchWriter_AddOcclusionRay(BatchWriter* writer, const OcclusionRay& ray);
+    void BatchWriter_AddHit(BatchWriter* writer, const HitParameters& hit);
+    void BatchWriter_Flush(BatchWriter* writer);
+    void BatchWriter_Shutdown(BatchWriter* writer);
 }
\ No newline at end of file
@@ -0,0 +1,413 @@
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#include "Shading/RayBatchTraversal.h"
+#include "Shading/PathTracingBatcher.h"
+#include "StringLib/StringUtil.h"
+#include "SystemLib/MemoryAllocation.h"
+#include "SystemLib/Memory.h"
+#include "SystemLib/JsAssert.h"
+#include "SystemLib/Atomic.h"
+#include "SystemLib/MinMax.h"
+#include "SystemLib/SystemTime.h"
+#include "SystemLib/Logging.h"
+#include "SystemLib/CountOf.h"
+
+#include "embree3/rtcore.h"
+#include "embree3/rtcore_ray.h"
+
+// -- 6 ray arrays, 5 float hit arrays, primId, geomId and one instId array per instance level.
+#define TraversalArrayCount_      (13 + MaxInstanceLevelCount_)
+
+namespace Selas
+{
+    static cpointer TraversalModeNames[] =
+    {
+        "packet8",
+        "packet16",
+        "stream",
+        "twolevel"
+    };
+    static_assert(CountOf_(TraversalModeNames) == TraversalModeCount, "Missing traversal mode name");
+
+    //=============================================================================================================================
+    static void Intersect(const int32* valid, RTCScene scene, RTCIntersectContext* context, RTCRayHit8* rayhit)
+    {
+        rtcIntersect8(valid, scene, context, rayhit);
+    }
+
+    //=============================================================================================================================
+    static void Intersect(const int32* valid, RTCScene scene, RTCIntersectContext* context, RTCRayHit16* rayhit)
+    {
+        rtcIntersect16(valid, scene, context, rayhit);
+    }
+
+    //=============================================================================================================================
+    static void Occluded(const int32* valid, RTCScene scene, RTCIntersectContext* context, RTCRay8* ray)
+    {
+        rtcOccluded8(valid, scene, context, ray);
+    }
+
+    //=============================================================================================================================
+    static void Occluded(const int32* valid, RTCScene scene, RTCIntersectContext* context, RTCRay16* ray)
+    {
+        rtcOccluded16(valid, scene, context, ray);
+    }
+
+    //=============================================================================================================================
+    static void InitializeCoherentContext(RTCIntersectContext* context)
+    {
+        rtcInitIntersectContext(context);
+        context->flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+    }
+
+    //=============================================================================================================================
+    template<uint Width_, typename Type_>
+    static void CopyLanes(Type_* __restrict destination, const Type_* __restrict source)
+    {
+        // -- Batch and traversal arrays are padded to RayBatchLaneCount_ lanes so a whole packet can always be copied. The
+        // -- fixed count lets the compiler turn this into aligned vector loads and stores.
+        for(uint lane = 0; lane < Width_; ++lane) {
+            destination[lane] = source[lane];
+        }
+    }
+
+    //=============================================================================================================================
+    template<uint Width_, typename Type_>
+    static void FillLanes(Type_* __restrict destination, Type_ value)
+    {
+        for(uint lane = 0; lane < Width_; ++lane) {
+            destination[lane] = value;
+        }
+    }
+
+    //=============================================================================================================================
+    template<uint Width_, typename RayPacket_>
+    static void LoadPacketRays(RayPacket_& ray, const float* originX, const float* originY, const float* originZ,
+                               const float* directionX, const float* directionY, const float* directionZ, uint start)
+    {
+        CopyLanes<Width_>(ray.org_x, originX + start);
+        CopyLanes<Width_>(ray.org_y, originY + start);
+        CopyLanes<Width_>(ray.org_z, originZ + start);
+        CopyLanes<Width_>(ray.dir_x, directionX + start);
+        CopyLanes<Width_>(ray.dir_y, directionY + start);
+        CopyLanes<Width_>(ray.dir_z, directionZ + start);
+        FillLanes<Width_>(ray.tnear, 0.0f);
+        FillLanes<Width_>(ray.time, 0.0f);
+        FillLanes<Width_>(ray.mask, (uint32)0xFFFFFFFF);
+        FillLanes<Width_>(ray.flags, (uint32)0);
+        for(uint lane = 0; lane < Width_; ++lane) {
+            ray.id[lane] = (uint32)lane;
+        }
+    }
+
+    //=============================================================================================================================
+    template<uint Width_>
+    static void MakeValidLanes(int32* valid, uint packetSize)
+    {
+        for(uint lane = 0; lane < Width_; ++lane) {
+            valid[lane] = (lane < packetSize) ? -1 : 0;
+        }
+    }
+
+    //=============================================================================================================================
+    template<typename RayHitPacket_, uint Width_>
+    static void IntersectPackets(RTCScene scene, const DeferredRaySoa& rays, TraversalBuffers* buffers)
+    {
+        RTCIntersectContext rtcContext;
+        InitializeCoherentContext(&rtcContext);
+
+        for(uint start = 0; start < rays.count; start += Width_) {
+            Align_(64) int32 valid[Width_];
+            MakeValidLanes<Width_>(valid, Min<uint>(rays.count - start, Width_));
+
+            Align_(64) RayHitPacket_ rayhit;
+            LoadPacketRays<Width_>(rayhit.ray, rays.originX, rays.originY, rays.originZ, rays.directionX, rays.directionY,
+                                   rays.directionZ, start);
+            FillLanes<Width_>(rayhit.ray.tfar, FloatMax_);
+
+            FillLanes<Width_>(rayhit.hit.geomID, (uint32)RTC_INVALID_GEOMETRY_ID);
+            FillLanes<Width_>(rayhit.hit.primID, (uint32)RTC_INVALID_GEOMETRY_ID);
+            for(uint level = 0; level < MaxInstanceLevelCount_; ++level) {
+                FillLanes<Width_>(rayhit.hit.instID[level], (uint32)RTC_INVALID_GEOMETRY_ID);
+            }
+
+            Intersect(valid, scene, &rtcContext, &rayhit);
+
+            CopyLanes<Width_>(buffers->tfar + start, rayhit.ray.tfar);
+            CopyLanes<Width_>(buffers->normalX + start, rayhit.hit.Ng_x);
+            CopyLanes<Width_>(buffers->normalY + start, rayhit.hit.Ng_y);
+            CopyLanes<Width_>(buffers->normalZ + start, rayhit.hit.Ng_z);
+            CopyLanes<Width_>(buffers->u + start, rayhit.hit.u);
+            CopyLanes<Width_>(buffers->v + start, rayhit.hit.v);
+            CopyLanes<Width_>(buffers->primId + start, rayhit.hit.primID);
+            CopyLanes<Width_>(buffers->geomId + start, rayhit.hit.geomID);
+            for(uint level = 0; level < MaxInstanceLevelCount_; ++level) {
+                CopyLanes<Width_>(buffers->instId[level] + start, rayhit.hit.instID[level]);
+            }
+        }
+    }
+
+    //=============================================================================================================================
+    template<typename RayPacket_, uint Width_>
+    static void OccludePackets(RTCScene scene, const OcclusionRaySoa& rays, TraversalBuffers* buffers)
+    {
+        RTCIntersectContext rtcContext;
+        InitializeCoherentContext(&rtcContext);
+
+        for(uint start = 0; start < rays.count; start += Width_) {
+            Align_(64) int32 valid[Width_];
+            MakeValidLanes<Width_>(valid, Min<uint>(rays.count - start, Width_));
+
+            Align_(64) RayPacket_ ray;
+            LoadPacketRays<Width_>(ray, rays.originX, rays.originY, rays.originZ, rays.directionX, rays.directionY,
+                                   rays.directionZ, start);
+            CopyLanes<Width_>(ray.tfar, rays.distance + start);
+
+            Occluded(valid, scene, &rtcContext, &ray);
+
+            CopyLanes<Width_>(buffers->tfar + start, ray.tfar);
+        }
+    }
+
+    //=============================================================================================================================
+    static void MakeStreamRays(const float* originX, const float* originY, const float* originZ, const float* directionX,
+                               const float* directionY, const float* directionZ, uint count, TraversalBuffers* buffers,
+                               RTCRayNp& rays)
+    {
+        // -- Origin and direction are read straight out of the batch. Only the fields the batch doesn't store are filled here.
+        for(uint scan = 0; scan < count; ++scan) {
+            buffers->tnear[scan] = 0.0f;
+            buffers->time[scan]  = 0.0f;
+            buffers->mask[scan]  = 0xFFFFFFFF;
+            buffers->id[scan]    = scan;
+            buffers->flags[scan] = 0;
+        }
+
+        rays.org_x = (float*)originX;
+        rays.org_y = (float*)originY;
+        rays.org_z = (float*)originZ;
+        rays.tnear = buffers->tnear;
+        rays.dir_x = (float*)directionX;
+        rays.dir_y = (float*)directionY;
+        rays.dir_z = (float*)directionZ;
+        rays.time  = buffers->time;
+        rays.tfar  = buffers->tfar;
+        rays.mask  = buffers->mask;
+        rays.id    = buffers->id;
+        rays.flags = buffers->flags;
+    }
+
+    //=============================================================================================================================
+    static void MakeStreamRayHits(const DeferredRaySoa& rays, TraversalBuffers* buffers, RTCRayHitNp& rayhit)
+    {
+        MakeStreamRays(rays.originX, rays.originY, rays.originZ, rays.directionX, rays.directionY, rays.directionZ, rays.count,
+                       buffers, rayhit.ray);
+
+        for(uint scan = 0; scan < rays.count; ++scan) {
+            buffers->tfar[scan]   = FloatMax_;
+            buffers->geomId[scan] = RTC_INVALID_GEOMETRY_ID;
+            buffers->primId[scan] = RTC_INVALID_GEOMETRY_ID;
+            for(uint level = 0; level < MaxInstanceLevelCount_; ++level) {
+                buffers->instId[level][scan] = RTC_INVALID_GEOMETRY_ID;
+            }
+        }
+
+        rayhit.hit.Ng_x   = buffers->normalX;
+        rayhit.hit.Ng_y   = buffers->normalY;
+        rayhit.hit.Ng_z   = buffers->normalZ;
+        rayhit.hit.u      = buffers->u;
+        rayhit.hit.v      = buffers->v;
+        rayhit.hit.primID = buffers->primId;
+        rayhit.hit.geomID = buffers->geomId;
+        for(uint level = 0; level < MaxInstanceLevelCount_; ++level) {
+            rayhit.hit.instID[level] = buffers->instId[level];
+        }
+    }
+
+    //=============================================================================================================================
+    static void IntersectStream(RTCScene scene, const DeferredRaySoa& rays, TraversalBuffers* buffers)
+    {
+        RTCRayHitNp rayhit;
+        MakeStreamRayHits(rays, buffers, rayhit);
+
+        RTCIntersectContext rtcContext;
+        InitializeCoherentContext(&rtcContext);
+
+        rtcIntersectNp(scene, &rtcContext, &rayhit, rays.count);
+    }
+
+    //=============================================================================================================================
+    static void IntersectTwoLevel(const SceneResource* scene, const DeferredRaySoa& rays, TraversalBuffers* buffers)
+    {
+        RTCRayHitNp rayhit;
+        MakeStreamRayHits(rays, buffers, rayhit);
+
+        IntersectSceneTwoLevel(scene, rayhit, rays.count, &buffers->instanceQueues);
+    }
+
+    //=============================================================================================================================
+    static void OccludeStream(RTCScene scene, const OcclusionRaySoa& rays, TraversalBuffers* buffers)
+    {
+        RTCRayNp streamRays;
+        MakeStreamRays(rays.originX, rays.originY, rays.originZ, rays.directionX, rays.directionY, rays.directionZ, rays.count,
+                       buffers, streamRays);
+
+        Memory::Copy(buffers->tfar, rays.distance, rays.count * sizeof(float));
+
+        RTCIntersectContext rtcContext;
+        InitializeCoherentContext(&rtcContext);
+
+        rtcOccludedNp(scene, &rtcContext, &streamRays, rays.count);
+    }
+
+    //=============================================================================================================================
+    cpointer TraversalModeName(TraversalMode mode)
+    {
+        Assert_(mode < TraversalModeCount);
+        return TraversalModeNames[mode];
+    }
+
+    //=============================================================================================================================
+    bool ParseTraversalMode(cpointer name, TraversalMode& mode)
+    {
+        for(uint scan = 0; scan < TraversalModeCount; ++scan) {
+            if(StringUtil::EqualsIgnoreCase(name, TraversalModeNames[scan])) {
+                mode = (TraversalMode)scan;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    //=============================================================================================================================
+    void TraversalBuffers_Initialize(TraversalBuffers* buffers)
+    {
+        buffers->capacity = 0;
+        buffers->memory = nullptr;
+    }
+
+    //=============================================================================================================================
+    void TraversalBuffers_Reserve(TraversalBuffers* buffers, uint count)
+    {
+        if(count <= buffers->capacity) {
+            return;
+        }
+
+        SafeFreeAligned_(buffers->memory);
+
+        uint stride = (count + RayBatchLaneCount_ - 1) & ~(RayBatchLaneCount_ - 1);
+        uint32* memory = AllocArrayAligned_(uint32, (uint64)stride * TraversalArrayCount_, CacheLineSize_);
+
+        float* floats = (float*)memory;
+        buffers->tnear   = floats + 0 * stride;
+        buffers->time    = floats + 1 * stride;
+        buffers->tfar    = floats + 2 * stride;
+        buffers->normalX = floats + 3 * stride;
+        buffers->normalY = floats + 4 * stride;
+        buffers->normalZ = floats + 5 * stride;
+        buffers->u       = floats + 6 * stride;
+        buffers->v       = floats + 7 * stride;
+
+        buffers->mask    = memory + 8 * stride;
+        buffers->id      = memory + 9 * stride;
+        buffers->flags   = memory + 10 * stride;
+        buffers->primId  = memory + 11 * stride;
+        buffers->geomId  = memory + 12 * stride;
+        for(uint level = 0; level < MaxInstanceLevelCount_; ++level) {
+            buffers->instId[level] = memory + (13 + level) * stride;
+        }
+
+        buffers->memory = memory;
+        buffers->capacity = stride;
+    }
+
+    //=============================================================================================================================
+    void TraversalBuffers_Shutdown(TraversalBuffers* buffers)
+    {
+        SafeFreeAligned_(buffers->memory);
+        buffers->capacity = 0;
+
+        buffers->instanceQueues.entries.Shutdown();
+        buffers->instanceQueues.scratch.Shutdown();
+    }
+
+    //=============================================================================================================================
+    void IntersectRayBatch(const SceneResource* scene, TraversalMode mode, const DeferredRaySoa& rays, TraversalBuffers* buffers)
+    {
+        TraversalBuffers_Reserve(buffers, rays.count);
+
+        if(mode == eTwoLevelTraversal) {
+            IntersectTwoLevel(scene, rays, buffers);
+        }
+        else if(mode == eStreamTraversal) {
+            IntersectStream(scene->rtcScene, rays, buffers);
+        }
+        else if(mode == ePacket16Traversal) {
+            IntersectPackets<RTCRayHit16, 16>(scene->rtcScene, rays, buffers);
+        }
+        else {
+            IntersectPackets<RTCRayHit8, 8>(scene->rtcScene, rays, buffers);
+        }
+    }
+
+    //=============================================================================================================================
+    void OccludeRayBatch(const SceneResource* scene, TraversalMode mode, const OcclusionRaySoa& rays, TraversalBuffers* buffers)
+    {
+        TraversalBuffers_Reserve(buffers, rays.count);
+
+        // -- Occlusion rays only need any hit so binning them buys little. Two level mode traces them as a stream.
+        if(mode == eStreamTraversal || mode == eTwoLevelTraversal) {
+            OccludeStream(scene->rtcScene, rays, buffers);
+        }
+        else if(mode == ePacket16Traversal) {
+            OccludePackets<RTCRay16, 16>(scene->rtcScene, rays, buffers);
+        }
+        else {
+            OccludePackets<RTCRay8, 8>(scene->rtcScene, rays, buffers);
+        }
+    }
+
+    //=============================================================================================================================
+    void TraversalTimings_Initialize(TraversalTimings* timings)
+    {
+        timings->batchCount = 0;
+        for(uint scan = 0; scan < TraversalModeCount; ++scan) {
+            timings->rayCount[scan] = 0;
+            timings->microseconds[scan] = 0;
+        }
+    }
+
+    //=============================================================================================================================
+    void TraversalTimings_Log(const TraversalTimings* timings)
+    {
+        for(uint scan = 0; scan < TraversalModeCount; ++scan) {
+            float seconds = (float)timings->microseconds[scan] * 1e-6f;
+            float mraysPerSecond = (float)timings->rayCount[scan] * 1e-6f / Max<float>(seconds, 1e-6f);
+            WriteDebugInfo_("Traversal %-8s %lld rays in %.2fs: %.2f Mrays/s", TraversalModeNames[scan],
+                            timings->rayCount[scan], seconds, mraysPerSecond);
+        }
+    }
+
+    //=============================================================================================================================
+    void BenchmarkRayBatchTraversal(const SceneResource* scene, const DeferredRaySoa& rays, TraversalBuffers* buffers,
+                                    TraversalTimings* timings)
+    {
+        TraversalBuffers_Reserve(buffers, rays.count);
+
+        int64 batch = Atomic::Increment64(&timings->batchCount);
+
+        for(uint scan = 0; scan < TraversalModeCount; ++scan) {
+            TraversalMode mode = (TraversalMode)((batch + scan) % TraversalModeCount);
+
+            auto timer = SystemTime::Now();
+            IntersectRayBatch(scene, mode, rays, buffers);
+            float elapsedUs = SystemTime::ElapsedMicrosecondsF(timer);
+
+            Atomic::Add64(&timings->rayCount[mode], (int64)rays.count);
+            Atomic::Add64(&timings->microseconds[mode], (int64)elapsedUs);
+        }
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#include "Shading/IntegratorContexts.h"
+#include "SceneLib/SceneResource.h"
+#include "SystemLib/BasicTypes.h"
+
+namespace Selas
+{
+    struct DeferredRaySoa;
+    struct OcclusionRaySoa;
+
+    enum TraversalMode
+    {
+        // -- RTCRayHit8 packets traced with rtcIntersect8.
+        ePacket8Traversal,
+        // -- RTCRayHit16 packets. Native on AVX-512 builds of Embree, emulated with two 8 wide packets elsewhere.
+        ePacket16Traversal,
+        // -- The whole sorted batch is handed to rtcIntersectNp in SoA layout so Embree can reorder rays internally.
+        eStreamTraversal,
+        // -- Rays are binned by the top level instance bounds they overlap and each bin is traced one subscene at a time. Meant
+        // -- for scenes whose geometry doesn't fit in the cache. Occlusion uses stream traversal.
+        eTwoLevelTraversal,
+
+        TraversalModeCount
+    };
+
+    cpointer TraversalModeName(TraversalMode mode);
+    bool     ParseTraversalMode(cpointer name, TraversalMode& mode);
+
+    // -- Per thread SoA scratch for a ray batch. The ray arrays hold the parts of an Embree ray that aren't stored in the batch
+    // -- itself and the hit arrays receive the results of every traversal mode so the caller consumes them the same way
+    // -- regardless of how the batch was traced.
+    struct TraversalBuffers
+    {
+        uint    capacity;
+        void*   memory;
+
+        float*  tnear;
+        float*  time;
+        float*  tfar;
+        uint32* mask;
+        uint32* id;
+        uint32* flags;
+
+        float*  normalX;
+        float*  normalY;
+        float*  normalZ;
+        float*  u;
+        float*  v;
+        uint32* primId;
+        uint32* geomId;
+        uint32* instId[MaxInstanceLevelCount_];
+
+        InstanceQueueBuffers instanceQueues;
+    };
+
+    void TraversalBuffers_Initialize(TraversalBuffers* buffers);
+    void TraversalBuffers_Reserve(TraversalBuffers* buffers, uint count);
+    void TraversalBuffers_Shutdown(TraversalBuffers* buffers);
+
+    // -- Fills tfar, normal, u, v and the ids in buffers. geomId is RTC_INVALID_GEOMETRY_ID for rays that missed.
+    void IntersectRayBatch(const SceneResource* scene, TraversalMode mode, const DeferredRaySoa& rays, TraversalBuffers* buffers);
+
+    // -- Fills tfar in buffers. Occluded rays have a negative tfar.
+    void OccludeRayBatch(const SceneResource* scene, TraversalMode mode, const OcclusionRaySoa& rays, TraversalBuffers* buffers);
+
+    struct TraversalTimings
+    {
+        volatile int64 batchCount;
+        volatile int64 rayCount[TraversalModeCount];
+        volatile int64 microseconds[TraversalModeCount];
+    };
+
+    void TraversalTimings_Initialize(TraversalTimings* timings);
+    void TraversalTimings_Log(const TraversalTimings* timings);
+
+    // -- Traces the same batch with every traversal mode and accumulates the time spent in each. The starting mode rotates per
+    // -- batch so no mode is always the one that pays for streaming in subscene geometry. Results are left in buffers.
+    void BenchmarkRayBatchTraversal(const SceneResource* scene, const DeferredRaySoa& rays, TraversalBuffers* buffers,
+                                    TraversalTimings* timings);
+}
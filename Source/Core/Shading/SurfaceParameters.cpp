@@ -14,6 +14,8 @@
 #include "GeometryLib/CoordinateSystem.h"
 #include "MathLib/FloatFuncs.h"
 #include "MathLib/ColorSpace.h"
+#include "SystemLib/Memory.h"
+#include "SystemLib/MinMax.h"
 
 #include "embree3/rtcore.h"
 #include "embree3/rtcore_ray.h"
@@ -140,6 +142,31 @@ namespace Selas
         return float4(0.0f);
     }
 
+    //=============================================================================================================================
+    static void SetMaterialParameters(const ModelGeometryUserData* modelData, SurfaceParameters& surface)
+    {
+        const MaterialResourceData* materialResource = modelData->material;
+
+        surface.materialFlags      = materialResource->flags;
+        surface.transmittanceColor = materialResource->transmittanceColor;
+        surface.sheen              = materialResource->scalarAttributeValues[eSheen];
+        surface.sheenTint          = materialResource->scalarAttributeValues[eSheenTint];
+        surface.clearcoat          = materialResource->scalarAttributeValues[eClearcoat];
+        surface.clearcoatGloss     = materialResource->scalarAttributeValues[eClearcoatGloss];
+        surface.specTrans          = Saturate(materialResource->scalarAttributeValues[eSpecTrans]);
+        surface.diffTrans          = materialResource->scalarAttributeValues[eDiffuseTrans] * 0.5f;
+        surface.flatness           = materialResource->scalarAttributeValues[eFlatness];
+        surface.anisotropic        = materialResource->scalarAttributeValues[eAnisotropic];
+        surface.specularTint       = materialResource->scalarAttributeValues[eSpecularTint];
+        surface.roughness          = materialResource->scalarAttributeValues[eRoughness];
+        surface.metallic           = Saturate(materialResource->scalarAttributeValues[eMetallic]);
+        surface.scatterDistance    = materialResource->scalarAttributeValues[eScatterDistance];
+        surface.ior                = materialResource->scalarAttributeValues[eIor];
+        surface.lightSetIndex      = modelData->lightSetIndex;
+
+        surface.shader = materialResource->shader;
+    }
+
     //=============================================================================================================================
     bool CalculateSurfaceParams(const GIIntegratorContext* context, const HitParameters* __restrict hit,
                                 SurfaceParameters& surface)
@@ -219,24 +246,7 @@ namespace Selas
         surface.worldToTangent     = MatrixTranspose(tangentToWorld);
         surface.position           = hit->position;
         surface.error              = hit->error;
-        surface.materialFlags      = materialResource->flags;
-        surface.transmittanceColor = materialResource->transmittanceColor;
-        surface.sheen              = materialResource->scalarAttributeValues[eSheen];
-        surface.sheenTint          = materialResource->scalarAttributeValues[eSheenTint];
-        surface.clearcoat          = materialResource->scalarAttributeValues[eClearcoat];
-        surface.clearcoatGloss     = materialResource->scalarAttributeValues[eClearcoatGloss];
-        surface.specTrans          = Saturate(materialResource->scalarAttributeValues[eSpecTrans]);
-        surface.diffTrans          = materialResource->scalarAttributeValues[eDiffuseTrans] * 0.5f;
-        surface.flatness           = materialResource->scalarAttributeValues[eFlatness];
-        surface.anisotropic        = materialResource->scalarAttributeValues[eAnisotropic];
-        surface.specularTint       = materialResource->scalarAttributeValues[eSpecularTint];
-        surface.roughness          = materialResource->scalarAttributeValues[eRoughness];
-        surface.metallic           = Saturate(materialResource->scalarAttributeValues[eMetallic]);
-        surface.scatterDistance    = materialResource->scalarAttributeValues[eScatterDistance];
-        surface.ior                = materialResource->scalarAttributeValues[eIor];
-        surface.lightSetIndex      = modelData->lightSetIndex;
-
-        surface.shader = materialResource->shader;
+        SetMaterialParameters(modelData, surface);
         surface.view = hit->view;
 
         // -- better way to handle this would be for the ray to know what IOR it is within
@@ -314,24 +324,7 @@ namespace Selas
         surface.worldToTangent     = MatrixTranspose(tangentToWorld);
         surface.position           = hit->position;
         surface.error              = hit->error;
-        surface.materialFlags      = materialResource->flags;
-        surface.transmittanceColor = materialResource->transmittanceColor;
-        surface.sheen              = materialResource->scalarAttributeValues[eSheen];
-        surface.sheenTint          = materialResource->scalarAttributeValues[eSheenTint];
-        surface.clearcoat          = materialResource->scalarAttributeValues[eClearcoat];
-        surface.clearcoatGloss     = materialResource->scalarAttributeValues[eClearcoatGloss];
-        surface.specTrans          = Saturate(materialResource->scalarAttributeValues[eSpecTrans]);
-        surface.diffTrans          = materialResource->scalarAttributeValues[eDiffuseTrans] * 0.5f;
-        surface.flatness           = materialResource->scalarAttributeValues[eFlatness];
-        surface.anisotropic        = materialResource->scalarAttributeValues[eAnisotropic];
-        surface.specularTint       = materialResource->scalarAttributeValues[eSpecularTint];
-        surface.roughness          = materialResource->scalarAttributeValues[eRoughness];
-        surface.metallic           = Saturate(materialResource->scalarAttributeValues[eMetallic]);
-        surface.scatterDistance    = materialResource->scalarAttributeValues[eScatterDistance];
-        surface.ior                = materialResource->scalarAttributeValues[eIor];
-        surface.lightSetIndex      = modelData->lightSetIndex;
-
-        surface.shader = materialResource->shader;
+        SetMaterialParameters(modelData, surface);
         surface.view = hit->view;
 
         // -- better way to handle this would be for the ray to know what IOR it is within
@@ -341,6 +334,141 @@ namespace Selas
         return true;
     }
 
+    //=============================================================================================================================
+    static void InterpolateAttribute(const ModelGeometryUserData* modelData, SurfaceAttributePack& pack, uint32 slot,
+                                     uint32 valueCount, float* values)
+    {
+        RTCInterpolateNArguments args;
+        Memory::Zero(&args, sizeof(args));
+        args.geometry   = modelData->rtcGeometry;
+        args.valid      = pack.valid;
+        args.primIDs    = pack.primIds;
+        args.u          = pack.u;
+        args.v          = pack.v;
+        args.N          = pack.count;
+        args.bufferType = RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE;
+        args.bufferSlot = slot;
+        args.P          = values;
+        args.valueCount = valueCount;
+
+        rtcInterpolateN(&args);
+    }
+
+    //=============================================================================================================================
+    void InterpolateSurfaceAttributes(const ModelGeometryUserData* modelData, const HitParameters* __restrict hits, uint count,
+                                      SurfaceAttributePack& pack)
+    {
+        Assert_(count <= SurfacePackLaneCount_);
+
+        pack.count = (uint32)count;
+        for(uint scan = 0; scan < count; ++scan) {
+            pack.valid[scan]   = -1;
+            pack.primIds[scan] = (uint32)hits[scan].primId;
+            pack.u[scan]       = hits[scan].baryCoords.x;
+            pack.v[scan]       = hits[scan].baryCoords.y;
+        }
+
+        // -- Results are laid out with a stride of count rather than SurfacePackLaneCount_.
+        if(modelData->flags & HasNormals) {
+            InterpolateAttribute(modelData, pack, 0, 3, pack.normals);
+        }
+        if(modelData->flags & HasTangents) {
+            InterpolateAttribute(modelData, pack, 1, 4, pack.tangents);
+        }
+        if(modelData->flags & HasUvs) {
+            InterpolateAttribute(modelData, pack, 2, 2, pack.uvs);
+        }
+    }
+
+    //=============================================================================================================================
+    void CalculateSurfaceParamsBatch(const GIIntegratorContext* context, const HitParameters* __restrict hits, uint count,
+                                     ModelGeometryUserData* modelData, float4x4 localToWorld, Ptex::PtexFilter* filter,
+                                     SurfaceParameters* surfaces)
+    {
+        TextureCache* textureCache = context->textureCache;
+        const MaterialResourceData* materialResource = modelData->material;
+
+        // -- Everything that only depends on the material is set up once and copied to each hit.
+        SurfaceParameters material;
+        SetMaterialParameters(modelData, material);
+
+        bool usesPtex = (materialResource->flags & eUsesPtex) != 0;
+        const TextureResource* baseColorTexture = nullptr;
+        if(usesPtex == false) {
+            baseColorTexture = textureCache->FetchTexture(modelData->baseColorTextureHandle);
+        }
+
+        bool needsGeometry = modelData->flags & (HasNormals | HasTangents | HasUvs);
+        if(needsGeometry) {
+            context->geometryCache->EnsureSubsceneGeometryLoaded(modelData->subscene);
+        }
+
+        SurfaceAttributePack pack;
+        for(uint packStart = 0; packStart < count; packStart += SurfacePackLaneCount_) {
+            uint packCount = Min<uint>(count - packStart, SurfacePackLaneCount_);
+            const HitParameters* packHits = hits + packStart;
+
+            InterpolateSurfaceAttributes(modelData, packHits, packCount, pack);
+
+            for(uint lane = 0; lane < packCount; ++lane) {
+                const HitParameters* hit = packHits + lane;
+                SurfaceParameters& surface = surfaces[packStart + lane];
+
+                float3 normal = hit->normal;
+                if(modelData->flags & HasNormals) {
+                    normal = float3(pack.normals[lane], pack.normals[packCount + lane], pack.normals[2 * packCount + lane]);
+                }
+
+                float3 n = Normalize(MatrixMultiplyVector(normal, localToWorld));
+                float3 t, b;
+
+                if(modelData->flags & HasTangents) {
+                    float3 localTangent = float3(pack.tangents[lane], pack.tangents[packCount + lane],
+                                                 pack.tangents[2 * packCount + lane]);
+                    float handedness = pack.tangents[3 * packCount + lane];
+
+                    t = MatrixMultiplyVector(localTangent, localToWorld);
+                    b = Cross(n, t) * handedness;
+                }
+                else {
+                    MakeOrthogonalCoordinateSystem(n, &t, &b);
+                }
+
+                float2 uvs = float2(0.0f, 0.0f);
+                if(modelData->flags & HasUvs) {
+                    uvs = float2(pack.uvs[lane], pack.uvs[packCount + lane]);
+                }
+
+                surface = material;
+
+                if(usesPtex) {
+                    float3 sample;
+                    filter->eval(&sample.x, 0, 3, hit->primId, hit->baryCoords.x, hit->baryCoords.y, 0, 0, 0, 0);
+                    surface.baseColor = Pow(sample, 2.2f);
+                }
+                else {
+                    surface.baseColor = SampleTextureFloat3(baseColorTexture, uvs, true, materialResource->baseColor);
+                    surface.baseColor = Pow(surface.baseColor, 2.2f);
+                }
+
+                surface.worldToTangent = MatrixTranspose(MakeFloat3x3(t, n, b));
+                surface.position       = hit->position;
+                surface.error          = hit->error;
+                surface.view           = hit->view;
+                surface.relativeIOR    = ((materialResource->flags & eTransparent) && Dot(hit->view, n) < 0.0f)
+                                       ? surface.ior : 1.0f / surface.ior;
+            }
+        }
+
+        if(needsGeometry) {
+            context->geometryCache->FinishUsingSubceneGeometry(modelData->subscene);
+        }
+
+        if(usesPtex == false) {
+            textureCache->ReleaseTexture(modelData->baseColorTextureHandle);
+        }
+    }
+
     //=============================================================================================================================
     bool CalculatePassesAlphaTest(const ModelGeometryUserData* geomData, uint32 geomId, uint32 primId, float2 baryCoords)
     {
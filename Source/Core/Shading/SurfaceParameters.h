@@ -48,11 +48,35 @@ namespace Selas
         uint32 lightSetIndex;
     };
 
+    #define SurfacePackLaneCount_ 64
+
+    // -- Vertex attributes interpolated for a run of hits on one geometry. Each attribute is stored component by component so
+    // -- rtcInterpolateN writes it in a single call. Lane i's normal is (normals[i], normals[count + i], normals[2 * count + i]).
+    struct SurfaceAttributePack
+    {
+        uint32 count;
+        Align_(64) int32  valid[SurfacePackLaneCount_];
+        Align_(64) uint32 primIds[SurfacePackLaneCount_];
+        Align_(64) float  u[SurfacePackLaneCount_];
+        Align_(64) float  v[SurfacePackLaneCount_];
+        Align_(64) float  normals[3 * SurfacePackLaneCount_];
+        Align_(64) float  tangents[4 * SurfacePackLaneCount_];
+        Align_(64) float  uvs[2 * SurfacePackLaneCount_];
+    };
+
     bool CalculateSurfaceParams(const GIIntegratorContext* context, const HitParameters* hit, SurfaceParameters& surface);
     bool CalculateSurfaceParams(const GIIntegratorContext* context, const HitParameters* hit,
                                 ModelGeometryUserData* modelData, float4x4 localToWorld, Ptex::PtexFilter* filter,
                                 SurfaceParameters& surface);
 
+    // -- Every hit must be on the geometry described by modelData. The subscene is acquired once and attributes for up to
+    // -- SurfacePackLaneCount_ hits are interpolated per rtcInterpolateN call.
+    void InterpolateSurfaceAttributes(const ModelGeometryUserData* modelData, const HitParameters* hits, uint count,
+                                      SurfaceAttributePack& pack);
+    void CalculateSurfaceParamsBatch(const GIIntegratorContext* context, const HitParameters* hits, uint count,
+                                     ModelGeometryUserData* modelData, float4x4 localToWorld, Ptex::PtexFilter* filter,
+                                     SurfaceParameters* surfaces);
+
     bool CalculatePassesAlphaTest(const ModelGeometryUserData* geomData, uint32 geomId, uint32 primitiveId, float2 baryCoords);
     float CalculateDisplacement(const ModelGeometryUserData* geomData, RTCGeometry rtcGeometry, uint32 primId, float2 barys);
 
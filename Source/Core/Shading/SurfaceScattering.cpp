@@ -59,4 +59,59 @@ namespace Selas
 
         return float3::Zero_;
     }
+
+    //=============================================================================================================================
+    static void FlushWideLanes(const SurfaceParameters* const* surfaces, const float3* v, const float3* l, const uint* indices,
+                               uint count, float3* reflectance, float* forwardPdf, float* reversePdf)
+    {
+        float3 laneReflectance[DisneyWideLaneCount_];
+        float laneForwardPdf[DisneyWideLaneCount_];
+        float laneReversePdf[DisneyWideLaneCount_];
+        EvaluateDisneyWide(surfaces, v, l, count, laneReflectance, laneForwardPdf, laneReversePdf);
+
+        for(uint lane = 0; lane < count; ++lane) {
+            reflectance[indices[lane]] = laneReflectance[lane];
+            forwardPdf[indices[lane]] = laneForwardPdf[lane];
+            reversePdf[indices[lane]] = laneReversePdf[lane];
+        }
+    }
+
+    //=============================================================================================================================
+    void EvaluateBsdfBatch(const SurfaceParameters* surfaces, const float3* v, const float3* l, uint count,
+                           float3* reflectance, float* forwardPdf, float* reversePdf)
+    {
+        const SurfaceParameters* laneSurfaces[DisneyWideLaneCount_];
+        float3 laneV[DisneyWideLaneCount_];
+        float3 laneL[DisneyWideLaneCount_];
+        uint laneIndices[DisneyWideLaneCount_];
+        uint laneCount = 0;
+
+        for(uint scan = 0; scan < count; ++scan) {
+            #if LambertAllTheThings_
+                bool wide = false;
+            #else
+                bool wide = CanEvaluateDisneyWide(surfaces[scan]);
+            #endif
+
+            if(wide == false) {
+                reflectance[scan] = EvaluateBsdf(surfaces[scan], v[scan], l[scan], forwardPdf[scan], reversePdf[scan]);
+                continue;
+            }
+
+            laneSurfaces[laneCount] = &surfaces[scan];
+            laneV[laneCount] = v[scan];
+            laneL[laneCount] = l[scan];
+            laneIndices[laneCount] = scan;
+            ++laneCount;
+
+            if(laneCount == DisneyWideLaneCount_) {
+                FlushWideLanes(laneSurfaces, laneV, laneL, laneIndices, laneCount, reflectance, forwardPdf, reversePdf);
+                laneCount = 0;
+            }
+        }
+
+        if(laneCount > 0) {
+            FlushWideLanes(laneSurfaces, laneV, laneL, laneIndices, laneCount, reflectance, forwardPdf, reversePdf);
+        }
+    }
 }
\ No newline at end of file
@@ -6,6 +6,7 @@
 
 #include "Shading/Scattering.h"
 #include "MathLib/FloatStructs.h"
+#include "SystemLib/BasicTypes.h"
 
 namespace Selas
 {
@@ -14,4 +15,8 @@ namespace Selas
 
     bool SampleBsdfFunction(CSampler* sampler, const SurfaceParameters& surface, float3 v, BsdfSample& sample);
     float3 EvaluateBsdf(const SurfaceParameters& surface, float3 v, float3 l, float& forwardPdf, float& reversePdf);
+
+    // -- EvaluateBsdf for count surfaces. Surfaces the wide Disney path supports are gathered and evaluated eight at a time.
+    void EvaluateBsdfBatch(const SurfaceParameters* surfaces, const float3* v, const float3* l, uint count,
+                           float3* reflectance, float* forwardPdf, float* reversePdf);
 }
\ No newline at end of file
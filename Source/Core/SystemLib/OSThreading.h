@@ -9,6 +9,7 @@
 namespace Selas
 {
     #define CacheLineSize_ 64
+    #define SpinBackoffPauseLimit_ 6
 
     // Events
     // -- These are not well supported by linux and they are unused for this project so disabling them for now.
@@ -35,4 +36,11 @@ namespace Selas
 
     // Sleep
     void     Sleep(uint sleepTimeMs);
+    void     YieldThread(void);
+
+    // -- Call repeatedly while waiting on another thread. Starts with short pause loops and falls back to yielding the thread.
+    void     SpinBackoff(uint32& attempt);
+
+    // -- Number of logical processors available to the process.
+    uint     HardwareThreadCount(void);
 }
\ No newline at end of file
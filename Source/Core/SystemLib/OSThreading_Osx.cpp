@@ -11,6 +11,8 @@
 #include <pthread.h>
 #include <dispatch/dispatch.h>
 #include <unistd.h>
+#include <sched.h>
+#include <xmmintrin.h>
 
 namespace Selas
 {
@@ -134,6 +136,33 @@ namespace Selas
     {
         usleep((useconds_t)(sleepTimeMs * 1000));
     }
+
+    //=============================================================================================================================
+    void YieldThread(void)
+    {
+        sched_yield();
+    }
+
+    //=============================================================================================================================
+    void SpinBackoff(uint32& attempt)
+    {
+        if(attempt < SpinBackoffPauseLimit_) {
+            for(uint32 scan = 0, count = 1u << attempt; scan < count; ++scan) {
+                _mm_pause();
+            }
+            ++attempt;
+        }
+        else {
+            YieldThread();
+        }
+    }
+
+    //=============================================================================================================================
+    uint HardwareThreadCount(void)
+    {
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        return count > 0 ? (uint)count : 1;
+    }
 }
 
 #endif
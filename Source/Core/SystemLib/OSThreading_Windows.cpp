@@ -132,6 +132,34 @@ namespace Selas
     {
         ::Sleep((DWORD)sleepTimeMs);
     }
+
+    //=============================================================================================================================
+    void YieldThread(void)
+    {
+        ::SwitchToThread();
+    }
+
+    //=============================================================================================================================
+    void SpinBackoff(uint32& attempt)
+    {
+        if(attempt < SpinBackoffPauseLimit_) {
+            for(uint32 scan = 0, count = 1u << attempt; scan < count; ++scan) {
+                YieldProcessor();
+            }
+            ++attempt;
+        }
+        else {
+            YieldThread();
+        }
+    }
+
+    //=============================================================================================================================
+    uint HardwareThreadCount(void)
+    {
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+        return (uint)systemInfo.dwNumberOfProcessors;
+    }
 }
 
 #endif
@@ -3,6 +3,12 @@
 //=================================================================================================================================
 
 #include "SystemLib/Profiling.h"
+#include "SystemLib/MemoryAllocation.h"
+#include "SystemLib/Atomic.h"
+#include "SystemLib/JsAssert.h"
+
+#include <chrono>
+#include <stdio.h>
 
 #if USE_PIX
     #define WIN32_LEAN_AND_MEAN
@@ -24,7 +30,221 @@ namespace Selas
     {
         PIXEndEvent();
     }
-#else
-
 #endif
+
+    static_assert((ProfilerRingCapacity_ & (ProfilerRingCapacity_ - 1)) == 0, "Ring capacity must be a power of two");
+
+    struct ProfilerEvent
+    {
+        cpointer name;
+        uint64   start;
+        uint64   end;
+    };
+
+    struct ProfilerRing
+    {
+        // -- Total events recorded. Only the owning thread writes it.
+        uint64         head;
+        ProfilerEvent* events;
+    };
+
+    static ProfilerRing*   rings[ProfilerMaxThreads_];
+    static volatile int64  ringCount;
+    static volatile int64  generation;
+    static volatile bool   enabled;
+    static uint64          epoch;
+    static volatile uint64 droppedThreadEvents;
+
+    static thread_local ProfilerRing* threadRing = nullptr;
+    static thread_local int64         threadGeneration = 0;
+
+    //=============================================================================================================================
+    static ProfilerRing* AcquireThreadRing()
+    {
+        if(threadGeneration == generation) {
+            return threadRing;
+        }
+
+        threadGeneration = generation;
+        threadRing = nullptr;
+
+        int64 index = Atomic::Increment64(&ringCount);
+        if(index >= ProfilerMaxThreads_) {
+            return nullptr;
+        }
+
+        // -- Rings are kept around between runs. Slots are only ever claimed by one thread per generation.
+        if(rings[index] == nullptr) {
+            ProfilerRing* ring = New_(ProfilerRing);
+            ring->events = AllocArray_(ProfilerEvent, ProfilerRingCapacity_);
+            rings[index] = ring;
+        }
+
+        rings[index]->head = 0;
+        threadRing = rings[index];
+
+        return threadRing;
+    }
+
+    //=============================================================================================================================
+    static FILE* OpenTraceFile(cpointer filepath)
+    {
+        FILE* result = nullptr;
+
+        #if IsWindows_
+            fopen_s(&result, filepath, "w");
+        #elif IsOsx_
+            result = fopen(filepath, "w");
+        #endif
+
+        return result;
+    }
+
+    //=============================================================================================================================
+    void Profiler_Start(void)
+    {
+        ringCount = 0;
+        droppedThreadEvents = 0;
+        epoch = Profiler_Timestamp();
+        Atomic::Increment64(&generation);
+        enabled = true;
+    }
+
+    //=============================================================================================================================
+    void Profiler_Stop(void)
+    {
+        enabled = false;
+    }
+
+    //=============================================================================================================================
+    void Profiler_Shutdown(void)
+    {
+        enabled = false;
+        Atomic::Increment64(&generation);
+
+        for(uint scan = 0; scan < ProfilerMaxThreads_; ++scan) {
+            if(rings[scan] != nullptr) {
+                Free_(rings[scan]->events);
+                Delete_(rings[scan]);
+                rings[scan] = nullptr;
+            }
+        }
+        ringCount = 0;
+    }
+
+    //=============================================================================================================================
+    uint64 Profiler_Timestamp(void)
+    {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+    }
+
+    //=============================================================================================================================
+    void Profiler_RecordEvent(cpointer name, uint64 start, uint64 end)
+    {
+        if(enabled == false) {
+            return;
+        }
+
+        ProfilerRing* ring = AcquireThreadRing();
+        if(ring == nullptr) {
+            Atomic::AddU64(&droppedThreadEvents, 1);
+            return;
+        }
+
+        ProfilerEvent& event = ring->events[ring->head & (ProfilerRingCapacity_ - 1)];
+        event.name  = name;
+        event.start = start;
+        event.end   = end;
+
+        ++ring->head;
+    }
+
+    //=============================================================================================================================
+    static void WriteJsonString(FILE* file, cpointer text)
+    {
+        fputc('"', file);
+        for(cpointer scan = text; *scan != '\0'; ++scan) {
+            char c = *scan;
+            if(c == '"' || c == '\\') {
+                fputc('\\', file);
+                fputc(c, file);
+            }
+            else if((uint8)c < 0x20) {
+                fprintf(file, "\\u%04x", (uint32)(uint8)c);
+            }
+            else {
+                fputc(c, file);
+            }
+        }
+        fputc('"', file);
+    }
+
+    //=============================================================================================================================
+    Error Profiler_WriteChromeTrace(cpointer filepath, const ProfilerCounter* counters, uint counterCount)
+    {
+        FILE* file = OpenTraceFile(filepath);
+        if(file == nullptr) {
+            return Error_("Failed to open file: %s", filepath);
+        }
+
+        fprintf(file, "{\n\"traceEvents\": [\n");
+
+        uint64 threadCount = (uint64)ringCount < ProfilerMaxThreads_ ? (uint64)ringCount : ProfilerMaxThreads_;
+        uint64 overwrittenEvents = 0;
+        bool first = true;
+
+        for(uint64 thread = 0; thread < threadCount; ++thread) {
+            const ProfilerRing* ring = rings[thread];
+
+            fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %llu, "
+                          "\"args\": {\"name\": \"Thread %llu\"}}", first ? "" : ",\n", thread, thread);
+            first = false;
+
+            uint64 count = ring->head < ProfilerRingCapacity_ ? ring->head : ProfilerRingCapacity_;
+            overwrittenEvents += ring->head - count;
+
+            for(uint64 scan = ring->head - count; scan < ring->head; ++scan) {
+                const ProfilerEvent& event = ring->events[scan & (ProfilerRingCapacity_ - 1)];
+
+                // -- Events from before the last Profiler_Start can't be in here since the ring was reset but clamp anyway.
+                uint64 start = event.start > epoch ? event.start - epoch : 0;
+                uint64 duration = event.end > event.start ? event.end - event.start : 0;
+
+                fprintf(file, ",\n{\"name\": ");
+                WriteJsonString(file, event.name);
+                fprintf(file, ", \"ph\": \"X\", \"pid\": 0, \"tid\": %llu, \"ts\": %.3f, \"dur\": %.3f}", thread, start * 1e-3,
+                        duration * 1e-3);
+            }
+        }
+
+        fprintf(file, "\n],\n\"otherData\": {\n");
+        fprintf(file, "\"overwrittenEvents\": %llu,\n\"droppedThreadEvents\": %llu", overwrittenEvents, droppedThreadEvents);
+        for(uint scan = 0; scan < counterCount; ++scan) {
+            fprintf(file, ",\n");
+            WriteJsonString(file, counters[scan].name);
+            fprintf(file, ": %f", counters[scan].value);
+        }
+        fprintf(file, "\n}\n}\n");
+
+        fclose(file);
+
+        return Success_;
+    }
+
+    //=============================================================================================================================
+    ScopedProfileTimer::ScopedProfileTimer(cpointer name_)
+        : name(name_)
+        , start(enabled ? Profiler_Timestamp() : 0)
+    {
+
+    }
+
+    //=============================================================================================================================
+    ScopedProfileTimer::~ScopedProfileTimer()
+    {
+        if(start != 0) {
+            Profiler_RecordEvent(name, start, Profiler_Timestamp());
+        }
+    }
 }
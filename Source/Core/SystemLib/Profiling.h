@@ -4,6 +4,7 @@
 // Joe Schutte
 //=================================================================================================================================
 
+#include "SystemLib/Error.h"
 #include "SystemLib/BasicTypes.h"
 
 namespace Selas
@@ -20,5 +21,44 @@ namespace Selas
     #else
         #define ProfileEventMarker_(color, name)
     #endif
-    
+
+    // -- Portable timeline profiler. Each thread records scoped events into its own ring buffer so recording never takes a
+    // -- lock. Once a ring is full its oldest events are overwritten. Nothing is recorded until Profiler_Start is called and
+    // -- event names must outlive the profiler since only the pointer is stored.
+    #define ProfilerMaxThreads_    64
+    #define ProfilerRingCapacity_  (64 * 1024)
+
+    struct ProfilerCounter
+    {
+        cpointer name;
+        double   value;
+    };
+
+    // -- Discards anything recorded so far. Threads that recorded before this get a fresh ring on their next event.
+    void   Profiler_Start(void);
+    void   Profiler_Stop(void);
+    void   Profiler_Shutdown(void);
+
+    // -- Nanoseconds from a monotonic clock.
+    uint64 Profiler_Timestamp(void);
+    void   Profiler_RecordEvent(cpointer name, uint64 start, uint64 end);
+
+    // -- Writes every recorded event in the Chrome trace event format for chrome://tracing or Perfetto. The counters are
+    // -- written to the otherData section. Only call this once the threads that recorded events have finished.
+    Error  Profiler_WriteChromeTrace(cpointer filepath, const ProfilerCounter* counters, uint counterCount);
+
+    class ScopedProfileTimer
+    {
+    private:
+        cpointer name;
+        uint64   start;
+
+    public:
+        ScopedProfileTimer(cpointer name);
+        ~ScopedProfileTimer();
+    };
+
+    #define ProfileConcatInner_(a, b) a##b
+    #define ProfileConcat_(a, b)      ProfileConcatInner_(a, b)
+    #define ProfileScope_(name)       ScopedProfileTimer ProfileConcat_(profileScope_, __LINE__)(name)
 }
\ No newline at end of file
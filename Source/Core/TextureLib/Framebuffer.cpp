@@ -11,11 +11,26 @@
 #include "IoLib/Directory.h"
 #include "SystemLib/MemoryAllocation.h"
 #include "SystemLib/Memory.h"
+#include "SystemLib/MinMax.h"
+#include "SystemLib/JsAssert.h"
+
+// -- Marks staged samples that a partial tile flush already accumulated.
+#define FlushedSampleIndex_ 0xFFFFFFFF
+// -- New samples a writer stages before retrying a tile flush that hit a contended lock. Each retry re-sorts every staged
+// -- sample over all lock tiles so it must not run on every write.
+#define FlushRetrySampleCount_ 64
 
 namespace Selas
 {
     //=============================================================================================================================
-    void FrameBuffer_Initialize(Framebuffer* frame, uint32 width, uint32 height, uint32 layerCount)
+    static float Luminance(float3 rgb)
+    {
+        // -- Rec. 709 weights, which match the linear sRGB primaries the renderer works in.
+        return rgb.x * 0.2126f + rgb.y * 0.7152f + rgb.z * 0.0722f;
+    }
+
+    //=============================================================================================================================
+    void FrameBuffer_Initialize(Framebuffer* frame, uint32 width, uint32 height, uint32 layerCount, uint32 flags)
     {
         CreateSpinLock(frame->spinlock);
 
@@ -28,6 +43,28 @@ namespace Selas
             frame->buffers[scan] = AllocArrayAligned_(float3, width * height, 16);
             Memory::Zero(frame->buffers[scan], sizeof(float3) * width * height);
         }
+
+        frame->secondMoments = nullptr;
+        frame->sampleCounts = nullptr;
+        if(flags & eFramebufferTrackVariance) {
+            frame->secondMoments = AllocArrayAligned_(float, width * height, 16);
+            frame->sampleCounts = AllocArrayAligned_(uint32, width * height, 16);
+            Memory::Zero(frame->secondMoments, sizeof(float) * width * height);
+            Memory::Zero(frame->sampleCounts, sizeof(uint32) * width * height);
+        }
+
+        frame->lockTilesX = 0;
+        frame->lockTileCount = 0;
+        frame->tileLocks = nullptr;
+        if(flags & eFramebufferTileLocks) {
+            uint32 tilesY = (height + FramebufferLockTileSize_ - 1) / FramebufferLockTileSize_;
+            frame->lockTilesX = (width + FramebufferLockTileSize_ - 1) / FramebufferLockTileSize_;
+            frame->lockTileCount = frame->lockTilesX * tilesY;
+            frame->tileLocks = AllocArrayAligned_(uint8, frame->lockTileCount * CacheLineSize_, CacheLineSize_);
+            for(uint scan = 0; scan < frame->lockTileCount; ++scan) {
+                CreateSpinLock(frame->tileLocks + scan * CacheLineSize_);
+            }
+        }
     }
 
     //=============================================================================================================================
@@ -37,10 +74,14 @@ namespace Selas
             FreeAligned_(frame->buffers[scan]);
         }
         Free_(frame->buffers);
+
+        SafeFreeAligned_(frame->secondMoments);
+        SafeFreeAligned_(frame->sampleCounts);
+        SafeFreeAligned_(frame->tileLocks);
     }
 
     //=============================================================================================================================
-    void FrameBuffer_Save(Framebuffer* frame, cpointer name)
+    void FrameBuffer_Save(Framebuffer* frame, cpointer name, float scale)
     {
         FixedString128 root = Environment_Root();
         uint8 pathsep = StringUtil::PathSeperator();
@@ -50,11 +91,29 @@ namespace Selas
 
         Directory::EnsureDirectoryExists(dirpath.Ascii());
 
+        uint pixelCount = frame->width * frame->height;
+        float3* scaled = nullptr;
+        if(scale != 1.0f) {
+            scaled = AllocArrayAligned_(float3, pixelCount, 16);
+        }
+
         for(uint32 scan = 0, count = frame->layerCount; scan < count; ++scan) {
             FilePathString filepath;
             FixedStringSprintf(filepath, "%s%s_%u.hdr", dirpath.Ascii(), name, scan);
 
-            StbImageWrite(filepath.Ascii(), frame->width, frame->height, 3, HDR, frame->buffers[scan]);
+            float3* pixels = frame->buffers[scan];
+            if(scaled != nullptr) {
+                for(uint index = 0; index < pixelCount; ++index) {
+                    scaled[index] = frame->buffers[scan][index] * scale;
+                }
+                pixels = scaled;
+            }
+
+            StbImageWrite(filepath.Ascii(), frame->width, frame->height, 3, HDR, pixels);
+        }
+
+        if(scaled != nullptr) {
+            FreeAligned_(scaled);
         }
     }
 
@@ -69,16 +128,113 @@ namespace Selas
         }
     }
 
+    //=============================================================================================================================
+    void FrameBuffer_Normalize(Framebuffer* __restrict frame)
+    {
+        Assert_(frame->sampleCounts != nullptr);
+
+        uint indexcount = frame->width * frame->height;
+        for(uint scan = 0; scan < indexcount; ++scan) {
+            uint32 sampleCount = frame->sampleCounts[scan];
+            if(sampleCount == 0) {
+                continue;
+            }
+
+            float term = 1.0f / sampleCount;
+            for(uint layer = 0; layer < frame->layerCount; ++layer) {
+                frame->buffers[layer][scan] = frame->buffers[layer][scan] * term;
+            }
+        }
+    }
+
+    //=============================================================================================================================
+    float FrameBuffer_RelativeVariance(const Framebuffer* frame, uint32 x0, uint32 y0, uint32 x1, uint32 y1)
+    {
+        Assert_(frame->sampleCounts != nullptr);
+        Assert_(x1 <= frame->width && y1 <= frame->height);
+
+        // -- Keeps black pixels from dividing by zero without hiding noise on dim ones.
+        const float luminanceEpsilon = 1e-4f;
+
+        float total = 0.0f;
+        uint32 pixelCount = 0;
+        for(uint32 y = y0; y < y1; ++y) {
+            for(uint32 x = x0; x < x1; ++x) {
+                uint32 index = y * frame->width + x;
+                uint32 sampleCount = frame->sampleCounts[index];
+                ++pixelCount;
+
+                if(sampleCount < 2) {
+                    total += FloatMax_;
+                    continue;
+                }
+
+                float3 sum = float3::Zero_;
+                for(uint layer = 0; layer < frame->layerCount; ++layer) {
+                    sum = sum + frame->buffers[layer][index];
+                }
+
+                float n = (float)sampleCount;
+                float mean = Luminance(sum) / n;
+                float sampleVariance = Max<float>(frame->secondMoments[index] - n * mean * mean, 0.0f) / (n - 1.0f);
+                total += (sampleVariance / n) / (mean * mean + luminanceEpsilon);
+            }
+        }
+
+        return pixelCount > 0 ? total / pixelCount : 0.0f;
+    }
+
     //=============================================================================================================================
     void FramebufferWriter_Initialize(FramebufferWriter* writer, Framebuffer* frame, uint32 capacity, uint32 softCapacity)
     {
         writer->count = 0;
         writer->capacity = capacity;
         writer->softCapacity = softCapacity;
+        writer->retryCount = softCapacity;
         writer->framebuffer = frame;
 
         writer->sampleIndices = AllocArrayAligned_(uint32, capacity, 16);
         writer->samples = AllocArrayAligned_(float3, frame->layerCount * capacity, 16);
+
+        writer->tileOffsets = nullptr;
+        writer->sampleOrder = nullptr;
+        if(frame->tileLocks != nullptr) {
+            writer->tileOffsets = AllocArray_(uint32, (frame->lockTileCount + 1));
+            writer->sampleOrder = AllocArray_(uint32, capacity);
+        }
+    }
+
+    //=============================================================================================================================
+    static uint32 LockTileIndex(const Framebuffer* frame, uint32 index)
+    {
+        uint32 y = index / frame->width;
+        uint32 x = index - y * frame->width;
+        return (y / FramebufferLockTileSize_) * frame->lockTilesX + (x / FramebufferLockTileSize_);
+    }
+
+    //=============================================================================================================================
+    void FrameBuffer_AddSample(Framebuffer* __restrict frame, uint32 index, const float3* samples, uint32 layerCount)
+    {
+        Assert_(layerCount == frame->layerCount);
+
+        float3 sum = float3::Zero_;
+        for(uint layer = 0; layer < layerCount; ++layer) {
+            frame->buffers[layer][index] += samples[layer];
+            sum = sum + samples[layer];
+        }
+
+        if(frame->sampleCounts != nullptr) {
+            float luminance = Luminance(sum);
+            frame->secondMoments[index] += luminance * luminance;
+            ++frame->sampleCounts[index];
+        }
+    }
+
+    //=============================================================================================================================
+    static void AccumulateSample(Framebuffer* __restrict frame, FramebufferWriter* __restrict writer, uint32 sample)
+    {
+        uint layerCount = frame->layerCount;
+        FrameBuffer_AddSample(frame, writer->sampleIndices[sample], writer->samples + layerCount * sample, layerCount);
     }
 
     //=============================================================================================================================
@@ -86,18 +242,87 @@ namespace Selas
     {
         Assert_(*writer->framebuffer->spinlock == 1);
 
-        uint layerCount = writer->framebuffer->layerCount;
+        Framebuffer* frame = writer->framebuffer;
+        for(uint32 scan = 0, count = writer->count; scan < count; ++scan) {
+            AccumulateSample(frame, writer, scan);
+        }
+        
+        writer->count = 0;
+    }
 
+    //=============================================================================================================================
+    static void FlushTiles(FramebufferWriter* __restrict writer, bool wait)
+    {
         Framebuffer* frame = writer->framebuffer;
-        for(uint scan = 0, count = writer->count; scan < count; ++scan) {
-            uint32 index = writer->sampleIndices[scan];
+        uint32 tileCount = frame->lockTileCount;
+        uint32* offsets = writer->tileOffsets;
 
-            for(uint layer = 0; layer < layerCount; ++layer) {
-                frame->buffers[layer][index] += writer->samples[layerCount * scan + layer];
+        // -- Counting sort of the staged samples by tile so each tile lock is taken once per flush.
+        Memory::Zero(offsets, sizeof(uint32) * (tileCount + 1));
+        for(uint32 scan = 0, count = writer->count; scan < count; ++scan) {
+            ++offsets[LockTileIndex(frame, writer->sampleIndices[scan]) + 1];
+        }
+        for(uint32 tile = 0; tile < tileCount; ++tile) {
+            offsets[tile + 1] += offsets[tile];
+        }
+        for(uint32 scan = 0, count = writer->count; scan < count; ++scan) {
+            writer->sampleOrder[offsets[LockTileIndex(frame, writer->sampleIndices[scan])]++] = scan;
+        }
+
+        // -- The scatter left each offset at the end of its tile which is where the next tile starts.
+        uint32 start = 0;
+        bool skippedTile = false;
+        for(uint32 tile = 0; tile < tileCount; ++tile) {
+            uint32 end = offsets[tile];
+            if(start == end) {
+                continue;
+            }
+
+            uint8* lock = frame->tileLocks + tile * CacheLineSize_;
+            if(wait) {
+                EnterSpinLock(lock);
+            }
+            else if(TryEnterSpinLock(lock) == false) {
+                // -- Someone else is in this tile. Keep its samples staged and try again on a later flush.
+                skippedTile = true;
+                start = end;
+                continue;
+            }
+
+            for(uint32 scan = start; scan < end; ++scan) {
+                AccumulateSample(frame, writer, writer->sampleOrder[scan]);
+                writer->sampleIndices[writer->sampleOrder[scan]] = FlushedSampleIndex_;
             }
+            LeaveSpinLock(lock);
+
+            start = end;
         }
-        
-        writer->count = 0;
+
+        if(skippedTile == false) {
+            writer->count = 0;
+            writer->retryCount = writer->softCapacity;
+            return;
+        }
+
+        // -- Compact the samples that are still staged to the front keeping their order.
+        uint32 layerCount = frame->layerCount;
+        uint32 kept = 0;
+        for(uint32 scan = 0, count = writer->count; scan < count; ++scan) {
+            if(writer->sampleIndices[scan] == FlushedSampleIndex_) {
+                continue;
+            }
+
+            if(kept != scan) {
+                writer->sampleIndices[kept] = writer->sampleIndices[scan];
+                for(uint32 layer = 0; layer < layerCount; ++layer) {
+                    writer->samples[layerCount * kept + layer] = writer->samples[layerCount * scan + layer];
+                }
+            }
+            ++kept;
+        }
+
+        writer->count = kept;
+        writer->retryCount = Max<uint32>(writer->softCapacity, kept + FlushRetrySampleCount_);
     }
 
     //=============================================================================================================================
@@ -124,6 +349,14 @@ namespace Selas
         ++writer->count;
 
         if(writer->count > writer->softCapacity) {
+            // -- Past the soft capacity only take locks that are free. Writers block once the buffer is completely full.
+            if(writer->framebuffer->tileLocks != nullptr) {
+                if(writer->count > writer->retryCount) {
+                    FlushTiles(writer, false);
+                }
+                return;
+            }
+
             bool locked = TryEnterSpinLock(writer->framebuffer->spinlock);
             if(!locked) {
                 return;
@@ -137,6 +370,11 @@ namespace Selas
     //=============================================================================================================================
     void FramebufferWriter_Flush(FramebufferWriter* writer)
     {
+        if(writer->framebuffer->tileLocks != nullptr) {
+            FlushTiles(writer, true);
+            return;
+        }
+
         EnterSpinLock(writer->framebuffer->spinlock);
         FlushInternal(writer);
         LeaveSpinLock(writer->framebuffer->spinlock);
@@ -148,5 +386,7 @@ namespace Selas
         FramebufferWriter_Flush(writer);
         FreeAligned_(writer->samples);
         FreeAligned_(writer->sampleIndices);
+        SafeFree_(writer->tileOffsets);
+        SafeFree_(writer->sampleOrder);
     }
 }
\ No newline at end of file
@@ -13,6 +13,18 @@ namespace Selas
 {
     #define DefaultFrameWriterCapacity_     4096
     #define DefaultFrameWriterSoftCapacity_ 3840
+    #define FramebufferLockTileSize_        32
+
+    enum FramebufferFlags
+    {
+        // -- Every write counts as one sample and adds the squared luminance of all of its layers to the pixel's second
+        // -- moment. Required by FrameBuffer_Normalize and FrameBuffer_RelativeVariance.
+        eFramebufferTrackVariance = 0x1,
+
+        // -- Writers flush through one lock per FramebufferLockTileSize_ square tile rather than the framebuffer wide lock.
+        // -- Flushes from different threads only contend when they touch the same tiles.
+        eFramebufferTileLocks     = 0x2
+    };
 
     struct Framebuffer
     {
@@ -20,6 +32,16 @@ namespace Selas
         uint32  height;
         uint32  layerCount;
         float3** buffers;
+
+        // -- Only allocated with eFramebufferTrackVariance.
+        float*  secondMoments;
+        uint32* sampleCounts;
+
+        // -- Only allocated with eFramebufferTileLocks. Each lock has a cache line to itself.
+        uint32  lockTilesX;
+        uint32  lockTileCount;
+        uint8*  tileLocks;
+
         uint8 spinlock[CacheLineSize_];
     };
 
@@ -28,17 +50,33 @@ namespace Selas
         uint32  count;
         uint32  capacity;
         uint32  softCapacity;
-        uint32  pad;
+        // -- Staged count at which the next non-blocking flush is tried. Stays above softCapacity after a contended flush.
+        uint32  retryCount;
         uint32* sampleIndices;
         float3* samples;
         Framebuffer* framebuffer;
+
+        // -- Scratch used to group samples by lock tile when the framebuffer has tile locks.
+        uint32* tileOffsets;
+        uint32* sampleOrder;
     };
 
-    void FrameBuffer_Initialize(Framebuffer* frame, uint32 width, uint32 height, uint32 layerCount);
+    void FrameBuffer_Initialize(Framebuffer* frame, uint32 width, uint32 height, uint32 layerCount, uint32 flags = 0);
     void FrameBuffer_Shutdown(Framebuffer* frame);
-    void FrameBuffer_Save(Framebuffer* frame, cpointer name);
+    // -- Scale is applied to the saved image only. Lets progressive renders write snapshots while still accumulating.
+    void FrameBuffer_Save(Framebuffer* frame, cpointer name, float scale = 1.0f);
     void FrameBuffer_Scale(Framebuffer* frame, float value);
 
+    // -- The functions below require eFramebufferTrackVariance and must not run while writers are flushing.
+    // -- Divides every pixel by its own sample count. Use instead of FrameBuffer_Scale when pixels took different counts.
+    void FrameBuffer_Normalize(Framebuffer* frame);
+    // -- Mean over the pixels in [x0, x1) x [y0, y1) of the variance of each pixel's estimate relative to its squared
+    // -- luminance. Pixels with fewer than two samples count as unconverged.
+    float FrameBuffer_RelativeVariance(const Framebuffer* frame, uint32 x0, uint32 y0, uint32 x1, uint32 y1);
+
+    // -- Adds one sample straight to the framebuffer. Only safe when the caller is the only thread writing to that pixel.
+    void FrameBuffer_AddSample(Framebuffer* frame, uint32 index, const float3* samples, uint32 layerCount);
+
     void FramebufferWriter_Initialize(FramebufferWriter* writer, Framebuffer* frame,
                                       uint32 capacity = DefaultFrameWriterCapacity_,
                                       uint32 softCapacity = DefaultFrameWriterSoftCapacity_);
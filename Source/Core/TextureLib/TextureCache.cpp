@@ -200,4 +200,15 @@ namespace Selas
         Assert_(obj->second->usageRefCount != 0);
         Atomic::Decrement64(&obj->second->usageRefCount);
     }
+
+    //=============================================================================================================================
+    void TextureCache::PtexStats(PtexCacheStats& stats)
+    {
+        Ptex::PtexCache::Stats ptexStats;
+        cacheData->ptexCache->getStats(ptexStats);
+
+        stats.filesAccessed = ptexStats.filesAccessed;
+        stats.fileReopens = ptexStats.fileReopens;
+        stats.blockReads = ptexStats.blockReads;
+    }
 }
\ No newline at end of file
@@ -29,11 +29,21 @@ namespace Selas
         {
             return hash != rhs.hash;
         }
+
+        // -- Only meant for ordering work by texture. Invalid handles have a key of zero.
+        uint32 SortKey() const { return hash; }
     private:
         friend class TextureCache;
         Hash32 hash;
     };
 
+    struct PtexCacheStats
+    {
+        uint64 filesAccessed;
+        uint64 fileReopens;
+        uint64 blockReads;
+    };
+
     class TextureCache
     {
     private:
@@ -53,5 +63,7 @@ namespace Selas
         const TextureResource* FetchTexture(TextureHandle handle);
         Ptex::PtexTexture* FetchPtex(TextureHandle handle);
         void ReleaseTexture(TextureHandle handle);
+
+        void PtexStats(PtexCacheStats& stats);
    };
 }
\ No newline at end of file
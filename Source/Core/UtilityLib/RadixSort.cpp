@@ -0,0 +1,135 @@
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#include "UtilityLib/RadixSort.h"
+#include "SystemLib/Memory.h"
+#include "SystemLib/MemoryAllocation.h"
+#include "SystemLib/MinMax.h"
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+namespace Selas
+{
+    #define RadixBits_          8
+    #define RadixBucketCount_   (1 << RadixBits_)
+    #define RadixMinChunkSize_  (64 * 1024)
+    #define RadixMaxChunkCount_ 64
+
+    struct RadixPass
+    {
+        const uint64* input;
+        uint64* output;
+        uint64 count;
+        uint64 chunkSize;
+        uint32 shift;
+
+        // -- histograms is indexed [chunk][bucket]. After the prefix sum it holds the output offset for each chunk and bucket.
+        uint64 histograms[RadixMaxChunkCount_][RadixBucketCount_];
+    };
+
+    //=============================================================================================================================
+    struct RadixHistogramBody
+    {
+        RadixPass* pass;
+
+        void operator()(const tbb::blocked_range<uint>& range) const
+        {
+            for(uint chunk = range.begin(); chunk < range.end(); ++chunk) {
+                uint64* histogram = pass->histograms[chunk];
+                Memory::Zero(histogram, sizeof(pass->histograms[chunk]));
+
+                uint64 start = chunk * pass->chunkSize;
+                uint64 end = Min(start + pass->chunkSize, pass->count);
+                for(uint64 scan = start; scan < end; ++scan) {
+                    ++histogram[(pass->input[scan] >> pass->shift) & (RadixBucketCount_ - 1)];
+                }
+            }
+        }
+    };
+
+    //=============================================================================================================================
+    struct RadixScatterBody
+    {
+        RadixPass* pass;
+
+        void operator()(const tbb::blocked_range<uint>& range) const
+        {
+            for(uint chunk = range.begin(); chunk < range.end(); ++chunk) {
+                uint64* offsets = pass->histograms[chunk];
+
+                uint64 start = chunk * pass->chunkSize;
+                uint64 end = Min(start + pass->chunkSize, pass->count);
+                for(uint64 scan = start; scan < end; ++scan) {
+                    uint64 value = pass->input[scan];
+                    pass->output[offsets[(value >> pass->shift) & (RadixBucketCount_ - 1)]++] = value;
+                }
+            }
+        }
+    };
+
+    //=============================================================================================================================
+    void ParallelRadixSort(uint64* values, uint64* scratch, uint64 count, uint32 keyShift)
+    {
+        if(count < 2) {
+            return;
+        }
+
+        uint chunkCount = (uint)Clamp<uint64>(count / RadixMinChunkSize_, 1, RadixMaxChunkCount_);
+
+        RadixPass* pass = New_(RadixPass);
+        pass->count = count;
+        pass->chunkSize = (count + chunkCount - 1) / chunkCount;
+
+        RadixHistogramBody histogramBody;
+        histogramBody.pass = pass;
+        RadixScatterBody scatterBody;
+        scatterBody.pass = pass;
+
+        uint64* input = values;
+        uint64* output = scratch;
+
+        for(uint32 shift = keyShift; shift < 64; shift += RadixBits_) {
+            pass->input = input;
+            pass->output = output;
+            pass->shift = shift;
+
+            tbb::parallel_for(tbb::blocked_range<uint>(0, chunkCount, 1), histogramBody);
+
+            // -- Exclusive prefix sum ordered by bucket then chunk so the sort stays stable. If every value landed in the same
+            // -- bucket this digit doesn't change the order and the scatter can be skipped entirely.
+            bool singleBucket = false;
+            uint64 offset = 0;
+            for(uint bucket = 0; bucket < RadixBucketCount_; ++bucket) {
+                uint64 bucketCount = 0;
+                for(uint chunk = 0; chunk < chunkCount; ++chunk) {
+                    uint64 chunkBucketCount = pass->histograms[chunk][bucket];
+                    pass->histograms[chunk][bucket] = offset;
+                    offset += chunkBucketCount;
+                    bucketCount += chunkBucketCount;
+                }
+
+                if(bucketCount == count) {
+                    singleBucket = true;
+                }
+            }
+
+            if(singleBucket) {
+                continue;
+            }
+
+            tbb::parallel_for(tbb::blocked_range<uint>(0, chunkCount, 1), scatterBody);
+
+            uint64* temp = input;
+            input = output;
+            output = temp;
+        }
+
+        if(input != values) {
+            Memory::Copy(values, input, count * sizeof(uint64));
+        }
+
+        Delete_(pass);
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+//=================================================================================================================================
+// Joe Schutte
+//=================================================================================================================================
+
+#include "SystemLib/BasicTypes.h"
+
+namespace Selas
+{
+    // -- Stable LSD radix sort of values by bits [keyShift, 64). The bits below keyShift are carried along untouched which makes it
+    // -- easy to pack an index next to the key. Large inputs are split across TBB workers. scratch must hold count values.
+    void ParallelRadixSort(uint64* values, uint64* scratch, uint64 count, uint32 keyShift);
+
+    #define PermutedEntryBit_ (1ull << 63)
+
+    //=============================================================================================================================
+    template<typename Type_>
+    void ApplyPermutation(Type_* entries, uint64* indices, uint64 count)
+    {
+        // -- indices[i] holds the index of the entry that belongs at i. Apply that permutation in place by following its cycles
+        // -- rather than copying the whole array. Each index gets tagged with PermutedEntryBit_ once its entry is in place.
+        for(uint64 scan = 0; scan < count; ++scan) {
+            if(indices[scan] & PermutedEntryBit_) {
+                continue;
+            }
+
+            Type_ first = entries[scan];
+
+            uint64 dst = scan;
+            while(true) {
+                uint64 src = indices[dst];
+                indices[dst] |= PermutedEntryBit_;
+
+                if(src == scan) {
+                    entries[dst] = first;
+                    break;
+                }
+
+                entries[dst] = entries[src];
+                dst = src;
+            }
+        }
+    }
+}